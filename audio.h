@@ -42,7 +42,8 @@ typedef struct {
     uint8_t initial_length_timer;
     uint16_t frequency;
     uint16_t current_frequency;
-    uint8_t randomness;
+    uint8_t randomness;     /* ch4: LFSR width, 1 = 7-bit */
+    uint16_t lfsr_index;    /* ch4: position in the precomputed LFSR sequence */
     uint32_t phase_accumulator;
 } gbc_audio_channel;
 
@@ -0,0 +1,396 @@
+#include <string.h>
+#include "audio_log.h"
+#include "audio.h"
+#include "audio_synth.h"
+#include "common.h"
+#include "utils.h"
+
+/* https://gbdev.io/pandocs/Audio_Registers.html */
+typedef struct {
+    uint8_t length_port;
+    uint8_t dac_port;
+    uint8_t control_port;
+    uint8_t length_mask;
+    uint16_t max_length;
+} audio_channel_ports_t;
+
+static const audio_channel_ports_t channel_ports[AUDIO_CHANNELS] = {
+    {IO_PORT_NR11, IO_PORT_NR12, IO_PORT_NR14, LENGTH_MASK, 64},
+    {IO_PORT_NR21, IO_PORT_NR22, IO_PORT_NR24, LENGTH_MASK, 64},
+    {IO_PORT_NR31, IO_PORT_NR30, IO_PORT_NR34, CH3_LENGTH_MASK, 256},
+    {IO_PORT_NR41, IO_PORT_NR42, IO_PORT_NR44, LENGTH_MASK, 64},
+};
+
+/* bits that always read back as 1, NR10..NR52 */
+static const uint8_t read_masks[IO_PORT_NR52 - IO_PORT_NR10 + 1] = {
+    0x80, 0x3F, 0x00, 0xFF, 0xBF,
+    0xFF, 0x3F, 0x00, 0xFF, 0xBF,
+    0x7F, 0xFF, 0x9F, 0xFF, 0xBF,
+    0xFF, 0xFF, 0x00, 0x00, 0xBF,
+    0x00, 0x00, 0x70,
+};
+
+static uint8_t dac_enabled(gbc_memory_t *mem, int ch)
+{
+    uint8_t v = IO_PORT_READ(mem, channel_ports[ch].dac_port);
+    return ch == 2 ? (v & 0x80) != 0 : IS_DAC_ENABLED(v);
+}
+
+static uint16_t length_left(gbc_audio_shadow_channel_t *ch, uint64_t now)
+{
+    if (!ch->length_enabled)
+        return ch->length;
+
+    uint64_t clocks = now / AUDIO_LENGTH_CLOCK_CYCLES - ch->length_base / AUDIO_LENGTH_CLOCK_CYCLES;
+    return clocks >= ch->length ? 0 : ch->length - clocks;
+}
+
+static uint64_t sweep_clocks(uint64_t cycle)
+{
+    return (cycle + AUDIO_SWEEP_CLOCK_CYCLES / 2) / AUDIO_SWEEP_CLOCK_CYCLES;
+}
+
+static uint16_t sweep_next(uint8_t nr10, uint16_t freq)
+{
+    uint16_t delta = freq >> NR10_SHIFT(nr10);
+    return (nr10 & SWEEP_DIRECTION_MASK) ? freq - delta : freq + delta;
+}
+
+/* Runs the ch1 sweep up to 'now' with the current NR10, the way the synthesizer steps it.
+ * Only steps that change the frequency are iterated, so this is bounded by the 11-bit
+ * frequency range however long ago it was last brought up to date. */
+static void sweep_sync(gbc_audio_log_t *log, uint64_t now)
+{
+    gbc_audio_shadow_channel_t *ch = log->channels;
+    uint8_t nr10 = IO_PORT_READ(log->mem, IO_PORT_NR10);
+    uint8_t period = NR10_PACE(nr10) ? NR10_PACE(nr10) : 8;
+    uint64_t clocks = sweep_clocks(now) - sweep_clocks(ch->sweep_base);
+
+    ch->sweep_base = now;
+    while (clocks && ch->on) {
+        if (clocks < ch->sweep_timer) {
+            ch->sweep_timer -= clocks;
+            return;
+        }
+        clocks -= ch->sweep_timer;
+        ch->sweep_timer = period;
+
+        uint16_t freq = ch->sweep_enabled && NR10_PACE(nr10) ? sweep_next(nr10, ch->sweep_freq) : ch->sweep_freq;
+        if (freq > AUDIO_MAX_FREQUENCY) {
+            ch->on = 0;
+        } else if (!NR10_SHIFT(nr10) || freq == ch->sweep_freq) {
+            /* nothing changes from here on */
+            ch->sweep_timer = period - clocks % period;
+            return;
+        } else {
+            ch->sweep_freq = freq;
+            if (sweep_next(nr10, freq) > AUDIO_MAX_FREQUENCY)
+                ch->on = 0;
+        }
+    }
+}
+
+/* a trigger with a non-zero shift checks for overflow immediately */
+static void sweep_trigger(gbc_audio_log_t *log, uint8_t nr14, uint64_t now)
+{
+    gbc_audio_shadow_channel_t *ch = log->channels;
+    uint8_t nr10 = IO_PORT_READ(log->mem, IO_PORT_NR10);
+
+    ch->sweep_freq = IO_PORT_READ(log->mem, IO_PORT_NR13) | ((nr14 & 0x07) << 8);
+    ch->sweep_timer = NR10_PACE(nr10) ? NR10_PACE(nr10) : 8;
+    ch->sweep_enabled = NR10_PACE(nr10) || NR10_SHIFT(nr10);
+    ch->sweep_base = now;
+
+    if (NR10_SHIFT(nr10) && sweep_next(nr10, ch->sweep_freq) > AUDIO_MAX_FREQUENCY)
+        ch->on = 0;
+}
+
+static uint8_t read_nr52(gbc_audio_log_t *log)
+{
+    uint8_t value = IO_PORT_READ(log->mem, IO_PORT_NR52) & NR52_POWER;
+    uint64_t now = *log->cycles;
+
+    sweep_sync(log, now);
+
+    for (int i = 0; i < AUDIO_CHANNELS; i++) {
+        gbc_audio_shadow_channel_t *ch = log->channels + i;
+        if (ch->on && ch->length_enabled && !length_left(ch, now))
+            ch->on = 0;
+        if (ch->on)
+            value |= 1 << i;
+    }
+
+    return value | read_masks[IO_PORT_NR52 - IO_PORT_NR10];
+}
+
+static void shadow_write(gbc_audio_log_t *log, uint8_t port, uint8_t data, uint64_t now)
+{
+    for (int i = 0; i < AUDIO_CHANNELS; i++) {
+        const audio_channel_ports_t *ports = channel_ports + i;
+        gbc_audio_shadow_channel_t *ch = log->channels + i;
+
+        if (port == ports->length_port) {
+            ch->length = ports->max_length - (data & ports->length_mask);
+            ch->length_base = now;
+        } else if (port == ports->dac_port) {
+            if (!dac_enabled(log->mem, i))
+                ch->on = 0;
+        } else if (port == ports->control_port) {
+            ch->length = length_left(ch, now);
+            ch->length_base = now;
+            ch->length_enabled = (data & NRX4_LENGTH_ENABLE) ? 1 : 0;
+
+            if (data & NRX4_TRIGGER) {
+                if (!ch->length)
+                    ch->length = ports->max_length;
+                ch->on = dac_enabled(log->mem, i);
+                if (i == 0)
+                    sweep_trigger(log, data, now);
+            }
+        }
+    }
+}
+
+static void replay_frame(gbc_audio_log_t *log, gbc_audio_frame_log_t *frame)
+{
+    for (uint32_t i = 0; i < frame->count; i++) {
+        gbc_audio_write_t *w = frame->writes + i;
+        log->render(log->udata, w->cycle);
+        log->write(log->udata, w->cycle, w->port, w->data);
+    }
+    log->render(log->udata, frame->end_cycle);
+}
+
+static void* audio_log_worker(void *arg)
+{
+    gbc_audio_log_t *log = (gbc_audio_log_t*)arg;
+
+    pthread_mutex_lock(&log->lock);
+    for (;;) {
+        while (!log->pending && log->running)
+            pthread_cond_wait(&log->ready, &log->lock);
+        if (!log->pending)
+            break;
+
+        gbc_audio_frame_log_t *frame = log->frames + (log->current ^ 1);
+        pthread_mutex_unlock(&log->lock);
+
+        replay_frame(log, frame);
+
+        pthread_mutex_lock(&log->lock);
+        log->pending = 0;
+        pthread_cond_signal(&log->done);
+    }
+    pthread_mutex_unlock(&log->lock);
+
+    return NULL;
+}
+
+/* hand the current log to the worker at 'cycle', only blocks if the worker is a frame behind */
+static void hand_off(gbc_audio_log_t *log, uint64_t cycle)
+{
+    pthread_mutex_lock(&log->lock);
+    while (log->pending)
+        pthread_cond_wait(&log->done, &log->lock);
+
+    log->frames[log->current].end_cycle = cycle;
+    log->current ^= 1;
+    log->frames[log->current].count = 0;
+    log->pending = 1;
+
+    pthread_cond_signal(&log->ready);
+    pthread_mutex_unlock(&log->lock);
+}
+
+static void append(gbc_audio_log_t *log, uint64_t cycle, uint8_t port, uint8_t data)
+{
+    if (!log->threaded) {
+        log->render(log->udata, cycle);
+        log->write(log->udata, cycle, port, data);
+        return;
+    }
+
+    gbc_audio_frame_log_t *frame = log->frames + log->current;
+    if (frame->count == AUDIO_LOG_CAPACITY) {
+        hand_off(log, cycle);
+        frame = log->frames + log->current;
+    }
+
+    gbc_audio_write_t *w = frame->writes + frame->count++;
+    w->cycle = cycle;
+    w->port = port;
+    w->data = data;
+}
+
+static uint8_t audio_log_read(void *udata, uint16_t addr)
+{
+    gbc_audio_log_t *log = (gbc_audio_log_t*)udata;
+    uint8_t port = IO_ADDR_PORT(addr);
+
+    if (port == IO_PORT_NR52)
+        return read_nr52(log);
+    if (port >= IO_PORT_WAVE_RAM_START)
+        return IO_PORT_READ(log->mem, port);
+    if (port > IO_PORT_NR52)
+        return 0xFF;
+
+    return IO_PORT_READ(log->mem, port) | read_masks[port - IO_PORT_NR10];
+}
+
+static uint8_t audio_log_write(void *udata, uint16_t addr, uint8_t data)
+{
+    gbc_audio_log_t *log = (gbc_audio_log_t*)udata;
+    gbc_memory_t *mem = log->mem;
+    uint8_t port = IO_ADDR_PORT(addr);
+    uint64_t now = *log->cycles;
+    uint8_t power = IO_PORT_READ(mem, IO_PORT_NR52) & NR52_POWER;
+
+    if (port == IO_PORT_NR52) {
+        if (power && !(data & NR52_POWER)) {
+            /* power off clears every register except wave RAM */
+            memset(mem->io_ports + IO_PORT_NR10, 0, IO_PORT_NR51 - IO_PORT_NR10 + 1);
+            memset(log->channels, 0, sizeof(log->channels));
+        }
+        IO_PORT_WRITE(mem, IO_PORT_NR52, data & NR52_POWER);
+    } else if (port > IO_PORT_NR52 && port < IO_PORT_WAVE_RAM_START) {
+        return data;
+    } else if (!power && port < IO_PORT_WAVE_RAM_START) {
+        /* ignored while the APU is off */
+        return data;
+    } else {
+        if (port == IO_PORT_NR10)
+            sweep_sync(log, now);
+        IO_PORT_WRITE(mem, port, data);
+        shadow_write(log, port, data, now);
+    }
+
+    if (!log->speculating)
+        append(log, now, port, data);
+    return data;
+}
+
+int gbc_audio_log_init(gbc_audio_log_t *log, audio_replay_write write, audio_replay_render render,
+    void *udata, uint8_t threaded)
+{
+    memset(log, 0, sizeof(gbc_audio_log_t));
+    log->write = write;
+    log->render = render;
+    log->udata = udata;
+    log->threaded = threaded;
+
+    if (!threaded)
+        return 0;
+
+    for (int i = 0; i < 2; i++) {
+        log->frames[i].writes = malloc_memory(AUDIO_LOG_CAPACITY * sizeof(gbc_audio_write_t));
+        if (!log->frames[i].writes) {
+            LOG_ERROR("[AUDIO] failed to allocate register log\n");
+            free_memory(log->frames[0].writes);
+            return -1;
+        }
+    }
+
+    pthread_mutex_init(&log->lock, NULL);
+    pthread_cond_init(&log->ready, NULL);
+    pthread_cond_init(&log->done, NULL);
+    log->running = 1;
+
+    if (pthread_create(&log->worker, NULL, audio_log_worker, log)) {
+        LOG_ERROR("[AUDIO] failed to start render worker, rendering inline\n");
+        log->running = 0;
+        log->threaded = 0;
+        pthread_mutex_destroy(&log->lock);
+        pthread_cond_destroy(&log->ready);
+        pthread_cond_destroy(&log->done);
+        for (int i = 0; i < 2; i++) {
+            free_memory(log->frames[i].writes);
+            log->frames[i].writes = NULL;
+        }
+    }
+
+    return 0;
+}
+
+void gbc_audio_log_connect(gbc_audio_log_t *log, gbc_memory_t *mem, gbc_cpu_t *cpu)
+{
+    log->mem = mem;
+    log->cycles = &cpu->cycles;
+
+    memory_map_entry_t entry;
+    entry.id = AUDIO_ID;
+    entry.addr_begin = AUDIO_BEGIN;
+    entry.addr_end = AUDIO_END;
+    entry.read = audio_log_read;
+    entry.write = audio_log_write;
+    entry.udata = log;
+
+    register_memory_map(mem, &entry);
+}
+
+/* Called once per emulated frame; the worker renders it while the next one runs. */
+void gbc_audio_log_end_frame(gbc_audio_log_t *log)
+{
+    if (!log->threaded) {
+        log->render(log->udata, *log->cycles);
+        return;
+    }
+
+    hand_off(log, *log->cycles);
+}
+
+/* Frames run between begin and end are thrown away afterwards (run-ahead): only the real
+ * timeline reaches the synthesizer, and the shadow goes back to where it was. */
+void gbc_audio_log_speculate(gbc_audio_log_t *log, uint8_t begin)
+{
+    if (begin)
+        memcpy(log->saved, log->channels, sizeof(log->channels));
+    else
+        memcpy(log->channels, log->saved, sizeof(log->channels));
+    log->speculating = begin;
+}
+
+/* After a reset: the writes not handed off yet belong to the old timeline */
+void gbc_audio_log_reset(gbc_audio_log_t *log)
+{
+    gbc_audio_log_sync(log);
+    log->frames[log->current].count = 0;
+    memset(log->channels, 0, sizeof(log->channels));
+    log->speculating = 0;
+}
+
+/* Wait until everything handed off so far has been rendered */
+void gbc_audio_log_sync(gbc_audio_log_t *log)
+{
+    if (!log->threaded)
+        return;
+
+    pthread_mutex_lock(&log->lock);
+    while (log->pending)
+        pthread_cond_wait(&log->done, &log->lock);
+    pthread_mutex_unlock(&log->lock);
+}
+
+void gbc_audio_log_cleanup(gbc_audio_log_t *log)
+{
+    if (log->running) {
+        /* writes after the last end_frame are rendered up to the last write, like inline */
+        gbc_audio_frame_log_t *frame = log->frames + log->current;
+        if (frame->count)
+            hand_off(log, frame->writes[frame->count - 1].cycle);
+
+        pthread_mutex_lock(&log->lock);
+        log->running = 0;
+        pthread_cond_signal(&log->ready);
+        pthread_mutex_unlock(&log->lock);
+
+        pthread_join(log->worker, NULL);
+        pthread_mutex_destroy(&log->lock);
+        pthread_cond_destroy(&log->ready);
+        pthread_cond_destroy(&log->done);
+    }
+
+    for (int i = 0; i < 2; i++) {
+        free_memory(log->frames[i].writes);
+        log->frames[i].writes = NULL;
+    }
+}
@@ -0,0 +1,82 @@
+#ifndef AUDIO_LOG_H
+#define AUDIO_LOG_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "memory.h"
+#include "cpu.h"
+
+#define AUDIO_LOG_CAPACITY 8192     /* writes per log buffer, a full buffer is handed off early */
+#define AUDIO_CHANNELS 4
+
+#define AUDIO_LENGTH_CLOCK_CYCLES 16384    /* 256 Hz frame sequencer length clock */
+#define AUDIO_SWEEP_CLOCK_CYCLES 32768     /* 128 Hz sweep clock, half a period after a length clock */
+
+#define NR52_POWER 0x80
+#define NRX4_TRIGGER 0x80
+#define NRX4_LENGTH_ENABLE 0x40
+
+/* Synthesizer entry points; called in cycle order, either inline or from the worker. */
+typedef void (*audio_replay_write)(void *udata, uint64_t cycle, uint8_t port, uint8_t data);
+typedef void (*audio_replay_render)(void *udata, uint64_t cycle);
+
+typedef struct {
+    uint64_t cycle;
+    uint8_t port;
+    uint8_t data;
+} gbc_audio_write_t;
+
+typedef struct {
+    gbc_audio_write_t *writes;
+    uint32_t count;
+    uint64_t end_cycle;
+} gbc_audio_frame_log_t;
+
+/* Just enough channel state to answer NR52 reads on the emulation thread */
+typedef struct {
+    uint8_t on;
+    uint8_t length_enabled;
+    uint16_t length;            /* length clocks left at length_base */
+    uint64_t length_base;
+
+    /* ch1 frequency sweep, which turns the channel off when it overflows */
+    uint8_t sweep_enabled;
+    uint8_t sweep_timer;        /* sweep clocks to the next step at sweep_base */
+    uint16_t sweep_freq;
+    uint64_t sweep_base;
+} gbc_audio_shadow_channel_t;
+
+typedef struct gbc_audio_log {
+    gbc_memory_t *mem;
+    uint64_t *cycles;
+
+    audio_replay_write write;
+    audio_replay_render render;
+    void *udata;
+
+    gbc_audio_frame_log_t frames[2];
+    uint8_t current;            /* frame being filled by the emulation thread */
+    uint8_t threaded;
+
+    gbc_audio_shadow_channel_t channels[AUDIO_CHANNELS];
+    gbc_audio_shadow_channel_t saved[AUDIO_CHANNELS];
+    uint8_t speculating;        /* writes update the shadow but are not logged */
+
+    pthread_t worker;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_cond_t done;
+    uint8_t pending;
+    uint8_t running;
+} gbc_audio_log_t;
+
+int gbc_audio_log_init(gbc_audio_log_t *log, audio_replay_write write, audio_replay_render render,
+    void *udata, uint8_t threaded);
+void gbc_audio_log_connect(gbc_audio_log_t *log, gbc_memory_t *mem, gbc_cpu_t *cpu);
+void gbc_audio_log_end_frame(gbc_audio_log_t *log);
+void gbc_audio_log_sync(gbc_audio_log_t *log);
+void gbc_audio_log_speculate(gbc_audio_log_t *log, uint8_t begin);
+void gbc_audio_log_reset(gbc_audio_log_t *log);
+void gbc_audio_log_cleanup(gbc_audio_log_t *log);
+
+#endif
@@ -0,0 +1,188 @@
+#include <pthread.h>
+#include "audio_noise.h"
+#include "common.h"
+
+#define LFSR_WORDS(period) (((period) + 64 + 63) / 64)
+
+/* Output bit (bit 0 of the register) after i steps from trigger, for i in [0, period).
+ * The first 64 bits are repeated after the period so any 64-bit window is contiguous. */
+static uint64_t lfsr15_bits[LFSR_WORDS(LFSR15_PERIOD)];
+static uint64_t lfsr7_bits[LFSR_WORDS(LFSR7_PERIOD)];
+static uint32_t lfsr15_ones;
+static uint32_t lfsr7_ones;
+static uint8_t lfsr7_index[128];    /* 7-bit register value -> index */
+
+static pthread_once_t noise_once = PTHREAD_ONCE_INIT;
+
+static inline uint8_t bit_at(const uint64_t *bits, uint32_t i)
+{
+    return (bits[i >> 6] >> (i & 63)) & 1;
+}
+
+/* bits [i, i + n), n <= 64, i < period */
+static inline uint64_t bits_window(const uint64_t *bits, uint32_t i, uint32_t n)
+{
+    uint64_t lo = bits[i >> 6] >> (i & 63);
+    if ((i & 63) + n > 64)
+        lo |= bits[(i >> 6) + 1] << (64 - (i & 63));
+    return n == 64 ? lo : lo & ((1ULL << n) - 1);
+}
+
+/* number of set bits in [begin, end), end <= period + 64 */
+static uint32_t bits_count(const uint64_t *bits, uint32_t begin, uint32_t end)
+{
+    uint32_t count = 0;
+
+    while (begin < end && (begin & 63)) {
+        count += bit_at(bits, begin);
+        begin++;
+    }
+    while (begin + 64 <= end) {
+        count += __builtin_popcountll(bits[begin >> 6]);
+        begin += 64;
+    }
+    if (begin < end)
+        count += __builtin_popcountll(bits[begin >> 6] & ((1ULL << (end - begin)) - 1));
+
+    return count;
+}
+
+static void build_table(uint64_t *bits, uint32_t period, uint8_t is_short)
+{
+    uint16_t lfsr = 0;
+
+    for (uint32_t i = 0; i < period + 64; i++) {
+        if (lfsr & 1)
+            bits[i >> 6] |= 1ULL << (i & 63);
+
+        uint16_t x = !((lfsr ^ (lfsr >> 1)) & 1);
+        lfsr = (lfsr | (x << 15)) >> 1;
+        if (is_short)
+            lfsr = (lfsr & ~0x40) | (x << 6);
+    }
+}
+
+static void build_tables()
+{
+    build_table(lfsr15_bits, LFSR15_PERIOD, 0);
+    build_table(lfsr7_bits, LFSR7_PERIOD, 1);
+
+    lfsr15_ones = bits_count(lfsr15_bits, 0, LFSR15_PERIOD);
+    lfsr7_ones = bits_count(lfsr7_bits, 0, LFSR7_PERIOD);
+
+    for (int i = 0; i < 128; i++)
+        lfsr7_index[i] = 0;
+    for (uint32_t i = 0; i < LFSR7_PERIOD; i++)
+        lfsr7_index[bits_window(lfsr7_bits, i, 7)] = i;
+
+    LOG_DEBUG("[AUDIO] noise tables ready, %u/%u and %u/%u ones\n",
+        lfsr15_ones, LFSR15_PERIOD, lfsr7_ones, LFSR7_PERIOD);
+}
+
+void audio_noise_init()
+{
+    pthread_once(&noise_once, build_tables);
+}
+
+void audio_noise_trigger(gbc_audio_channel *channel, uint8_t nr43)
+{
+    /* trigger clears the register, which is index 0 of both sequences */
+    channel->lfsr_index = 0;
+    channel->randomness = CH4_IS_SHORT(nr43);
+    channel->phase_accumulator = 0;
+}
+
+/* Re-locate the current register value in the other sequence when the width changes
+ * mid-note; rare enough for the 15-bit lookup to be a scan. */
+void audio_noise_set_control(gbc_audio_channel *channel, uint8_t nr43)
+{
+    uint8_t is_short = CH4_IS_SHORT(nr43);
+    uint16_t idx = channel->lfsr_index;
+
+    if (is_short == channel->randomness)
+        return;
+    channel->randomness = is_short;
+
+    if (idx == LFSR_LOCKED) {
+        /* all ones is stuck for both widths */
+        return;
+    }
+
+    if (is_short) {
+        /* bit k of the register is the output k steps ahead */
+        uint8_t low7 = bits_window(lfsr15_bits, idx, 7);
+        channel->lfsr_index = (low7 == 0x7F) ? LFSR_LOCKED : lfsr7_index[low7];
+        return;
+    }
+
+    /* in 7-bit mode bits 8..14 mirror bits 0..6 and bit 7 holds the previous output */
+    uint16_t low7 = bits_window(lfsr7_bits, idx, 7);
+    uint16_t prev = bit_at(lfsr7_bits, idx ? idx - 1 : LFSR7_PERIOD - 1);
+    uint16_t lfsr = low7 | (prev << 7) | (low7 << 8);
+
+    if (lfsr == 0x7FFF) {
+        channel->lfsr_index = LFSR_LOCKED;
+        return;
+    }
+
+    uint16_t window = bits_window(lfsr15_bits, 0, 15);
+    for (uint32_t i = 0; i < LFSR15_PERIOD; i++) {
+        if (window == lfsr) {
+            channel->lfsr_index = i;
+            return;
+        }
+        window = (window >> 1) | (bit_at(lfsr15_bits, i + 15) << 14);
+    }
+
+    LOG_ERROR("[AUDIO] noise register %04x not in sequence\n", lfsr);
+    channel->lfsr_index = 0;
+}
+
+uint8_t audio_noise_output(gbc_audio_channel *channel)
+{
+    if (channel->lfsr_index == LFSR_LOCKED)
+        return 1;
+
+    return bit_at(channel->randomness ? lfsr7_bits : lfsr15_bits, channel->lfsr_index);
+}
+
+/* Advance the channel by 'cycles' cpu cycles. Returns how many of the steps taken left
+ * the output high, so the mixer can average a whole span without stepping the register. */
+uint32_t audio_noise_run(gbc_audio_channel *channel, uint8_t nr43, uint32_t cycles, uint32_t *steps)
+{
+    uint32_t step_cycles = CH4_STEP_CYCLES(nr43);
+    uint32_t n, ones;
+
+    *steps = 0;
+    if (!step_cycles)
+        return 0;
+
+    channel->phase_accumulator += cycles;
+    n = channel->phase_accumulator / step_cycles;
+    channel->phase_accumulator -= n * step_cycles;
+    *steps = n;
+
+    if (!n)
+        return 0;
+    if (channel->lfsr_index == LFSR_LOCKED)
+        return n;
+
+    const uint64_t *bits = channel->randomness ? lfsr7_bits : lfsr15_bits;
+    uint32_t period = channel->randomness ? LFSR7_PERIOD : LFSR15_PERIOD;
+    uint32_t total = channel->randomness ? lfsr7_ones : lfsr15_ones;
+
+    /* outputs seen are indices idx+1 .. idx+n */
+    uint32_t begin = channel->lfsr_index + 1;
+    ones = (n / period) * total;
+    n %= period;
+
+    if (begin + n <= period) {
+        ones += bits_count(bits, begin, begin + n);
+    } else {
+        ones += bits_count(bits, begin, period);
+        ones += bits_count(bits, 0, begin + n - period);
+    }
+
+    channel->lfsr_index = (channel->lfsr_index + *steps) % period;
+    return ones;
+}
@@ -0,0 +1,29 @@
+#ifndef AUDIO_NOISE_H
+#define AUDIO_NOISE_H
+
+#include <stdint.h>
+#include "audio.h"
+
+/* https://gbdev.io/pandocs/Audio_details.html#noise-channel-ch4 */
+#define LFSR15_PERIOD 32767
+#define LFSR7_PERIOD  127
+
+#define LFSR_LOCKED 0xFFFF     /* lfsr_index while stuck in the all-ones state */
+
+#define CH4_LFSR_WIDTH_MASK 0x08
+#define CH4_CLOCK_SHIFT(nr43)   ((nr43) >> 4)
+#define CH4_CLOCK_DIVIDER(nr43) ((nr43) & 0x07)
+#define CH4_IS_SHORT(nr43)      (((nr43) & CH4_LFSR_WIDTH_MASK) ? 1 : 0)
+
+/* cpu cycles between two LFSR steps, 0 when the channel receives no clocks (shift 14/15) */
+#define CH4_STEP_CYCLES(nr43) \
+    (CH4_CLOCK_SHIFT(nr43) >= 14 ? 0 : \
+    ((CH4_CLOCK_DIVIDER(nr43) ? (CH4_CLOCK_DIVIDER(nr43) << 4) : 8) << CH4_CLOCK_SHIFT(nr43)))
+
+void audio_noise_init();
+void audio_noise_trigger(gbc_audio_channel *channel, uint8_t nr43);
+void audio_noise_set_control(gbc_audio_channel *channel, uint8_t nr43);
+uint8_t audio_noise_output(gbc_audio_channel *channel);
+uint32_t audio_noise_run(gbc_audio_channel *channel, uint8_t nr43, uint32_t cycles, uint32_t *steps);
+
+#endif
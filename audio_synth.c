@@ -0,0 +1,352 @@
+#include <string.h>
+#include "audio_synth.h"
+#include "audio_noise.h"
+#include "audio_log.h"
+#include "cpu.h"
+#include "common.h"
+#include "utils.h"
+
+#define REG(synth, port) ((synth)->regs[(port) - IO_PORT_NR10])
+
+/* https://gbdev.io/pandocs/Audio_Registers.html */
+typedef struct {
+    uint8_t length_port;
+    uint8_t dac_port;
+    uint8_t low_port;           /* frequency low, NR43 on ch4 */
+    uint8_t high_port;
+    uint8_t length_mask;
+    uint16_t max_length;
+} synth_ports_t;
+
+static const synth_ports_t synth_ports[4] = {
+    {IO_PORT_NR11, IO_PORT_NR12, IO_PORT_NR13, IO_PORT_NR14, LENGTH_MASK, 64},
+    {IO_PORT_NR21, IO_PORT_NR22, IO_PORT_NR23, IO_PORT_NR24, LENGTH_MASK, 64},
+    {IO_PORT_NR31, IO_PORT_NR30, IO_PORT_NR33, IO_PORT_NR34, CH3_LENGTH_MASK, 256},
+    {IO_PORT_NR41, IO_PORT_NR42, IO_PORT_NR43, IO_PORT_NR44, LENGTH_MASK, 64},
+};
+
+/* output of duty step i is bit i: 12.5%, 25%, 50%, 75% */
+static const uint8_t duty_patterns[4] = { 0x80, 0x81, 0xE1, 0x7E };
+
+static gbc_audio_channel* synth_channel(gbc_audio_synth_t *synth, int i)
+{
+    gbc_audio_channel *channels[4] = {
+        &synth->audio.channel1, &synth->audio.channel2, &synth->audio.channel3, &synth->audio.channel4
+    };
+    return channels[i];
+}
+
+static uint8_t dac_on(gbc_audio_synth_t *synth, int i)
+{
+    uint8_t v = REG(synth, synth_ports[i].dac_port);
+    return i == 2 ? (v & 0x80) != 0 : IS_DAC_ENABLED(v);
+}
+
+static uint16_t sweep_next(gbc_audio_synth_t *synth, uint16_t freq)
+{
+    uint8_t nr10 = REG(synth, IO_PORT_NR10);
+    uint16_t delta = freq >> NR10_SHIFT(nr10);
+
+    return (nr10 & SWEEP_DIRECTION_MASK) ? freq - delta : freq + delta;
+}
+
+static void set_ch1_frequency(gbc_audio_synth_t *synth, uint16_t freq)
+{
+    synth->audio.channel1.frequency = freq;
+    REG(synth, IO_PORT_NR13) = freq & UINT8_MASK;
+    REG(synth, IO_PORT_NR14) = (REG(synth, IO_PORT_NR14) & ~0x07) | (freq >> 8);
+}
+
+static void sweep_step(gbc_audio_synth_t *synth)
+{
+    gbc_audio_channel *ch = &synth->audio.channel1;
+    uint8_t nr10 = REG(synth, IO_PORT_NR10);
+
+    if (synth->sweep_timer > 1) {
+        synth->sweep_timer--;
+        return;
+    }
+    synth->sweep_timer = NR10_PACE(nr10) ? NR10_PACE(nr10) : 8;
+    if (!synth->sweep_enabled || !NR10_PACE(nr10))
+        return;
+
+    uint16_t freq = sweep_next(synth, ch->current_frequency);
+    if (freq > AUDIO_MAX_FREQUENCY) {
+        synth->ch[0].on = 0;
+        return;
+    }
+    if (NR10_SHIFT(nr10)) {
+        ch->current_frequency = freq;
+        set_ch1_frequency(synth, freq);
+        if (sweep_next(synth, freq) > AUDIO_MAX_FREQUENCY)
+            synth->ch[0].on = 0;
+    }
+}
+
+static void envelope_step(gbc_audio_synth_t *synth, int i)
+{
+    gbc_audio_channel *ch = synth_channel(synth, i);
+    gbc_audio_synth_channel_t *s = synth->ch + i;
+
+    if (!ch->envelope_pace || --s->envelope_timer)
+        return;
+
+    s->envelope_timer = ch->envelope_pace;
+    if (ch->envelope_direction && ch->volume < 15)
+        ch->volume++;
+    else if (!ch->envelope_direction && ch->volume)
+        ch->volume--;
+}
+
+/* step 0-7 of the frame sequencer: length on even steps, sweep on 2 and 6, envelope on 7 */
+static void sequencer_step(gbc_audio_synth_t *synth, uint8_t step)
+{
+    if (!(step & 1)) {
+        for (int i = 0; i < 4; i++) {
+            gbc_audio_synth_channel_t *s = synth->ch + i;
+            if ((REG(synth, synth_ports[i].high_port) & NRX4_LENGTH_ENABLE) && s->length && !--s->length)
+                s->on = 0;
+        }
+    }
+    if (step == 2 || step == 6)
+        sweep_step(synth);
+    if (step == 7) {
+        envelope_step(synth, 0);
+        envelope_step(synth, 1);
+        envelope_step(synth, 3);
+    }
+}
+
+static void run_channels(gbc_audio_synth_t *synth, uint32_t cycles)
+{
+    for (int i = 0; i < 3; i++) {
+        gbc_audio_channel *ch = synth_channel(synth, i);
+        gbc_audio_synth_channel_t *s = synth->ch + i;
+        if (!s->on)
+            continue;
+
+        uint32_t period = (2048 - ch->frequency) * (i == 2 ? 2 : 4);
+        ch->phase_accumulator += cycles;
+        if (ch->phase_accumulator >= period) {
+            uint32_t steps = ch->phase_accumulator / period;
+            ch->phase_accumulator -= steps * period;
+            s->position = (s->position + steps) & (i == 2 ? 31 : 7);
+        }
+    }
+
+    /* the noise channel advances a whole span at once from the LFSR tables */
+    gbc_audio_synth_channel_t *s = synth->ch + 3;
+    if (s->on) {
+        uint32_t steps;
+        s->noise_ones += audio_noise_run(&synth->audio.channel4, REG(synth, IO_PORT_NR43), cycles, &steps);
+        s->noise_steps += steps;
+    }
+}
+
+/* digital output 0-15 of channel i */
+static uint8_t channel_output(gbc_audio_synth_t *synth, int i)
+{
+    gbc_audio_channel *ch = synth_channel(synth, i);
+    gbc_audio_synth_channel_t *s = synth->ch + i;
+
+    if (i < 2) {
+        uint8_t duty = REG(synth, synth_ports[i].length_port) >> 6;
+        return ((duty_patterns[duty] >> s->position) & 1) ? ch->volume : 0;
+    }
+
+    if (i == 2) {
+        uint8_t byte = REG(synth, IO_PORT_WAVE_RAM_START + (s->position >> 1));
+        uint8_t sample = (s->position & 1) ? byte & UINT4_MASK : byte >> 4;
+        uint8_t level = (REG(synth, IO_PORT_NR32) >> 5) & 0x03;
+        return level ? sample >> (level - 1) : 0;
+    }
+
+    /* average of the LFSR outputs since the last sample */
+    uint8_t out;
+    if (s->noise_steps)
+        out = (ch->volume * s->noise_ones + s->noise_steps / 2) / s->noise_steps;
+    else
+        out = audio_noise_output(ch) ? ch->volume : 0;
+    s->noise_ones = 0;
+    s->noise_steps = 0;
+    return out;
+}
+
+static void emit_sample(gbc_audio_synth_t *synth)
+{
+    uint8_t nr50 = REG(synth, IO_PORT_NR50);
+    uint8_t nr51 = REG(synth, IO_PORT_NR51);
+    int left = 0, right = 0;
+
+    for (int i = 0; i < 4; i++) {
+        if (!synth->ch[i].on || !dac_on(synth, i))
+            continue;
+
+        int analog = channel_output(synth, i) * 2 - 15;
+        if (nr51 & (0x10 << i))
+            left += analog;
+        if (nr51 & (0x01 << i))
+            right += analog;
+    }
+
+    /* 4 channels * 15 * 8 fits int16 with a x64 gain */
+    int16_t *out = synth->samples + synth->count * 2;
+    out[0] = left * (((nr50 >> 4) & 0x07) + 1) * 64;
+    out[1] = right * ((nr50 & 0x07) + 1) * 64;
+
+    synth->total++;
+    if (++synth->count == AUDIO_SYNTH_BUFFER)
+        gbc_audio_synth_flush(synth);
+}
+
+static void trigger(gbc_audio_synth_t *synth, int i)
+{
+    const synth_ports_t *ports = synth_ports + i;
+    gbc_audio_channel *ch = synth_channel(synth, i);
+    gbc_audio_synth_channel_t *s = synth->ch + i;
+
+    s->on = dac_on(synth, i);
+    if (!s->length)
+        s->length = ports->max_length;
+    s->position = 0;
+    ch->phase_accumulator = 0;
+
+    if (i != 2) {
+        uint8_t nrx2 = REG(synth, ports->dac_port);
+        ch->volume = NRX2_VOLUME(nrx2);
+        ch->envelope_direction = NRX2_INCREASE(nrx2);
+        ch->envelope_pace = NRX2_PACE(nrx2);
+        s->envelope_timer = ch->envelope_pace;
+    }
+
+    if (i == 0) {
+        uint8_t nr10 = REG(synth, IO_PORT_NR10);
+        ch->current_frequency = ch->frequency;
+        synth->sweep_timer = NR10_PACE(nr10) ? NR10_PACE(nr10) : 8;
+        synth->sweep_enabled = NR10_PACE(nr10) || NR10_SHIFT(nr10);
+        if (NR10_SHIFT(nr10) && sweep_next(synth, ch->frequency) > AUDIO_MAX_FREQUENCY)
+            s->on = 0;
+    }
+
+    if (i == 3) {
+        audio_noise_trigger(ch, REG(synth, IO_PORT_NR43));
+        s->noise_ones = 0;
+        s->noise_steps = 0;
+    }
+}
+
+void gbc_audio_synth_init(gbc_audio_synth_t *synth, audio_sample_sink sink, void *udata)
+{
+    memset(synth, 0, sizeof(gbc_audio_synth_t));
+    synth->sink = sink;
+    synth->sink_udata = udata;
+    synth->sweep_timer = 8;
+    audio_noise_init();
+}
+
+/* Silences every channel and takes the registers (NR10 .. wave RAM, e.g. the post-boot
+ * I/O ports) as they are, without triggering anything. Output position and checksum stay. */
+void gbc_audio_synth_reset(gbc_audio_synth_t *synth, const uint8_t *regs)
+{
+    memset(&synth->audio, 0, sizeof(synth->audio));
+    memset(synth->ch, 0, sizeof(synth->ch));
+    memcpy(synth->regs, regs, AUDIO_SYNTH_REGS);
+    synth->sweep_timer = 8;
+    synth->sweep_enabled = 0;
+    synth->audio.channel1.frequency = REG(synth, IO_PORT_NR13) | ((REG(synth, IO_PORT_NR14) & 0x07) << 8);
+    synth->audio.channel2.frequency = REG(synth, IO_PORT_NR23) | ((REG(synth, IO_PORT_NR24) & 0x07) << 8);
+    synth->audio.channel3.frequency = REG(synth, IO_PORT_NR33) | ((REG(synth, IO_PORT_NR34) & 0x07) << 8);
+    synth->audio.channel4.randomness = CH4_IS_SHORT(REG(synth, IO_PORT_NR43));
+}
+
+/* audio_replay_write: a register write at 'cycle', after rendering up to it */
+void gbc_audio_synth_write(void *udata, uint64_t cycle, uint8_t port, uint8_t data)
+{
+    gbc_audio_synth_t *synth = (gbc_audio_synth_t*)udata;
+
+    (void)cycle;    /* the log renders up to it first */
+    if (port == IO_PORT_NR52) {
+        if (!(data & NR52_POWER)) {
+            memset(synth->regs, 0, IO_PORT_NR51 - IO_PORT_NR10 + 1);
+            for (int i = 0; i < 4; i++)
+                synth->ch[i].on = 0;
+        }
+        REG(synth, IO_PORT_NR52) = data & NR52_POWER;
+        return;
+    }
+    if (port < IO_PORT_WAVE_RAM_START && !(REG(synth, IO_PORT_NR52) & NR52_POWER))
+        return;
+
+    REG(synth, port) = data;
+    if (port == IO_PORT_NR43) {
+        audio_noise_set_control(&synth->audio.channel4, data);
+        return;
+    }
+
+    for (int i = 0; i < 4; i++) {
+        const synth_ports_t *ports = synth_ports + i;
+        gbc_audio_channel *ch = synth_channel(synth, i);
+
+        if (port == ports->length_port) {
+            synth->ch[i].length = ports->max_length - (data & ports->length_mask);
+        } else if (port == ports->dac_port) {
+            if (!dac_on(synth, i))
+                synth->ch[i].on = 0;
+        } else if (port == ports->low_port) {
+            ch->frequency = (ch->frequency & 0x700) | data;
+        } else if (port == ports->high_port) {
+            if (i != 3)
+                ch->frequency = (ch->frequency & UINT8_MASK) | ((data & 0x07) << 8);
+            if (data & NRX4_TRIGGER)
+                trigger(synth, i);
+        }
+    }
+}
+
+/* audio_replay_render: produce every sample due before 'cycle' */
+void gbc_audio_synth_render(void *udata, uint64_t cycle)
+{
+    gbc_audio_synth_t *synth = (gbc_audio_synth_t*)udata;
+    uint8_t power = REG(synth, IO_PORT_NR52) & NR52_POWER;
+
+    /* the clock went back (reset, state load): carry on from there */
+    if (cycle < synth->cycle) {
+        synth->cycle = cycle;
+        return;
+    }
+
+    while (synth->cycle < cycle) {
+        uint64_t n = cycle - synth->cycle;
+        uint64_t to_tick = AUDIO_SEQUENCER_CYCLES - synth->cycle % AUDIO_SEQUENCER_CYCLES;
+        uint64_t to_sample = (CLOCK_RATE - synth->sample_frac + AUDIO_SAMPLE_RATE - 1) / AUDIO_SAMPLE_RATE;
+
+        if (n > to_tick)
+            n = to_tick;
+        if (n > to_sample)
+            n = to_sample;
+
+        if (power)
+            run_channels(synth, n);
+        synth->cycle += n;
+        synth->sample_frac += n * AUDIO_SAMPLE_RATE;
+
+        if (power && !(synth->cycle % AUDIO_SEQUENCER_CYCLES))
+            sequencer_step(synth, (synth->cycle / AUDIO_SEQUENCER_CYCLES) & 7);
+        if (synth->sample_frac >= CLOCK_RATE) {
+            synth->sample_frac -= CLOCK_RATE;
+            emit_sample(synth);
+        }
+    }
+}
+
+/* Hands buffered samples to the sink and folds them into the checksum */
+void gbc_audio_synth_flush(gbc_audio_synth_t *synth)
+{
+    if (!synth->count)
+        return;
+
+    synth->checksum = hash64(synth->samples, synth->count * 2 * sizeof(int16_t), synth->checksum);
+    if (synth->sink)
+        synth->sink(synth->sink_udata, synth->samples, synth->count);
+    synth->count = 0;
+}
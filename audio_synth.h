@@ -0,0 +1,61 @@
+#ifndef AUDIO_SYNTH_H
+#define AUDIO_SYNTH_H
+
+#include <stdint.h>
+#include "audio.h"
+#include "memory.h"
+
+#define AUDIO_SAMPLE_RATE 48000
+#define AUDIO_SYNTH_BUFFER 2048             /* stereo samples handed to the sink at a time */
+
+#define AUDIO_SEQUENCER_CYCLES 8192         /* 512 Hz frame sequencer */
+#define AUDIO_MAX_FREQUENCY 2047            /* 11-bit period value, the sweep overflows past it */
+#define AUDIO_SYNTH_REGS (IO_PORT_WAVE_RAM_END - IO_PORT_NR10 + 1)
+
+/* https://gbdev.io/pandocs/Audio_Registers.html */
+#define NR10_PACE(nr10)     (((nr10) >> 4) & 0x07)
+#define NR10_SHIFT(nr10)    ((nr10) & 0x07)
+#define NRX2_VOLUME(nrx2)   ((nrx2) >> 4)
+#define NRX2_INCREASE(nrx2) (((nrx2) >> 3) & 0x01)
+#define NRX2_PACE(nrx2)     ((nrx2) & 0x07)
+
+typedef void (*audio_sample_sink)(void *udata, const int16_t *samples, uint32_t count);
+
+/* What gbc_audio_channel does not hold */
+typedef struct {
+    uint8_t on;
+    uint8_t position;           /* duty step, or wave sample */
+    uint8_t envelope_timer;
+    uint16_t length;
+    uint32_t noise_ones;        /* ch4 since the last sample */
+    uint32_t noise_steps;
+} gbc_audio_synth_channel_t;
+
+/* Renders the APU from register writes alone, in cycle order, so it can run inline or
+ * replay a gbc_audio_log on another thread. Cycles are in single speed units. */
+typedef struct gbc_audio_synth {
+    gbc_audio audio;
+    gbc_audio_synth_channel_t ch[4];
+    uint8_t regs[AUDIO_SYNTH_REGS];     /* NR10 .. wave RAM as written */
+    uint8_t sweep_timer;
+    uint8_t sweep_enabled;
+
+    uint64_t cycle;             /* rendered up to here */
+    uint32_t sample_frac;       /* in AUDIO_SAMPLE_RATE units of a cycle */
+
+    int16_t samples[AUDIO_SYNTH_BUFFER * 2];
+    uint32_t count;
+    uint64_t total;             /* stereo samples rendered */
+    uint64_t checksum;          /* hash of every sample handed out */
+
+    audio_sample_sink sink;
+    void *sink_udata;
+} gbc_audio_synth_t;
+
+void gbc_audio_synth_init(gbc_audio_synth_t *synth, audio_sample_sink sink, void *udata);
+void gbc_audio_synth_reset(gbc_audio_synth_t *synth, const uint8_t *regs);
+void gbc_audio_synth_write(void *udata, uint64_t cycle, uint8_t port, uint8_t data);
+void gbc_audio_synth_render(void *udata, uint64_t cycle);
+void gbc_audio_synth_flush(gbc_audio_synth_t *synth);
+
+#endif
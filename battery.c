@@ -0,0 +1,172 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "battery.h"
+#include "common.h"
+
+static void flush_pages(gbc_battery_t *bat, uint32_t first, uint32_t count)
+{
+    size_t offset = (size_t)first << bat->page_shift;
+    size_t length = (size_t)count << bat->page_shift;
+
+    if (offset + length > bat->size)
+        length = bat->size - offset;
+
+    if (msync(bat->data + offset, length, MS_SYNC))
+        LOG_ERROR("[BATTERY] msync failed: %s\n", strerror(errno));
+
+    bat->pages_flushed += count;
+}
+
+/* Runs on the flusher thread, or on the caller's after the flusher stopped */
+void gbc_battery_flush(gbc_battery_t *bat)
+{
+    for (int w = 0; w < BATTERY_DIRTY_WORDS; w++) {
+        /* pages written while we sync get their bit set again and go in the next flush */
+        uint64_t dirty = __atomic_exchange_n(&bat->dirty[w], 0, __ATOMIC_ACQ_REL);
+
+        while (dirty) {
+            uint32_t first = __builtin_ctzll(dirty);
+            uint32_t count = 0;
+            while (first + count < 64 && (dirty & (1ULL << (first + count))))
+                count++;
+
+            dirty &= count == 64 ? 0 : ~(((1ULL << count) - 1) << first);
+            flush_pages(bat, w * 64 + first, count);
+        }
+    }
+
+    bat->flushes++;
+}
+
+static void* battery_flusher(void *arg)
+{
+    gbc_battery_t *bat = (gbc_battery_t*)arg;
+    struct timespec deadline;
+
+    pthread_mutex_lock(&bat->lock);
+    while (bat->running) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += bat->interval_ms / 1000;
+        deadline.tv_nsec += (bat->interval_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        pthread_cond_timedwait(&bat->wake, &bat->lock, &deadline);
+        if (!bat->running)
+            break;
+
+        pthread_mutex_unlock(&bat->lock);
+        gbc_battery_flush(bat);
+        pthread_mutex_lock(&bat->lock);
+    }
+    pthread_mutex_unlock(&bat->lock);
+
+    return NULL;
+}
+
+/* 16K and 64K pages exist (arm64, ppc64), and msync wants page aligned ranges */
+static void set_page_size(gbc_battery_t *bat)
+{
+    long host = sysconf(_SC_PAGESIZE);
+    uint32_t page = BATTERY_MIN_PAGE_SIZE;
+
+    while (host > 0 && page < (unsigned long)host)
+        page <<= 1;
+
+    bat->page_size = page;
+    bat->page_shift = __builtin_ctz(page);
+}
+
+int gbc_battery_open(gbc_battery_t *bat, const char *path, size_t size, uint32_t interval_ms)
+{
+    struct stat st;
+
+    memset(bat, 0, sizeof(gbc_battery_t));
+    bat->fd = -1;
+    set_page_size(bat);
+
+    if (size > ((size_t)BATTERY_DIRTY_WORDS * 64) << bat->page_shift) {
+        LOG_ERROR("[BATTERY] save of %zu bytes is too large\n", size);
+        return -1;
+    }
+
+    bat->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (bat->fd < 0 || fstat(bat->fd, &st)) {
+        LOG_ERROR("[BATTERY] cannot open %s: %s\n", path, strerror(errno));
+        goto fail;
+    }
+
+    /* a new or short file is extended; extra bytes (e.g. an RTC footer) are kept */
+    size_t file_size = st.st_size;
+    if (file_size < size) {
+        if (ftruncate(bat->fd, size)) {
+            LOG_ERROR("[BATTERY] cannot resize %s: %s\n", path, strerror(errno));
+            goto fail;
+        }
+    }
+
+    bat->data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, bat->fd, 0);
+    if (bat->data == MAP_FAILED) {
+        LOG_ERROR("[BATTERY] mmap of %s failed: %s\n", path, strerror(errno));
+        bat->data = NULL;
+        goto fail;
+    }
+    bat->size = size;
+    bat->interval_ms = interval_ms ? interval_ms : BATTERY_DEFAULT_INTERVAL_MS;
+
+    /* fresh cartridge RAM reads as 0xFF */
+    if (file_size < size) {
+        memset(bat->data + file_size, 0xFF, size - file_size);
+        for (size_t offset = file_size; offset < size; offset += bat->page_size)
+            gbc_battery_mark(bat, offset);
+    }
+
+    pthread_mutex_init(&bat->lock, NULL);
+    pthread_cond_init(&bat->wake, NULL);
+    bat->running = 1;
+
+    if (pthread_create(&bat->flusher, NULL, battery_flusher, bat)) {
+        LOG_ERROR("[BATTERY] failed to start flusher, saving on close only\n");
+        bat->running = 0;
+    }
+
+    LOG_INFO("[BATTERY] %s mapped, %zu bytes, flush every %u ms\n", path, size, bat->interval_ms);
+    return 0;
+
+fail:
+    if (bat->fd >= 0)
+        close(bat->fd);
+    bat->fd = -1;
+    return -1;
+}
+
+void gbc_battery_close(gbc_battery_t *bat)
+{
+    if (!bat->data)
+        return;
+
+    if (bat->running) {
+        pthread_mutex_lock(&bat->lock);
+        bat->running = 0;
+        pthread_cond_signal(&bat->wake);
+        pthread_mutex_unlock(&bat->lock);
+        pthread_join(bat->flusher, NULL);
+    }
+
+    gbc_battery_flush(bat);
+
+    pthread_mutex_destroy(&bat->lock);
+    pthread_cond_destroy(&bat->wake);
+    munmap(bat->data, bat->size);
+    close(bat->fd);
+
+    bat->data = NULL;
+    bat->fd = -1;
+}
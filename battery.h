@@ -0,0 +1,43 @@
+#ifndef BATTERY_H
+#define BATTERY_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#define BATTERY_MIN_PAGE_SIZE 4096
+#define BATTERY_DIRTY_WORDS 2           /* up to 128 pages, 512 KB or more */
+#define BATTERY_DEFAULT_INTERVAL_MS 1000
+
+/* Cartridge RAM backed by a MAP_SHARED .sav file. Writes only set a dirty bit; a
+ * background thread msyncs dirty pages every 'interval_ms' and once more on close. */
+typedef struct gbc_battery {
+    int fd;
+    uint8_t *data;
+    size_t size;
+    uint32_t interval_ms;
+    uint32_t page_size;                     /* host page, msync needs aligned ranges */
+    uint8_t page_shift;
+
+    uint64_t dirty[BATTERY_DIRTY_WORDS];    /* one bit per page, atomic */
+
+    pthread_t flusher;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    uint8_t running;
+
+    uint64_t flushes;
+    uint64_t pages_flushed;
+} gbc_battery_t;
+
+static inline void gbc_battery_mark(gbc_battery_t *bat, uint32_t offset)
+{
+    uint32_t page = offset >> bat->page_shift;
+    __atomic_fetch_or(&bat->dirty[page >> 6], 1ULL << (page & 63), __ATOMIC_RELAXED);
+}
+
+int gbc_battery_open(gbc_battery_t *bat, const char *path, size_t size, uint32_t interval_ms);
+void gbc_battery_flush(gbc_battery_t *bat);
+void gbc_battery_close(gbc_battery_t *bat);
+
+#endif
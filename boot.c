@@ -0,0 +1,235 @@
+#include <string.h>
+#include "boot.h"
+#include "common.h"
+
+typedef struct {
+    uint8_t port;
+    uint8_t value;
+} boot_port_t;
+
+/* https://gbdev.io/pandocs/Power_Up_Sequence.html, CGB column. Ports the table leaves
+ * unspecified (DIV, STAT, LY, OBP0/1, BCPS/OCPS) keep their power-on values. */
+static const boot_port_t boot_ports[] = {
+    {IO_PORT_P1, 0xCF},   {IO_PORT_SB, 0x00},   {IO_PORT_SC, 0x7F},
+    {IO_PORT_TAC, 0xF8},  {IO_PORT_IF, 0xE1},
+    {IO_PORT_NR10, 0x80}, {IO_PORT_NR11, 0xBF}, {IO_PORT_NR12, 0xF3}, {IO_PORT_NR13, 0xFF},
+    {IO_PORT_NR14, 0xBF}, {IO_PORT_NR21, 0x3F}, {IO_PORT_NR22, 0x00}, {IO_PORT_NR23, 0xFF},
+    {IO_PORT_NR24, 0xBF}, {IO_PORT_NR30, 0x7F}, {IO_PORT_NR31, 0xFF}, {IO_PORT_NR32, 0x9F},
+    {IO_PORT_NR33, 0xFF}, {IO_PORT_NR34, 0xBF}, {IO_PORT_NR41, 0xFF}, {IO_PORT_NR42, 0x00},
+    {IO_PORT_NR43, 0x00}, {IO_PORT_NR44, 0xBF}, {IO_PORT_NR50, 0x77}, {IO_PORT_NR51, 0xF3},
+    {IO_PORT_NR52, 0xF1},
+    {IO_PORT_LCDC, 0x91}, {IO_PORT_SCY, 0x00},  {IO_PORT_SCX, 0x00},  {IO_PORT_LYC, 0x00},
+    {IO_PORT_DMA, 0x00},  {IO_PORT_BGP, 0xFC},  {IO_PORT_WY, 0x00},   {IO_PORT_WX, 0x00},
+    {IO_PORT_KEY1, 0x7E}, {IO_PORT_VBK, 0xFE},
+    {IO_PORT_HDMA1, 0xFF}, {IO_PORT_HDMA2, 0xFF}, {IO_PORT_HDMA3, 0xFF}, {IO_PORT_HDMA4, 0xFF},
+    {IO_PORT_HDMA5, 0xFF}, {IO_PORT_RP, 0x3E},   {IO_PORT_SVBK, 0xF8},
+};
+
+/* The CGB boot ROM's compatibility palettes for DMG carts, as its data tables hold them.
+ * A title picks one of compat_combos by its checksum, and a combo picks the OBJ0, OBJ1 and
+ * BG colours as offsets into compat_colors. Three combos start one colour before a
+ * palette, which the boot ROM does too. */
+static const uint16_t compat_colors[30 * 4] = {
+    0x7FFF, 0x32BF, 0x00D0, 0x0000,   0x639F, 0x4279, 0x15B0, 0x04CB,
+    0x7FFF, 0x6E31, 0x454A, 0x0000,   0x7FFF, 0x1BEF, 0x0200, 0x0000,
+    0x7FFF, 0x421F, 0x1CF2, 0x0000,   0x7FFF, 0x5294, 0x294A, 0x0000,
+    0x7FFF, 0x03FF, 0x012F, 0x0000,   0x7FFF, 0x03EF, 0x01D6, 0x0000,
+    0x7FFF, 0x42B5, 0x3DC8, 0x0000,   0x7E74, 0x03FF, 0x0180, 0x0000,
+    0x67FF, 0x77AC, 0x1A13, 0x2D6B,   0x7ED6, 0x4BFF, 0x2175, 0x0000,
+    0x53FF, 0x4A5F, 0x7E52, 0x0000,   0x4FFF, 0x7ED2, 0x3A4C, 0x1CE0,
+    0x03ED, 0x7FFF, 0x255F, 0x0000,   0x036A, 0x021F, 0x03FF, 0x7FFF,
+    0x7FFF, 0x01DF, 0x0112, 0x0000,   0x231F, 0x035F, 0x00F2, 0x0009,
+    0x7FFF, 0x03EA, 0x011F, 0x0000,   0x299F, 0x001A, 0x000C, 0x0000,
+    0x7FFF, 0x027F, 0x001F, 0x0000,   0x7FFF, 0x03E0, 0x0206, 0x0120,
+    0x7FFF, 0x7EEB, 0x001F, 0x7C00,   0x7FFF, 0x3FFF, 0x7E00, 0x001F,
+    0x7FFF, 0x03FF, 0x001F, 0x0000,   0x03FF, 0x001F, 0x000C, 0x0000,
+    0x7FFF, 0x033F, 0x0193, 0x0000,   0x0000, 0x4200, 0x037F, 0x7FFF,
+    0x7FFF, 0x7E8C, 0x7C00, 0x0000,   0x7FFF, 0x1BEF, 0x6180, 0x0000,
+};
+
+typedef struct {
+    uint8_t obj0;
+    uint8_t obj1;
+    uint8_t bg;
+} compat_combo_t;
+
+#define BOOT_COMPAT_DMG_MAP 0x80
+
+#define COMPAT(obj0, obj1, bg) { (obj0) * 4, (obj1) * 4, (bg) * 4 }
+
+static const compat_combo_t compat_combos[] = {
+    COMPAT(4, 4, 29), COMPAT(18, 18, 18), COMPAT(20, 20, 20), COMPAT(24, 24, 24), COMPAT(9, 9, 9),
+    COMPAT(0, 0, 0), COMPAT(27, 27, 27), COMPAT(5, 5, 5), COMPAT(12, 12, 12), COMPAT(26, 26, 26),
+    COMPAT(16, 8, 8), COMPAT(4, 28, 28), COMPAT(4, 2, 2), COMPAT(3, 4, 4), COMPAT(4, 29, 29),
+    COMPAT(28, 4, 28), COMPAT(2, 17, 2), COMPAT(16, 16, 8), COMPAT(4, 4, 7), COMPAT(4, 4, 18),
+    COMPAT(4, 4, 20), COMPAT(19, 19, 9), { 4 * 4 - 1, 4 * 4 - 1, 11 * 4 }, COMPAT(17, 17, 2), COMPAT(4, 4, 2),
+    COMPAT(4, 4, 3), COMPAT(28, 28, 0), COMPAT(3, 3, 0), COMPAT(0, 0, 1), COMPAT(18, 22, 18),
+    COMPAT(20, 22, 20), COMPAT(24, 22, 24), COMPAT(16, 22, 8), COMPAT(17, 4, 13), { 28 * 4 - 1, 0 * 4, 14 * 4 },
+    { 28 * 4 - 1, 4 * 4, 15 * 4 }, COMPAT(19, 22, 9), COMPAT(16, 28, 10), COMPAT(4, 23, 28), COMPAT(17, 22, 2),
+    COMPAT(4, 0, 2), COMPAT(4, 28, 3), COMPAT(28, 3, 0), COMPAT(3, 28, 4), COMPAT(21, 28, 4),
+    COMPAT(3, 28, 0), COMPAT(25, 3, 28), COMPAT(0, 28, 8), COMPAT(4, 3, 28), COMPAT(28, 3, 6),
+    COMPAT(4, 28, 29),
+};
+
+/* Title checksums; from COMPAT_FIRST_DUPLICATE on, several titles share a checksum and
+ * the 4th title letter in compat_letters tells them apart */
+#define COMPAT_TITLES 94
+#define COMPAT_FIRST_DUPLICATE 65
+
+static const uint8_t compat_checksums[COMPAT_TITLES] = {
+    0x00, 0x88, 0x16, 0x36, 0xD1, 0xDB, 0xF2, 0x3C, 0x8C, 0x92, 0x3D, 0x5C,
+    0x58, 0xC9, 0x3E, 0x70, 0x1D, 0x59, 0x69, 0x19, 0x35, 0xA8, 0x14, 0xAA,
+    0x75, 0x95, 0x99, 0x34, 0x6F, 0x15, 0xFF, 0x97, 0x4B, 0x90, 0x17, 0x10,
+    0x39, 0xF7, 0xF6, 0xA2, 0x49, 0x4E, 0x43, 0x68, 0xE0, 0x8B, 0xF0, 0xCE,
+    0x0C, 0x29, 0xE8, 0xB7, 0x86, 0x9A, 0x52, 0x01, 0x9D, 0x71, 0x9C, 0xBD,
+    0x5D, 0x6D, 0x67, 0x3F, 0x6B, 0xB3, 0x46, 0x28, 0xA5, 0xC6, 0xD3, 0x27,
+    0x61, 0x18, 0x66, 0x6A, 0xBF, 0x0D, 0xF4, 0xB3, 0x46, 0x28, 0xA5, 0xC6,
+    0xD3, 0x27, 0x61, 0x18, 0x66, 0x6A, 0xBF, 0x0D, 0xF4, 0xB3,
+};
+
+static const char compat_letters[COMPAT_TITLES - COMPAT_FIRST_DUPLICATE + 1] = "BEFAARBEKEK R-URAR INAILICE R";
+
+/* combo per title, BOOT_COMPAT_DMG_MAP for titles that read back the boot tilemap */
+static const uint8_t compat_titles[COMPAT_TITLES] = {
+    0, 4, 5, 35, 34, 3, 31, 15, 10, 5, 19, 36, 7 | BOOT_COMPAT_DMG_MAP,
+    37, 30, 44, 21, 32, 31, 20, 5, 33, 13, 14, 5, 29,
+    5, 18, 9, 3, 2, 26, 25, 25, 41, 42, 26, 45, 42,
+    45, 36, 38, 26 | BOOT_COMPAT_DMG_MAP, 42, 30, 41, 34, 34, 5, 42, 6, 5,
+    33, 25, 42, 42, 40, 2, 16, 25, 42, 42, 5, 0, 39,
+    36, 22, 25, 6, 32, 12, 36, 11, 39, 18, 39, 24, 31,
+    50, 17, 46, 6, 27, 0, 47, 41, 41, 0, 0, 19, 34,
+    23, 18, 29,
+};
+
+/* Sum of the title bytes, which the boot ROM only trusts for Nintendo-published carts */
+uint8_t gbc_boot_title_checksum(cartridge_t *cart)
+{
+    uint8_t nintendo = cart->old_licensee_code == 0x01;
+    uint8_t sum = 0;
+
+    if (cart->old_licensee_code == 0x33)
+        nintendo = !memcmp(&cart->new_licensee_code, "01", 2);
+    if (!nintendo)
+        return 0;
+
+    for (int i = 0; i < 16; i++)
+        sum += cart->title[i];
+    return sum;
+}
+
+static void set_palette(gbc_palette_t *palette, const uint16_t *colors)
+{
+    memcpy(palette->c, colors, sizeof(palette->c));
+}
+
+/* compat_titles entry the boot ROM picks for a DMG cart, the default for unknown titles */
+static uint8_t compat_title(cartridge_t *cart)
+{
+    uint8_t checksum = gbc_boot_title_checksum(cart);
+
+    for (int i = 0; i < COMPAT_TITLES; i++) {
+        if (compat_checksums[i] != checksum)
+            continue;
+        if (i >= COMPAT_FIRST_DUPLICATE && cart->title[3] != compat_letters[i - COMPAT_FIRST_DUPLICATE])
+            continue;
+        return compat_titles[i];
+    }
+    return compat_titles[0];
+}
+
+/* bitplane 0 of a tile row, every other byte, as the boot ROM copies it */
+static void vram_row(gbc_graphic_t *graphic, uint16_t addr, uint8_t bits)
+{
+    GRAPHIC_VRAM_WRITE(graphic, addr - VRAM_START, bits);
+    GRAPHIC_VRAM_WRITE(graphic, addr - VRAM_START + 1, 0x00);
+}
+
+/* each logo bit doubled in width */
+static uint8_t logo_wide(uint8_t nibble)
+{
+    uint8_t bits = 0;
+    for (int b = 0; b < 4; b++) {
+        if (nibble & (1 << b))
+            bits |= 0x03 << (b * 2);
+    }
+    return bits;
+}
+
+/* The header logo at twice its size in tiles 1-24 with the (R) mark in tile 25, and for
+ * DMG carts the tilemap that shows them, as the boot ROM leaves VRAM bank 0 */
+static void boot_logo(gbc_graphic_t *graphic, cartridge_t *cart)
+{
+    static const uint8_t registered[8] = { 0x3C, 0x42, 0xB9, 0xA5, 0xB9, 0xA5, 0x42, 0x3C };
+    uint16_t addr = BOOT_LOGO_TILES;
+
+    for (size_t i = 0; i < sizeof(cart->logo); i++) {
+        uint8_t hi = logo_wide(cart->logo[i] >> 4);
+        uint8_t lo = logo_wide(cart->logo[i] & 0x0F);
+
+        /* and twice its height */
+        vram_row(graphic, addr, hi);
+        vram_row(graphic, addr + 2, hi);
+        vram_row(graphic, addr + 4, lo);
+        vram_row(graphic, addr + 6, lo);
+        addr += 8;
+    }
+    for (int i = 0; i < 8; i++)
+        vram_row(graphic, addr + i * 2, registered[i]);
+
+    if (cartridge_is_cgb(cart))
+        return;
+
+    for (int i = 0; i < BOOT_LOGO_WIDTH; i++) {
+        GRAPHIC_VRAM_WRITE(graphic, BOOT_LOGO_MAP - VRAM_START + i, 1 + i);
+        GRAPHIC_VRAM_WRITE(graphic, BOOT_LOGO_MAP + 0x20 - VRAM_START + i, 1 + BOOT_LOGO_WIDTH + i);
+    }
+    GRAPHIC_VRAM_WRITE(graphic, BOOT_LOGO_MAP - VRAM_START + BOOT_LOGO_WIDTH, 1 + 2 * BOOT_LOGO_WIDTH);
+}
+
+/* Leaves the machine as the CGB boot ROM does when it jumps to 0x0100, without running
+ * it. DMG carts get compatibility mode with the palettes the boot ROM picks by title. */
+void gbc_boot_skip(gbc_cpu_t *cpu, gbc_memory_t *mem, gbc_graphic_t *graphic, cartridge_t *cart)
+{
+    static const uint16_t white[4] = { 0x7FFF, 0x7FFF, 0x7FFF, 0x7FFF };
+    cpu_register_t *reg = &cpu->reg;
+
+    for (size_t i = 0; i < sizeof(boot_ports) / sizeof(boot_ports[0]); i++)
+        IO_PORT_WRITE(mem, boot_ports[i].port, boot_ports[i].value);
+    IO_PORT_WRITE(mem, IO_PORT_IE, 0x00);
+    cpu->ier = 0;
+    cpu->ime = 0;
+
+    WRITE_R16(reg, REG_AF, 0x1180);
+    WRITE_R16(reg, REG_SP, 0xFFFE);
+    WRITE_R16(reg, REG_PC, 0x0100);
+
+    if (cartridge_is_cgb(cart)) {
+        WRITE_R16(reg, REG_BC, 0x0000);
+        WRITE_R16(reg, REG_DE, 0xFF56);
+        WRITE_R16(reg, REG_HL, 0x000D);
+
+        IO_PORT_WRITE(mem, IO_PORT_KEY0, cart->cart_cgb_flag);
+        for (int i = 0; i < 8; i++)
+            set_palette(mem->bg_palette + i, white);
+    } else {
+        uint8_t title = compat_title(cart);
+        const compat_combo_t *combo = compat_combos + (title & ~BOOT_COMPAT_DMG_MAP);
+
+        WRITE_R8(reg, REG_B, gbc_boot_title_checksum(cart));
+        WRITE_R8(reg, REG_C, 0x00);
+        WRITE_R16(reg, REG_DE, 0x0008);
+        WRITE_R16(reg, REG_HL, (title & BOOT_COMPAT_DMG_MAP) ? 0x991A : 0x007C);
+
+        /* objects are prioritized by OAM position, like on a DMG */
+        IO_PORT_WRITE(mem, IO_PORT_KEY0, BOOT_KEY0_DMG_COMPAT);
+        IO_PORT_WRITE(mem, IO_PORT_OPRI, 0x01);
+        set_palette(mem->bg_palette, compat_colors + combo->bg);
+        set_palette(mem->obj_palette, compat_colors + combo->obj0);
+        set_palette(mem->obj_palette + 1, compat_colors + combo->obj1);
+    }
+    boot_logo(graphic, cart);
+
+    IO_PORT_WRITE(mem, IO_PORT_BANK, 0x01);
+    mem->boot_rom_enabled = 0;
+    LOG_DEBUG("[BOOT] skipped the boot ROM, %s mode\n", cartridge_is_cgb(cart) ? "CGB" : "DMG compatibility");
+}
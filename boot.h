@@ -0,0 +1,21 @@
+#ifndef BOOT_H
+#define BOOT_H
+
+#include <stdint.h>
+#include "cpu.h"
+#include "memory.h"
+#include "graphics.h"
+#include "cartridge.h"
+
+/* KEY0 as the boot ROM leaves it */
+#define BOOT_KEY0_DMG_COMPAT 0x04
+
+/* Where the boot ROM leaves the logo: tiles from 0x8010, two rows of 12 in the map */
+#define BOOT_LOGO_TILES 0x8010
+#define BOOT_LOGO_MAP   0x9904
+#define BOOT_LOGO_WIDTH 12
+
+uint8_t gbc_boot_title_checksum(cartridge_t *cart);
+void gbc_boot_skip(gbc_cpu_t *cpu, gbc_memory_t *mem, gbc_graphic_t *graphic, cartridge_t *cart);
+
+#endif
@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "bootcache.h"
+#include "common.h"
+#include "utils.h"
+
+typedef struct bootcache_header {
+    uint64_t magic;
+    uint64_t key;
+    uint64_t frames;            /* gbc->frames at the snapshot */
+    uint64_t size;              /* state bytes that follow */
+} bootcache_header_t;
+
+int gbc_bootcache_init(gbc_bootcache_t *bc, const char *dir)
+{
+    memset(bc, 0, sizeof(gbc_bootcache_t));
+
+    if (strlen(dir) >= BOOTCACHE_PATH_MAX) {
+        LOG_ERROR("[BOOTCACHE] path too long: %s\n", dir);
+        return -1;
+    }
+    if (mkdir(dir, 0755) && errno != EEXIST) {
+        LOG_ERROR("[BOOTCACHE] cannot create %s\n", dir);
+        return -1;
+    }
+
+    strcpy(bc->dir, dir);
+    return 0;
+}
+
+/* Everything that decides what the machine looks like at the boot point. Taken right
+ * after gbc_create, so cartridge RAM is whatever the .sav held. */
+static uint64_t boot_key(gbc_t *gbc, const gbc_config_t *config, const gbc_boot_point_t *point)
+{
+    uint64_t key = hash64(&point->frames, sizeof(point->frames), gbc_rom_hash(gbc->rom));
+    uint32_t version = STATE_VERSION;
+
+    key = hash64(&version, sizeof(version), key);
+    key = hash64(&config->rtc_clock, sizeof(config->rtc_clock), key);
+    key = hash64(&gbc->mem.boot_rom_enabled, sizeof(gbc->mem.boot_rom_enabled), key);
+    key = hash64(gbc->mem.boot_rom, sizeof(gbc->mem.boot_rom), key);
+    if (point->buttons)
+        key = hash64(point->buttons, point->frames, key);
+    if (gbc->mbc.ram_banks)
+        key = hash64(gbc->mbc.ram_banks, gbc->mbc.ram_size, key);
+    return key;
+}
+
+/* 'path' holds BOOTCACHE_PATH_MAX + BOOTCACHE_NAME_MAX bytes */
+static void cache_path(gbc_bootcache_t *bc, uint64_t key, char *path)
+{
+    snprintf(path, BOOTCACHE_PATH_MAX + BOOTCACHE_NAME_MAX, "%s/%016llx.boot", bc->dir, (unsigned long long)key);
+}
+
+static int cache_load(gbc_t *gbc, const char *path, uint64_t key)
+{
+    gbc_state_components_t c;
+    bootcache_header_t header;
+    int ret = -1;
+
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+        return -1;
+
+    gbc_get_components(gbc, &c);
+    size_t size = gbc_state_size(&c);
+    uint8_t *buf = malloc_memory(size);
+
+    if (buf && fread(&header, sizeof(header), 1, fp) == 1 &&
+        header.magic == BOOTCACHE_MAGIC && header.key == key && header.size == size &&
+        fread(buf, 1, size, fp) == size && !gbc_load_state(gbc, buf, size)) {
+        gbc->frames = header.frames;
+        ret = 0;
+    }
+
+    fclose(fp);
+    free_memory(buf);
+    return ret;
+}
+
+static int cache_store(gbc_t *gbc, const char *path, uint64_t key)
+{
+    gbc_state_components_t c;
+    char tmp[BOOTCACHE_PATH_MAX + 2 * BOOTCACHE_NAME_MAX];
+
+    gbc_get_components(gbc, &c);
+    size_t size = gbc_state_size(&c);
+    uint8_t *buf = malloc_memory(size);
+    if (!buf)
+        return -1;
+
+    bootcache_header_t header = { BOOTCACHE_MAGIC, key, gbc->frames, size };
+    gbc_state_save(&c, buf, size);
+
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+    FILE *fp = fopen(tmp, "wb");
+    int ok = fp && fwrite(&header, sizeof(header), 1, fp) == 1 && fwrite(buf, 1, size, fp) == size;
+    if (fp && fclose(fp))
+        ok = 0;
+    free_memory(buf);
+
+    if (!ok || rename(tmp, path)) {
+        LOG_ERROR("[BOOTCACHE] failed to write %s\n", path);
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+static int run_to_point(gbc_t *gbc, const gbc_boot_point_t *point)
+{
+    uint32_t f;
+
+    for (f = 0; gbc->mem.boot_rom_enabled && f < BOOTCACHE_MAX_BOOT_FRAMES; f++)
+        gbc_run_frame(gbc);
+    if (gbc->mem.boot_rom_enabled) {
+        LOG_ERROR("[BOOTCACHE] boot ROM still mapped after %d frames\n", BOOTCACHE_MAX_BOOT_FRAMES);
+        return -1;
+    }
+
+    for (f = 0; f < point->frames; f++) {
+        io_set_buttons(&gbc->io, point->buttons ? point->buttons[f] : 0);
+        gbc_run_frame(gbc);
+    }
+    io_set_buttons(&gbc->io, 0);
+    return 0;
+}
+
+/* gbc_create, then either the cached snapshot for this ROM and point or a cold boot up
+ * to the point that fills the cache for next time */
+gbc_t* gbc_bootcache_create(gbc_bootcache_t *bc, const gbc_config_t *config, const gbc_boot_point_t *point)
+{
+    char path[BOOTCACHE_PATH_MAX + BOOTCACHE_NAME_MAX];
+    uint64_t start = get_time();
+
+    gbc_t *gbc = gbc_create(config);
+    if (!gbc)
+        return NULL;
+
+    uint64_t key = boot_key(gbc, config, point);
+    cache_path(bc, key, path);
+
+    if (!cache_load(gbc, path, key)) {
+        __atomic_fetch_add(&bc->hits, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&bc->cached_ns, get_time() - start, __ATOMIC_RELAXED);
+        return gbc;
+    }
+
+    if (run_to_point(gbc, point)) {
+        gbc_destroy(gbc);
+        return NULL;
+    }
+    __atomic_fetch_add(&bc->misses, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&bc->cold_ns, get_time() - start, __ATOMIC_RELAXED);
+
+    cache_store(gbc, path, key);
+    LOG_DEBUG("[BOOTCACHE] stored %s after %lu frames\n", path, (unsigned long)gbc->frames);
+    return gbc;
+}
+
+void gbc_bootcache_report(gbc_bootcache_t *bc)
+{
+    double cold = bc->misses ? bc->cold_ns / 1e6 / bc->misses : 0.0;
+    double cached = bc->hits ? bc->cached_ns / 1e6 / bc->hits : 0.0;
+
+    LOG_INFO("[BOOTCACHE] %lu cold starts at %.2f ms, %lu cached starts at %.2f ms%s\n",
+        (unsigned long)bc->misses, cold, (unsigned long)bc->hits, cached,
+        cold && cached ? "" : ", need both for a comparison");
+    if (cold && cached)
+        LOG_INFO("[BOOTCACHE] cached starts are %.1fx faster\n", cold / cached);
+}
@@ -0,0 +1,37 @@
+#ifndef BOOTCACHE_H
+#define BOOTCACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "gbc.h"
+
+#define BOOTCACHE_MAGIC   0x53544f4f42434247ULL  /* "GBCBOOTS" */
+#define BOOTCACHE_PATH_MAX 4096
+#define BOOTCACHE_NAME_MAX 32                   /* after the directory: "/<key>.boot", ".<pid>.tmp" */
+#define BOOTCACHE_MAX_BOOT_FRAMES 600           /* 10 s, the CGB boot ROM needs about 2 */
+
+/* Where a cached start begins: once the boot ROM has unmapped itself, after 'frames'
+ * further frames with buttons[i] (KEY_* bits, NULL for none) held on frame i. */
+typedef struct gbc_boot_point {
+    uint32_t frames;
+    const uint8_t *buttons;
+} gbc_boot_point_t;
+
+/* Machine snapshots on disk, one per ROM content, boot ROM, initial cartridge RAM, clock
+ * setting and boot point. Any number of processes can share the directory: files are
+ * written under a temporary name and renamed into place. */
+typedef struct gbc_bootcache {
+    char dir[BOOTCACHE_PATH_MAX];
+
+    /* statistics, atomic */
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t cold_ns;                           /* creation and emulation up to the point */
+    uint64_t cached_ns;                         /* creation and snapshot load */
+} gbc_bootcache_t;
+
+int gbc_bootcache_init(gbc_bootcache_t *bc, const char *dir);
+gbc_t* gbc_bootcache_create(gbc_bootcache_t *bc, const gbc_config_t *config, const gbc_boot_point_t *point);
+void gbc_bootcache_report(gbc_bootcache_t *bc);
+
+#endif
@@ -33,6 +33,13 @@
 #define CART_TYPE_HUC3 0xFE
 #define CART_TYPE_HUC1_RAM_BATTERY 0xFF
 
+#define CARTRIDGE_HEADER_OFFSET  0x100   /* cartridge_t starts at the entry point */
+#define CARTRIDGE_CODE_OFFSET    0x150
+#define CARTRIDGE_CHECKSUM_BEGIN 0x134   /* header checksum covers 0x134-0x14C */
+#define CARTRIDGE_CHECKSUM_END   0x14C
+
+#define CARTRIDGE_MAX_ROM_SIZE_CODE 0x08 /* 8 MB */
+
 /* https://gbdev.io/pandocs/The_Cartridge_Header.html */
 typedef struct {
     uint8_t entry_point[4];
@@ -58,6 +65,31 @@ typedef struct {
 #define cartridge_rom_size(cart)    (32 * (1 << (cart)->rom_size) * 1024)   
 #define cartridge_rom_banks(cart)   (2 << cart->rom_size)
 
+/* https://gbdev.io/pandocs/The_Cartridge_Header.html#0149--ram-size */
+#define cartridge_ram_size(cart) \
+    ((cart)->ram_size == 2 ? 0x2000 : (cart)->ram_size == 3 ? 0x8000 : \
+     (cart)->ram_size == 4 ? 0x20000 : (cart)->ram_size == 5 ? 0x10000 : 0)
+
+#define cartridge_has_rtc(cart) \
+    ((cart)->cartridge_type == CART_TYPE_MBC3_TIMER_BATTERY || \
+     (cart)->cartridge_type == CART_TYPE_MBC3_TIMER_RAM_BATTERY)
+
+#define cartridge_has_battery(cart) \
+    ((cart)->cartridge_type == CART_TYPE_MBC1_RAM_BATTERY || \
+     (cart)->cartridge_type == CART_TYPE_MBC2_BATTERY || \
+     (cart)->cartridge_type == CART_TYPE_ROM_RAM_BATTERY || \
+     (cart)->cartridge_type == CART_TYPE_MMM01_RAM_BATTERY || \
+     (cart)->cartridge_type == CART_TYPE_MBC3_TIMER_BATTERY || \
+     (cart)->cartridge_type == CART_TYPE_MBC3_TIMER_RAM_BATTERY || \
+     (cart)->cartridge_type == CART_TYPE_MBC3_RAM_BATTERY || \
+     (cart)->cartridge_type == CART_TYPE_MBC5_RAM_BATTERY || \
+     (cart)->cartridge_type == CART_TYPE_MBC5_RUMBLE_RAM_BATTERY || \
+     (cart)->cartridge_type == CART_TYPE_MBC7_SENSOR_RUMBLE_RAM_BATTERY || \
+     (cart)->cartridge_type == CART_TYPE_HUC1_RAM_BATTERY)
+
+#define CART_CGB_FLAG_CGB 0x80      /* 0x80 supports CGB, 0xC0 CGB only */
+#define cartridge_is_cgb(cart)      (((cart)->cart_cgb_flag & CART_CGB_FLAG_CGB) != 0)
+
 #define cartridge_code(cart)        ((uint8_t*)&(cart->code))
 #define cartridge_code_size(cart)   (cartridge_code(cart) - (uint8_t*)(cart) + cartridge_rom_size((cart)))
 
@@ -0,0 +1,194 @@
+#include <string.h>
+#include "cow.h"
+#include "common.h"
+#include "utils.h"
+
+void gbc_cow_pool_init(gbc_cow_pool_t *pool)
+{
+    memset(pool, 0, sizeof(gbc_cow_pool_t));
+}
+
+/* Every instance using the pool must be destroyed first */
+void gbc_cow_pool_free(gbc_cow_pool_t *pool)
+{
+    gbc_cow_slab_t *slab = pool->slabs;
+
+    if (pool->live)
+        LOG_ERROR("[COW] freeing a pool with %lu pages still shared\n", (unsigned long)pool->live);
+
+    while (slab) {
+        gbc_cow_slab_t *next = slab->next;
+        free_memory(slab->data);
+        free_memory(slab);
+        slab = next;
+    }
+    memset(pool, 0, sizeof(gbc_cow_pool_t));
+}
+
+/* Slab data is only touched once a page is actually copied into it */
+static int pool_grow(gbc_cow_pool_t *pool)
+{
+    gbc_cow_slab_t *slab = malloc_memory(sizeof(gbc_cow_slab_t));
+    if (!slab)
+        return -1;
+
+    slab->data = malloc_memory((size_t)COW_SLAB_PAGES * COW_PAGE_SIZE);
+    if (!slab->data) {
+        free_memory(slab);
+        return -1;
+    }
+
+    for (int i = 0; i < COW_SLAB_PAGES; i++) {
+        gbc_cow_page_t *p = slab->pages + i;
+        p->buf = slab->data + (size_t)i * COW_PAGE_SIZE;
+        p->pool = pool;
+        p->next = pool->free;
+        pool->free = p;
+    }
+
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+    pool->pages += COW_SLAB_PAGES;
+    return 0;
+}
+
+static gbc_cow_page_t* page_get(gbc_cow_pool_t *pool)
+{
+    if (!pool->free && pool_grow(pool))
+        return NULL;
+
+    gbc_cow_page_t *p = pool->free;
+    pool->free = p->next;
+    pool->live++;
+    return p;
+}
+
+static void page_put(gbc_cow_page_t *p)
+{
+    if (--p->refs)
+        return;
+
+    p->data = NULL;
+    p->owner = NULL;
+    p->next = p->pool->free;
+    p->pool->free = p;
+    p->pool->live--;
+}
+
+static uint32_t page_length(const gbc_cow_table_t *t, uint32_t page)
+{
+    uint32_t offset = page << COW_PAGE_SHIFT;
+    return t->size - offset < COW_PAGE_SIZE ? t->size - offset : COW_PAGE_SIZE;
+}
+
+/* The owner is about to change or free its flat page: the other holders keep a copy */
+static void page_donate(gbc_cow_page_t *p, uint32_t length)
+{
+    memcpy(p->buf, p->data, length);
+    p->data = p->buf;
+    p->owner = NULL;
+    p->pool->copies++;
+}
+
+/* Makes 'dst' see the current contents of 'src' without copying any data. Private
+ * pages of 'src' become shared pages that still live in its flat buffer. Whatever
+ * 'dst' had shared before is overwritten, not released. */
+int gbc_cow_share(gbc_cow_table_t *dst, gbc_cow_table_t *src, uint8_t *src_base, uint32_t size, gbc_cow_pool_t *pool)
+{
+    uint32_t pages = COW_PAGES(size);
+
+    if (pages > COW_MAX_PAGES)
+        return -1;
+
+    memset(dst, 0, sizeof(gbc_cow_table_t));
+    dst->size = size;
+    src->size = size;
+
+    for (uint32_t i = 0; i < pages; i++) {
+        gbc_cow_page_t *p = src->page[i];
+
+        if (!p) {
+            p = page_get(pool);
+            if (!p) {
+                gbc_cow_release(dst, NULL);
+                return -1;
+            }
+            p->refs = 1;
+            p->data = src_base + ((size_t)i << COW_PAGE_SHIFT);
+            p->owner = src_base;
+            src->page[i] = p;
+            src->shared++;
+        }
+
+        p->refs++;
+        dst->page[i] = p;
+        dst->shared++;
+    }
+
+    return 0;
+}
+
+/* Gives 'base' its own copy of one page */
+void gbc_cow_unshare(gbc_cow_table_t *t, uint8_t *base, uint32_t page)
+{
+    gbc_cow_page_t *p = t->page[page];
+    uint32_t length = page_length(t, page);
+
+    if (p->owner == base) {
+        /* the data is already ours, move the shared copy out of the way */
+        if (p->refs > 1)
+            page_donate(p, length);
+    } else {
+        memcpy(base + ((size_t)page << COW_PAGE_SHIFT), p->data, length);
+        p->pool->copies++;
+    }
+
+    t->page[page] = NULL;
+    t->shared--;
+    page_put(p);
+}
+
+/* Before the flat buffer is read or written as a whole */
+void gbc_cow_unshare_all(gbc_cow_table_t *t, uint8_t *base)
+{
+    for (uint32_t i = 0; t->shared && i < COW_MAX_PAGES; i++) {
+        if (t->page[i])
+            gbc_cow_unshare(t, base, i);
+    }
+}
+
+/* Drops every shared page without copying, before 'base' is freed or overwritten */
+void gbc_cow_release(gbc_cow_table_t *t, uint8_t *base)
+{
+    for (uint32_t i = 0; t->shared && i < COW_MAX_PAGES; i++) {
+        gbc_cow_page_t *p = t->page[i];
+        if (!p)
+            continue;
+        if (base && p->owner == base && p->refs > 1)
+            page_donate(p, page_length(t, i));
+        t->page[i] = NULL;
+        t->shared--;
+        page_put(p);
+    }
+}
+
+/* Reads the first 'size' bytes of the region as the instance sees them */
+void gbc_cow_copy_out(const gbc_cow_table_t *t, const uint8_t *base, uint8_t *dst, uint32_t size)
+{
+    if (!t->shared) {
+        memcpy(dst, base, size);
+        return;
+    }
+
+    for (uint32_t offset = 0; offset < size; offset += COW_PAGE_SIZE) {
+        uint32_t length = size - offset < COW_PAGE_SIZE ? size - offset : COW_PAGE_SIZE;
+        memcpy(dst + offset, gbc_cow_ptr(t, base, offset), length);
+    }
+}
+
+void gbc_cow_pool_report(gbc_cow_pool_t *pool)
+{
+    LOG_INFO("[COW] %lu forks, %lu/%lu pages shared, %lu pages copied (%lu KB)\n",
+        (unsigned long)pool->forks, (unsigned long)pool->live, (unsigned long)pool->pages,
+        (unsigned long)pool->copies, (unsigned long)(pool->copies * COW_PAGE_SIZE / 1024));
+}
@@ -0,0 +1,95 @@
+#ifndef COW_H
+#define COW_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Copy-on-write sharing of the flat RAM regions (WRAM, VRAM, cartridge RAM) between
+ * forked instances, at 4 KB page granularity. A region keeps its own flat buffer; a
+ * table next to it lists the pages that currently come from a shared page instead.
+ * The first store to such a page copies it into the flat buffer and drops the table
+ * entry, so reads cost one extra test while nothing is shared. */
+#define COW_PAGE_SHIFT 12
+#define COW_PAGE_SIZE  (1 << COW_PAGE_SHIFT)
+#define COW_PAGE_MASK  (COW_PAGE_SIZE - 1)
+#define COW_PAGES(size) (((size) + COW_PAGE_SIZE - 1) >> COW_PAGE_SHIFT)
+#define COW_MAX_PAGES  32           /* 128 KB, the largest cartridge RAM */
+#define COW_SLAB_PAGES 64           /* pages the pool grows by */
+
+typedef struct gbc_cow_pool gbc_cow_pool_t;
+
+/* The shared copy of one page. While 'owner' is set the data still lives in that
+ * region's flat buffer; the owner moves it into 'buf' before writing over it. */
+typedef struct gbc_cow_page {
+    uint32_t refs;
+    uint8_t *data;
+    uint8_t *owner;
+    uint8_t *buf;                   /* COW_PAGE_SIZE bytes from the pool's slab */
+    gbc_cow_pool_t *pool;
+    struct gbc_cow_page *next;      /* free list */
+} gbc_cow_page_t;
+
+typedef struct gbc_cow_slab {
+    struct gbc_cow_slab *next;
+    gbc_cow_page_t pages[COW_SLAB_PAGES];
+    uint8_t *data;
+} gbc_cow_slab_t;
+
+/* Page allocator for a family of forks. Not thread safe: a parent and every instance
+ * forked from it must run on the same thread. */
+struct gbc_cow_pool {
+    gbc_cow_page_t *free;
+    gbc_cow_slab_t *slabs;
+    uint32_t users;                 /* instances of the family still alive */
+
+    /* statistics */
+    uint64_t pages;                 /* page objects allocated from the heap */
+    uint64_t live;                  /* page objects in use */
+    uint64_t copies;                /* pages copied by writes, both directions */
+    uint64_t forks;
+};
+
+typedef struct gbc_cow_table {
+    gbc_cow_page_t *page[COW_MAX_PAGES];
+    uint16_t shared;                /* entries set, 0 means the flat buffer is all there is */
+    uint32_t size;
+} gbc_cow_table_t;
+
+void gbc_cow_pool_init(gbc_cow_pool_t *pool);
+void gbc_cow_pool_free(gbc_cow_pool_t *pool);
+void gbc_cow_pool_report(gbc_cow_pool_t *pool);
+int gbc_cow_share(gbc_cow_table_t *dst, gbc_cow_table_t *src, uint8_t *src_base, uint32_t size, gbc_cow_pool_t *pool);
+void gbc_cow_unshare(gbc_cow_table_t *t, uint8_t *base, uint32_t page);
+void gbc_cow_unshare_all(gbc_cow_table_t *t, uint8_t *base);
+void gbc_cow_release(gbc_cow_table_t *t, uint8_t *base);
+void gbc_cow_copy_out(const gbc_cow_table_t *t, const uint8_t *base, uint8_t *dst, uint32_t size);
+
+static inline uint8_t gbc_cow_read(const gbc_cow_table_t *t, const uint8_t *base, uint32_t offset)
+{
+    if (t->shared) {
+        gbc_cow_page_t *p = t->page[offset >> COW_PAGE_SHIFT];
+        if (p)
+            return p->data[offset & COW_PAGE_MASK];
+    }
+    return base[offset];
+}
+
+/* For the renderer's tile fetches, which never cross a page */
+static inline const uint8_t* gbc_cow_ptr(const gbc_cow_table_t *t, const uint8_t *base, uint32_t offset)
+{
+    if (t->shared) {
+        gbc_cow_page_t *p = t->page[offset >> COW_PAGE_SHIFT];
+        if (p)
+            return p->data + (offset & COW_PAGE_MASK);
+    }
+    return base + offset;
+}
+
+/* Call before every store into a region that may be shared */
+#define COW_TOUCH(t, base, offset)                                              \
+    do {                                                                        \
+        if ((t)->shared && (t)->page[(offset) >> COW_PAGE_SHIFT])               \
+            gbc_cow_unshare((t), (base), (offset) >> COW_PAGE_SHIFT);           \
+    } while (0)
+
+#endif
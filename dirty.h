@@ -0,0 +1,22 @@
+#ifndef DIRTY_H
+#define DIRTY_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+/* One bit per 256-byte page of a writable region, set on every store and cleared by the
+ * incremental snapshots (gbc_state_update, gbc_state_restore). Only the emulation thread
+ * touches these, so marking is a plain OR; the store macros add it to their COW test, and
+ * MBC_RAM_WRITE to the battery mark. */
+#define DIRTY_PAGE_SHIFT 8
+#define DIRTY_PAGE_SIZE  (1 << DIRTY_PAGE_SHIFT)
+#define DIRTY_WORDS(size) (((((size) + DIRTY_PAGE_SIZE - 1) >> DIRTY_PAGE_SHIFT) + 63) / 64)
+
+#define DIRTY_MARK(bitmap, offset) \
+    ((bitmap)[(offset) >> (DIRTY_PAGE_SHIFT + 6)] |= 1ULL << (((offset) >> DIRTY_PAGE_SHIFT) & 63))
+
+#define DIRTY_CLEAR(bitmap) memset((bitmap), 0, sizeof(bitmap))
+#define DIRTY_SET_ALL(bitmap) memset((bitmap), 0xFF, sizeof(bitmap))
+
+#endif
@@ -0,0 +1,567 @@
+#include <pthread.h>
+#include <stddef.h>
+#include <string.h>
+#include "gbc.h"
+#include "boot.h"
+#include "common.h"
+#include "utils.h"
+
+static int gbc_load_cartridge(gbc_t *gbc, const gbc_config_t *config)
+{
+    gbc->rom = gbc_rom_open(config->rom_path, config->rom_flags);
+    if (!gbc->rom)
+        return -1;
+
+    cartridge_t *cart = gbc->rom->cart;
+
+    gbc_mbc_init(&gbc->mbc);
+    gbc->mbc.rom_banks = gbc->rom->data;
+    gbc->mbc.rom_bank_map = gbc->rom->bank_map;
+
+    int ret = config->save_path ?
+        gbc_mbc_open_save(&gbc->mbc, cart, config->save_path, config->save_interval_ms,
+                          config->rtc_clock) :
+        gbc_mbc_alloc_ram(&gbc->mbc, cart, config->rtc_clock);
+    if (ret)
+        return -1;
+
+    gbc_mbc_init_with_cart(&gbc->mbc, cart);
+    return 0;
+}
+
+static void framebuffer_write(void *udata, uint16_t addr, uint16_t data)
+{
+    gbc_t *gbc = (gbc_t*)udata;
+
+    if (addr < GBC_SCREEN_PIXELS)
+        gbc->framebuffer[addr] = data;
+}
+
+static void detach_audio(gbc_t *gbc)
+{
+    if (gbc->audio_log)
+        gbc_audio_log_cleanup(gbc->audio_log);
+    free_memory(gbc->audio_log);
+    free_memory(gbc->synth);
+    gbc->audio_log = NULL;
+    gbc->synth = NULL;
+}
+
+/* Routes the audio range through a register log into a synthesizer that starts from the
+ * current I/O ports */
+static int attach_audio(gbc_t *gbc, uint8_t threaded)
+{
+    gbc->synth = malloc_memory(sizeof(gbc_audio_synth_t));
+    gbc->audio_log = malloc_memory(sizeof(gbc_audio_log_t));
+    if (!gbc->synth || !gbc->audio_log ||
+        gbc_audio_log_init(gbc->audio_log, gbc_audio_synth_write, gbc_audio_synth_render, gbc->synth, threaded)) {
+        free_memory(gbc->audio_log);
+        gbc->audio_log = NULL;
+        detach_audio(gbc);
+        return -1;
+    }
+
+    gbc_audio_synth_init(gbc->synth, NULL, NULL);
+    gbc_audio_synth_reset(gbc->synth, gbc->mem.io_ports + IO_PORT_NR10);
+    gbc_audio_log_connect(gbc->audio_log, &gbc->mem, &gbc->cpu);
+    return 0;
+}
+
+/* Everything but the cartridge: a reset keeps battery RAM and the RTC like a power cycle */
+static void power_on_components(gbc_t *gbc, gbc_state_components_t *c)
+{
+    gbc_get_components(gbc, c);
+    c->mbc = NULL;
+}
+
+gbc_t* gbc_create(const gbc_config_t *config)
+{
+    gbc_t *gbc = malloc_memory(sizeof(gbc_t));
+    if (!gbc)
+        return NULL;
+    memset(gbc, 0, sizeof(gbc_t));
+
+    if (gbc_load_cartridge(gbc, config))
+        goto fail;
+
+    cartridge_t *cart = gbc->rom->cart;
+
+    mem_init(&gbc->mem);
+    if (mem_alloc_banks(&gbc->mem, cart) || gbc_graphic_alloc_vram(&gbc->graphic, cart))
+        goto fail;
+    mem_connect_ram(&gbc->mem);
+
+    gbc_cpu_init(&gbc->cpu);
+    gbc_cpu_connect(&gbc->cpu, &gbc->mem);
+
+    gbc_graphic_init(&gbc->graphic);
+    gbc_graphic_connect(&gbc->graphic, &gbc->mem);
+    gbc_graphic_connect_vram(&gbc->graphic, &gbc->mem);
+    gbc->graphic.screen_udata = gbc;
+    gbc->graphic.screen_write = framebuffer_write;
+
+    gbc_timer_init(&gbc->timer);
+    gbc_timer_connect(&gbc->timer, &gbc->mem, &gbc->cpu);
+
+    gbc_mbc_connect(&gbc->mbc, &gbc->mem);
+    if (gbc->mbc.rtc.present)
+        gbc_rtc_connect(&gbc->mbc.rtc, &gbc->cpu);
+
+    io_init(&gbc->io);
+    io_connect(&gbc->io, &gbc->mem);
+
+    gbc_scheduler_init(&gbc->sched);
+    gbc_scheduler_connect(&gbc->sched, &gbc->cpu, &gbc->graphic, &gbc->timer);
+    gbc_idle_init(&gbc->idle);
+    gbc_idle_connect(&gbc->idle, &gbc->cpu, &gbc->sched);
+
+    if (config->skip_boot || !gbc->mem.boot_rom_enabled)
+        gbc_boot_skip(&gbc->cpu, &gbc->mem, &gbc->graphic, cart);
+    if (config->audio && attach_audio(gbc, config->audio == GBC_AUDIO_THREADED))
+        goto fail;
+
+    gbc_state_components_t c;
+    power_on_components(gbc, &c);
+    size_t size = gbc_state_size(&c);
+    gbc->power_on = malloc_memory(sizeof(gbc_power_on_t) + size);
+    if (!gbc->power_on)
+        goto fail;
+    gbc->power_on->refs = 1;
+    gbc->power_on->size = size;
+    if (!gbc_state_save(&c, gbc->power_on->data, size))
+        goto fail;
+
+    LOG_INFO("[GBC] %.16s ready\n", cart->title);
+    return gbc;
+
+fail:
+    LOG_ERROR("[GBC] cannot create a context for %s\n", config->rom_path);
+    gbc_destroy(gbc);
+    return NULL;
+}
+
+void gbc_destroy(gbc_t *gbc)
+{
+    if (!gbc)
+        return;
+
+    if (gbc->power_on && !__atomic_sub_fetch(&gbc->power_on->refs, 1, __ATOMIC_ACQ_REL))
+        free_memory(gbc->power_on);
+    gbc_obs_free(&gbc->obs);
+    detach_audio(gbc);
+    io_cleanup(&gbc->io);
+    gbc_mbc_free_ram(&gbc->mbc);
+    gbc_graphic_free_vram(&gbc->graphic);
+    mem_free_banks(&gbc->mem);
+    if (gbc->pool && !--gbc->pool->users) {
+        gbc_cow_pool_free(gbc->pool);
+        free_memory(gbc->pool);
+    }
+    if (gbc->rom)
+        gbc_rom_release(gbc->rom);
+    free_memory(gbc);
+}
+
+/* A private flat buffer whose pages all start out shared with 'src' */
+static int fork_region(gbc_cow_table_t *dst, uint8_t **dst_base, gbc_cow_table_t *src,
+    uint8_t *src_base, uint32_t size, gbc_cow_pool_t *pool)
+{
+    if (!size)
+        return 0;
+
+    *dst_base = malloc_memory(size);
+    if (!*dst_base)
+        return -1;
+    return gbc_cow_share(dst, src, src_base, size, pool);
+}
+
+/* Forks synthesize inline from the parent's last completed frame, into no sink */
+static int fork_audio(gbc_t *child, gbc_t *parent)
+{
+    gbc_audio_log_sync(parent->audio_log);
+    if (attach_audio(child, 0))
+        return -1;
+
+    memcpy(child->synth, parent->synth, sizeof(gbc_audio_synth_t));
+    child->synth->count = 0;
+    child->synth->sink = NULL;
+    child->synth->sink_udata = NULL;
+    memcpy(child->audio_log->channels, parent->audio_log->channels, sizeof(child->audio_log->channels));
+    return 0;
+}
+
+/* A copy of 'parent' that shares WRAM, VRAM and cartridge RAM with it copy-on-write, so
+ * the cost is the machine struct plus the pages either side writes afterwards. The fork
+ * keeps no save file and starts with an empty framebuffer until its next frame. Parent
+ * and forks share a page pool and must stay on one thread. */
+gbc_t* gbc_fork(gbc_t *parent)
+{
+    gbc_state_components_t c;
+
+    if (!parent->pool) {
+        parent->pool = malloc_memory(sizeof(gbc_cow_pool_t));
+        if (!parent->pool)
+            return NULL;
+        gbc_cow_pool_init(parent->pool);
+        parent->pool->users = 1;
+    }
+
+    gbc_t *child = malloc_memory(sizeof(gbc_t));
+    if (!child)
+        return NULL;
+
+    memcpy(child, parent, offsetof(gbc_t, framebuffer));
+    memset(child->framebuffer, 0, sizeof(child->framebuffer));
+    memset(&child->obs, 0, sizeof(child->obs));
+    child->power_on = parent->power_on;
+    __atomic_add_fetch(&child->power_on->refs, 1, __ATOMIC_RELAXED);
+    child->pool = parent->pool;
+    child->pool->users++;
+    child->audio_log = NULL;
+    child->synth = NULL;
+    gbc_rom_retain(child->rom);
+
+    /* nothing below may point back at the parent's buffers if we bail out */
+    child->mem.wram = NULL;
+    child->graphic.vram = NULL;
+    child->mbc.ram_banks = NULL;
+    memset(&child->mem.wram_cow, 0, sizeof(gbc_cow_table_t));
+    memset(&child->graphic.vram_cow, 0, sizeof(gbc_cow_table_t));
+    memset(&child->mbc.ram_cow, 0, sizeof(gbc_cow_table_t));
+    child->mbc.battery = NULL;
+    child->mbc.rtc.save = NULL;
+    child->mbc.rtc.battery = NULL;
+
+    gbc_get_components(child, &c);
+    gbc_state_relocate(&c, parent, sizeof(gbc_t), child);
+    child->io.memory = child->mem.io_ports;
+    gbc_scheduler_connect(&child->sched, &child->cpu, &child->graphic, &child->timer);
+    gbc_idle_connect(&child->idle, &child->cpu, &child->sched);
+
+    child->graphic.obs = NULL;
+    if (parent->graphic.obs) {
+        if (gbc_set_observation(child, parent->obs.width, parent->obs.height))
+            goto fail;
+        memcpy(child->obs.out, parent->obs.out, (size_t)parent->obs.width * parent->obs.height);
+    }
+    if (parent->audio_log && fork_audio(child, parent))
+        goto fail;
+
+    if (fork_region(&child->mem.wram_cow, &child->mem.wram, &parent->mem.wram_cow,
+            parent->mem.wram, (uint32_t)WRAM_BANK_SIZE * parent->mem.wram_banks, child->pool) ||
+        fork_region(&child->graphic.vram_cow, &child->graphic.vram, &parent->graphic.vram_cow,
+            parent->graphic.vram, (uint32_t)VRAM_BANK_SIZE * parent->graphic.vram_banks, child->pool) ||
+        fork_region(&child->mbc.ram_cow, &child->mbc.ram_banks, &parent->mbc.ram_cow,
+            parent->mbc.ram_banks, parent->mbc.ram_banks ? parent->mbc.ram_size : 0, child->pool))
+        goto fail;
+
+    child->pool->forks++;
+    return child;
+
+fail:
+    LOG_ERROR("[GBC] cannot fork\n");
+    gbc_destroy(child);
+    return NULL;
+}
+
+/* Forks 'forks' children, runs each for 'frames' frames with its own inputs, and reports
+ * the fork rate and what every fork ended up costing in memory. Returns forks per second. */
+double gbc_fork_benchmark(gbc_t *parent, uint32_t forks, uint32_t frames)
+{
+    gbc_t **children = malloc_memory(forks * sizeof(gbc_t*));
+    uint32_t n = 0;
+
+    if (!children)
+        return 0.0;
+
+    uint64_t start = get_time();
+    while (n < forks && (children[n] = gbc_fork(parent)))
+        n++;
+    uint64_t fork_ns = get_time() - start;
+
+    if (!n) {
+        free_memory(children);
+        return 0.0;
+    }
+
+    gbc_cow_pool_t *pool = parent->pool;
+    uint64_t copies = pool->copies;
+    for (uint32_t i = 0; i < n; i++) {
+        io_set_buttons(&children[i]->io, (uint8_t)(i * 0x9D));
+        for (uint32_t f = 0; f < frames; f++)
+            gbc_run_frame(children[i]);
+    }
+    copies = pool->copies - copies;
+
+    /* a full copy would be the struct and every region */
+    size_t full = sizeof(gbc_t) + (size_t)WRAM_BANK_SIZE * parent->mem.wram_banks +
+        (size_t)VRAM_BANK_SIZE * parent->graphic.vram_banks + (parent->mbc.ram_banks ? parent->mbc.ram_size : 0);
+    size_t per_fork = sizeof(gbc_t) + (size_t)(pool->pages * sizeof(gbc_cow_page_t) + copies * COW_PAGE_SIZE) / n;
+    double rate = fork_ns ? n * 1e9 / fork_ns : 0.0;
+
+    LOG_INFO("[GBC] %u forks in %.3f ms, %.0f forks/s, %zu bytes per fork after %u frames (full copy %zu)\n",
+        n, fork_ns / 1e6, rate, per_fork, frames, full);
+    gbc_cow_pool_report(pool);
+
+    for (uint32_t i = 0; i < n; i++)
+        gbc_destroy(children[i]);
+    free_memory(children);
+    return rate;
+}
+
+/* Runs the ROM with inline synthesis and again with the threaded log, under the same
+ * scripted inputs and emulated time, and checks both produced the same samples. Returns 0
+ * when they match. */
+int gbc_audio_compare(const gbc_config_t *config, uint32_t frames)
+{
+    gbc_config_t cfg = *config;
+    uint64_t checksum[2], total[2];
+
+    cfg.save_path = NULL;
+    cfg.rtc_clock = RTC_CLOCK_EMULATED;
+    for (int pass = 0; pass < 2; pass++) {
+        cfg.audio = pass ? GBC_AUDIO_THREADED : GBC_AUDIO_INLINE;
+        gbc_t *gbc = gbc_create(&cfg);
+        if (!gbc)
+            return -1;
+
+        uint32_t seed = 1;
+        for (uint32_t f = 0; f < frames; f++) {
+            seed = seed * 1103515245 + 12345;
+            io_set_buttons(&gbc->io, (f & 15) ? 0 : seed >> 24);
+            gbc_run_frame(gbc);
+        }
+
+        gbc_audio_log_sync(gbc->audio_log);
+        gbc_audio_synth_flush(gbc->synth);
+        checksum[pass] = gbc->synth->checksum;
+        total[pass] = gbc->synth->total;
+        gbc_destroy(gbc);
+    }
+
+    if (checksum[0] != checksum[1] || total[0] != total[1]) {
+        LOG_ERROR("[GBC] %s: threaded audio differs, %lu samples [%016llx] vs %lu inline [%016llx]\n",
+            config->rom_path, (unsigned long)total[1], (unsigned long long)checksum[1],
+            (unsigned long)total[0], (unsigned long long)checksum[0]);
+        return -1;
+    }
+
+    LOG_INFO("[GBC] %s: %lu samples identical inline and threaded [%016llx]\n",
+        config->rom_path, (unsigned long)total[0], (unsigned long long)checksum[0]);
+    return 0;
+}
+
+/* one context of the stress run: its own inputs, hashed at the end */
+static uint64_t stress_context(const gbc_config_t *config, uint32_t index, uint32_t frames)
+{
+    gbc_state_components_t c;
+    uint32_t seed = index + 1;
+
+    gbc_t *gbc = gbc_create(config);
+    if (!gbc)
+        return 0;
+
+    for (uint32_t f = 0; f < frames; f++) {
+        seed = seed * 1103515245 + 12345;
+        io_set_buttons(&gbc->io, (f & 7) ? 0 : seed >> 24);
+        gbc_run_frame(gbc);
+    }
+
+    gbc_get_components(gbc, &c);
+    uint64_t hash = gbc_state_hash(&c);
+    hash = hash64(gbc->framebuffer, sizeof(gbc->framebuffer), hash);
+    gbc_destroy(gbc);
+    return hash;
+}
+
+typedef struct stress_job {
+    const gbc_config_t *config;
+    uint32_t contexts;
+    uint32_t frames;
+    uint32_t next;              /* atomic */
+    uint64_t *hash;
+} stress_job_t;
+
+static void* stress_worker(void *arg)
+{
+    stress_job_t *job = (stress_job_t*)arg;
+    uint32_t i;
+
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->contexts)
+        job->hash[i] = stress_context(job->config, i, job->frames);
+    return NULL;
+}
+
+/* Creates, runs and destroys 'contexts' machines on 'threads' threads at once and checks
+ * each ended in the same state as the same context run alone. Returns the number of
+ * contexts that differ, -1 if the run could not start. */
+int gbc_stress(const gbc_config_t *config, uint32_t contexts, uint32_t threads, uint32_t frames)
+{
+    gbc_config_t cfg = *config;
+    stress_job_t job;
+    int failed = 0;
+
+    if (!contexts || !threads)
+        return -1;
+
+    /* nothing that depends on the host or on another context */
+    cfg.save_path = NULL;
+    cfg.rtc_clock = RTC_CLOCK_EMULATED;
+    cfg.audio = GBC_AUDIO_OFF;
+
+    uint64_t *solo = malloc_memory(contexts * sizeof(uint64_t));
+    uint64_t *hash = malloc_memory(contexts * sizeof(uint64_t));
+    pthread_t *tid = malloc_memory(threads * sizeof(pthread_t));
+    if (!solo || !hash || !tid) {
+        failed = -1;
+        goto out;
+    }
+
+    uint64_t start = get_time();
+    for (uint32_t i = 0; i < contexts; i++)
+        solo[i] = stress_context(&cfg, i, frames);
+    uint64_t solo_ns = get_time() - start;
+
+    job.config = &cfg;
+    job.contexts = contexts;
+    job.frames = frames;
+    job.next = 0;
+    job.hash = hash;
+
+    /* the calling thread is the last worker */
+    uint32_t started = 0;
+    start = get_time();
+    while (started + 1 < threads && !pthread_create(tid + started, NULL, stress_worker, &job))
+        started++;
+    stress_worker(&job);
+    for (uint32_t t = 0; t < started; t++)
+        pthread_join(tid[t], NULL);
+    uint64_t ns = get_time() - start;
+    started++;
+
+    for (uint32_t i = 0; i < contexts; i++) {
+        if (!solo[i] || hash[i] != solo[i]) {
+            LOG_ERROR("[GBC] context %u differs: %016llx on %u threads, %016llx alone\n",
+                i, (unsigned long long)hash[i], started, (unsigned long long)solo[i]);
+            failed++;
+        }
+    }
+
+    LOG_INFO("[GBC] %u contexts x %u frames: %.1f ms alone, %.1f ms on %u threads, %d differ\n",
+        contexts, frames, solo_ns / 1e6, ns / 1e6, started, failed);
+
+out:
+    free_memory(solo);
+    free_memory(hash);
+    free_memory(tid);
+    return failed;
+}
+
+/* The audio log and synthesizer live outside the state: after a load the NR52 shadow and
+ * the writes not rendered yet belong to the timeline that was left */
+static void state_loaded(gbc_t *gbc)
+{
+    if (gbc->audio_log) {
+        gbc_audio_log_reset(gbc->audio_log);
+        gbc_audio_synth_reset(gbc->synth, gbc->mem.io_ports + IO_PORT_NR10);
+    }
+}
+
+/* gbc_state_load for a whole instance; every path that loads a state goes through here */
+int gbc_load_state(gbc_t *gbc, const uint8_t *buf, size_t size)
+{
+    gbc_state_components_t c;
+
+    gbc_get_components(gbc, &c);
+    if (gbc_state_load(&c, buf, size))
+        return -1;
+
+    state_loaded(gbc);
+    return 0;
+}
+
+/* Back to the state gbc_create left, with the cartridge's bank registers at power-on values */
+int gbc_reset(gbc_t *gbc)
+{
+    gbc_state_components_t c;
+
+    /* cpu->cycles jumps back: the RTC keeps its reading across it */
+    power_on_components(gbc, &c);
+    if (gbc->mbc.rtc.present)
+        gbc_rtc_disconnect(&gbc->mbc.rtc);
+    int ret = gbc_state_load(&c, gbc->power_on->data, gbc->power_on->size);
+    if (gbc->mbc.rtc.present)
+        gbc_rtc_connect(&gbc->mbc.rtc, &gbc->cpu);
+    if (ret)
+        return -1;
+
+    gbc_mbc_init_with_cart(&gbc->mbc, gbc->rom->cart);
+    state_loaded(gbc);
+    memset(gbc->framebuffer, 0, sizeof(gbc->framebuffer));
+    gbc->frames = 0;
+    return 0;
+}
+
+void gbc_get_components(gbc_t *gbc, gbc_state_components_t *c)
+{
+    c->cpu = &gbc->cpu;
+    c->mem = &gbc->mem;
+    c->graphic = &gbc->graphic;
+    c->timer = &gbc->timer;
+    c->mbc = &gbc->mbc;
+    c->audio = &gbc->audio;
+}
+
+/* The RGB framebuffer is only filled while enabled */
+void gbc_set_color_output(gbc_t *gbc, uint8_t enable)
+{
+    gbc->graphic.screen_write = enable ? framebuffer_write : NULL;
+}
+
+/* Attaches a width x height grayscale observation to the renderer, 0 x 0 detaches it */
+int gbc_set_observation(gbc_t *gbc, uint16_t width, uint16_t height)
+{
+    gbc->graphic.obs = NULL;
+    gbc_obs_free(&gbc->obs);
+
+    if (!width && !height)
+        return 0;
+    if (gbc_obs_init(&gbc->obs, width, height))
+        return -1;
+
+    gbc->graphic.obs = &gbc->obs;
+    return 0;
+}
+
+/* Called by STOP after it flips cpu->dspeed; 'mem' is the one cpu->mem_data points at */
+void gbc_speed_switch(gbc_memory_t *mem)
+{
+    gbc_t *gbc = (gbc_t*)((uint8_t*)mem - offsetof(gbc_t, mem));
+
+    if (gbc->mbc.rtc.present)
+        gbc_rtc_speed_switch(&gbc->mbc.rtc);
+}
+
+/* Runs one frame of emulated time; halted stretches and idle polling loops are skipped
+ * up to the next event */
+void gbc_run_frame(gbc_t *gbc)
+{
+    gbc_scheduler_begin_frame(&gbc->sched, (uint64_t)CYCLES_PER_FRAME << gbc->cpu.dspeed);
+
+    while (gbc->cpu.cycles < gbc->sched.frame_end) {
+        uint16_t pc = READ_R16(&gbc->cpu.reg, REG_PC);
+
+        gbc_scheduler_skip_halt(&gbc->sched);
+        gbc_cpu_cycle(&gbc->cpu);
+        gbc_graphic_cycle(&gbc->graphic);
+        gbc_timer_cycle(&gbc->timer);
+        gbc_idle_step(&gbc->idle, pc);
+    }
+
+    gbc_scheduler_end_frame(&gbc->sched);
+    gbc->frames++;
+
+    /* speculative frames (run-ahead) are neither heard nor rendered */
+    if (gbc->audio_log && !gbc->audio_log->speculating)
+        gbc_audio_log_end_frame(gbc->audio_log);
+}
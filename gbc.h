@@ -0,0 +1,81 @@
+#ifndef GBC_H
+#define GBC_H
+
+#include <stdint.h>
+#include "cpu.h"
+#include "memory.h"
+#include "graphics.h"
+#include "timers.h"
+#include "mbc.h"
+#include "audio.h"
+#include "audio_log.h"
+#include "audio_synth.h"
+#include "io.h"
+#include "rom.h"
+#include "scheduler.h"
+#include "idle.h"
+#include "state.h"
+
+#define GBC_SCREEN_PIXELS (VISIBLE_HORIZONTAL_PIXELS * VISIBLE_VERTICAL_PIXELS)
+
+#define GBC_AUDIO_OFF      0    /* writes to the audio range are not synthesized */
+#define GBC_AUDIO_INLINE   1    /* synthesized on the emulation thread */
+#define GBC_AUDIO_THREADED 2    /* logged and rendered a frame behind on a worker thread */
+
+typedef struct gbc_config {
+    const char *rom_path;
+    const char *save_path;      /* NULL keeps cartridge RAM in memory only */
+    uint32_t rom_flags;         /* GBC_ROM_* */
+    uint32_t save_interval_ms;
+    uint8_t rtc_clock;          /* RTC_CLOCK_*, for MBC3 timer carts */
+    uint8_t skip_boot;          /* start at 0x0100 in the post-boot state, also without a boot ROM */
+    uint8_t audio;              /* GBC_AUDIO_* */
+} gbc_config_t;
+
+/* The state gbc_reset goes back to, shared by a machine and its forks */
+typedef struct gbc_power_on {
+    uint32_t refs;              /* atomic */
+    size_t size;
+    uint8_t data[];
+} gbc_power_on_t;
+
+/* One emulated machine. It owns every component and wires them together; nothing is
+ * shared between contexts except the read-only ROM mapping, so any number of them can
+ * run on different threads. */
+typedef struct gbc {
+    gbc_cpu_t cpu;
+    gbc_memory_t mem;
+    gbc_graphic_t graphic;
+    gbc_timer_t timer;
+    gbc_mbc_t mbc;
+    gbc_audio audio;
+    gbc_io_t io;
+    gbc_scheduler_t sched;
+    gbc_idle_t idle;
+
+    gbc_rom_t *rom;
+    uint64_t frames;
+
+    uint16_t framebuffer[GBC_SCREEN_PIXELS];    /* RGB555, row major, as the PPU writes it */
+    gbc_obs_t obs;                              /* downscaled grayscale, when enabled */
+    gbc_power_on_t *power_on;                   /* state right after creation, for gbc_reset */
+    gbc_cow_pool_t *pool;                       /* shared pages of this fork family, or NULL */
+    gbc_audio_log_t *audio_log;                 /* NULL with GBC_AUDIO_OFF */
+    gbc_audio_synth_t *synth;
+} gbc_t;
+
+gbc_t* gbc_create(const gbc_config_t *config);
+void gbc_destroy(gbc_t *gbc);
+gbc_t* gbc_fork(gbc_t *parent);
+double gbc_fork_benchmark(gbc_t *parent, uint32_t forks, uint32_t frames);
+int gbc_audio_compare(const gbc_config_t *config, uint32_t frames);
+int gbc_stress(const gbc_config_t *config, uint32_t contexts, uint32_t threads, uint32_t frames);
+int gbc_reset(gbc_t *gbc);
+int gbc_load_state(gbc_t *gbc, const uint8_t *buf, size_t size);
+void gbc_run_frame(gbc_t *gbc);
+void gbc_speed_switch(gbc_memory_t *mem);
+void gbc_get_components(gbc_t *gbc, gbc_state_components_t *c);
+void gbc_set_color_output(gbc_t *gbc, uint8_t enable);
+int gbc_set_observation(gbc_t *gbc, uint16_t width, uint16_t height);
+
+#endif
@@ -0,0 +1,118 @@
+#include "gbc_api.h"
+#include "gbc.h"
+#include "common.h"
+
+int gbc_api_version(void)
+{
+    return GBC_API_VERSION;
+}
+
+gbc_t* gbc_api_create(const char *rom_path)
+{
+    gbc_config_t config = { 0 };
+
+    config.rom_path = rom_path;
+    config.rtc_clock = RTC_CLOCK_EMULATED;   /* runs with emulated time, so steps are reproducible */
+    return gbc_create(&config);
+}
+
+void gbc_api_destroy(gbc_t *gbc)
+{
+    gbc_destroy(gbc);
+}
+
+/* Branches off a copy-on-write child; destroy it with gbc_api_destroy. The child and its
+ * parent must be stepped on the same thread. */
+gbc_t* gbc_api_fork(gbc_t *gbc)
+{
+    return gbc_fork(gbc);
+}
+
+int gbc_api_reset(gbc_t *gbc)
+{
+    return gbc_reset(gbc);
+}
+
+/* Holds 'buttons' (KEY_* bits) for 'frames' frames */
+int gbc_api_step(gbc_t *gbc, uint8_t buttons, uint32_t frames)
+{
+    io_set_buttons(&gbc->io, buttons);
+    for (uint32_t f = 0; f < frames; f++)
+        gbc_run_frame(gbc);
+    return 0;
+}
+
+/* GBC_API_SCREEN_WIDTH x GBC_API_SCREEN_HEIGHT RGB555 pixels, row major */
+const uint16_t* gbc_api_get_frame(gbc_t *gbc)
+{
+    return gbc->framebuffer;
+}
+
+const uint8_t* gbc_api_get_ram(gbc_t *gbc, int region, size_t *size)
+{
+    /* a fork reads shared pages from its relatives, the caller wants one flat buffer */
+    switch (region) {
+    case GBC_API_RAM_WRAM:
+        gbc_cow_unshare_all(&gbc->mem.wram_cow, gbc->mem.wram);
+        *size = (size_t)WRAM_BANK_SIZE * gbc->mem.wram_banks;
+        return gbc->mem.wram;
+    case GBC_API_RAM_HRAM:
+        *size = sizeof(gbc->mem.hraw);
+        return gbc->mem.hraw;
+    case GBC_API_RAM_CART:
+        gbc_cow_unshare_all(&gbc->mbc.ram_cow, gbc->mbc.ram_banks);
+        *size = gbc->mbc.ram_banks ? gbc->mbc.ram_size : 0;
+        return gbc->mbc.ram_banks;
+    }
+
+    LOG_ERROR("[API] unknown RAM region %d\n", region);
+    *size = 0;
+    return NULL;
+}
+
+/* Without colour output get_frame keeps the last frame drawn while it was on */
+void gbc_api_set_color_output(gbc_t *gbc, int enable)
+{
+    gbc_set_color_output(gbc, enable != 0);
+}
+
+/* Grayscale observation box-filtered by the renderer as each scanline completes */
+int gbc_api_set_observation(gbc_t *gbc, uint16_t width, uint16_t height)
+{
+    return gbc_set_observation(gbc, width, height);
+}
+
+/* width x height luminance bytes, NULL when no observation is set */
+const uint8_t* gbc_api_get_observation(gbc_t *gbc, uint16_t *width, uint16_t *height)
+{
+    *width = gbc->obs.width;
+    *height = gbc->obs.height;
+    return gbc->obs.out;
+}
+
+uint64_t gbc_api_frame_count(gbc_t *gbc)
+{
+    return gbc->frames;
+}
+
+size_t gbc_api_state_size(gbc_t *gbc)
+{
+    gbc_state_components_t c;
+
+    gbc_get_components(gbc, &c);
+    return gbc_state_size(&c);
+}
+
+/* Returns the bytes written, 0 if 'size' is too small */
+size_t gbc_api_save_state(gbc_t *gbc, void *buf, size_t size)
+{
+    gbc_state_components_t c;
+
+    gbc_get_components(gbc, &c);
+    return gbc_state_save(&c, (uint8_t*)buf, size);
+}
+
+int gbc_api_load_state(gbc_t *gbc, const void *buf, size_t size)
+{
+    return gbc_load_state(gbc, (const uint8_t*)buf, size);
+}
@@ -0,0 +1,46 @@
+#ifndef GBC_API_H
+#define GBC_API_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "io.h"     /* KEY_* button bits for gbc_api_step */
+
+/* The only symbols a shared build exports; compile the rest with -fvisibility=hidden */
+#if defined(_WIN32)
+#define GBC_API __declspec(dllexport)
+#else
+#define GBC_API __attribute__((visibility("default")))
+#endif
+
+#define GBC_API_VERSION 1       /* bump on any incompatible change below */
+
+#define GBC_API_SCREEN_WIDTH  160
+#define GBC_API_SCREEN_HEIGHT 144
+
+/* gbc_api_get_ram regions */
+#define GBC_API_RAM_WRAM 0      /* all WRAM banks, bank 0 first */
+#define GBC_API_RAM_HRAM 1      /* 0xFF80-0xFFFE */
+#define GBC_API_RAM_CART 2      /* cartridge RAM, size 0 without it */
+
+typedef struct gbc gbc_t;
+
+/* Step/reset/observe interface for embedding, e.g. as an agent training environment.
+ * Observations point into buffers the emulator owns: they stay valid until the context
+ * is destroyed and change on the next step, reset or state load. */
+GBC_API int gbc_api_version(void);
+GBC_API gbc_t* gbc_api_create(const char *rom_path);
+GBC_API void gbc_api_destroy(gbc_t *gbc);
+GBC_API gbc_t* gbc_api_fork(gbc_t *gbc);
+GBC_API int gbc_api_reset(gbc_t *gbc);
+GBC_API int gbc_api_step(gbc_t *gbc, uint8_t buttons, uint32_t frames);
+GBC_API const uint16_t* gbc_api_get_frame(gbc_t *gbc);
+GBC_API const uint8_t* gbc_api_get_ram(gbc_t *gbc, int region, size_t *size);
+GBC_API void gbc_api_set_color_output(gbc_t *gbc, int enable);
+GBC_API int gbc_api_set_observation(gbc_t *gbc, uint16_t width, uint16_t height);
+GBC_API const uint8_t* gbc_api_get_observation(gbc_t *gbc, uint16_t *width, uint16_t *height);
+GBC_API uint64_t gbc_api_frame_count(gbc_t *gbc);
+GBC_API size_t gbc_api_state_size(gbc_t *gbc);
+GBC_API size_t gbc_api_save_state(gbc_t *gbc, void *buf, size_t size);
+GBC_API int gbc_api_load_state(gbc_t *gbc, const void *buf, size_t size);
+
+#endif
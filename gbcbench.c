@@ -0,0 +1,248 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "gbc_api.h"
+#include "gbc.h"
+#include "obs.h"
+#include "utils.h"
+
+#define GBCBENCH_DEFAULT_FRAMES 60000
+#define GBCBENCH_TARGET_FPS     10000       /* headless, one core */
+#define GBCBENCH_MAX_ROMS       256         /* -a */
+#define GBCBENCH_STRESS_FRAMES  600         /* -s, per context and twice over */
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-f frames] [-n frames per step] [-i] [-o WxH | -d WxH] <rom>\n", prog);
+    fprintf(stderr, "       %s -a [-f frames] <rom>...\n", prog);
+    fprintf(stderr, "       %s -b switches <rom>\n", prog);
+    fprintf(stderr, "       %s -s contexts [-f frames] <rom>\n", prog);
+    fprintf(stderr, "       %s -l iterations <rom>\n", prog);
+    fprintf(stderr, "       %s -w stores <rom>\n", prog);
+    fprintf(stderr, "  -f  frames to run, default %d\n", GBCBENCH_DEFAULT_FRAMES);
+    fprintf(stderr, "  -n  frames per gbc_api_step call, default 1\n");
+    fprintf(stderr, "  -i  change the buttons every step, like an agent would\n");
+    fprintf(stderr, "  -o  WxH grayscale observation from the renderer, colour output off\n");
+    fprintf(stderr, "  -d  WxH grayscale observation downscaled from the RGB frame after each step\n");
+    fprintf(stderr, "  -a  check threaded audio renders the same samples as inline synthesis\n");
+    fprintf(stderr, "  -b  time cartridge bank switches instead of frames\n");
+    fprintf(stderr, "  -l  time state save, load, incremental update and restore, a frame apart\n");
+    fprintf(stderr, "  -w  time WRAM stores with and without the dirty page mark\n");
+    fprintf(stderr, "  -s  run that many contexts on as many threads and compare with single-threaded runs,\n");
+    fprintf(stderr, "      %d frames each unless -f is given\n", GBCBENCH_STRESS_FRAMES);
+}
+
+static int audio_check(char **roms, int count, uint32_t frames)
+{
+    gbc_config_t config;
+    int failed = 0;
+
+    memset(&config, 0, sizeof(config));
+    for (int i = 0; i < count; i++) {
+        config.rom_path = roms[i];
+        if (gbc_audio_compare(&config, frames))
+            failed++;
+    }
+
+    printf("audio: %d of %d ROMs identical\n", count - failed, count);
+    return failed ? 2 : 0;
+}
+
+static int stress_check(char *rom, uint32_t contexts, uint32_t frames)
+{
+    gbc_config_t config;
+
+    memset(&config, 0, sizeof(config));
+    config.rom_path = rom;
+    int failed = gbc_stress(&config, contexts, contexts, frames);
+    if (failed < 0)
+        return 1;
+
+    printf("stress: %u contexts, %d differ\n", contexts, failed);
+    return failed ? 2 : 0;
+}
+
+/* Latency of each state operation with a frame of emulation between snapshots, the way
+ * rewind, run-ahead and frontends call them */
+static int state_latency(gbc_t *gbc, uint32_t iterations)
+{
+    gbc_state_components_t c;
+    uint64_t save_ns = 0, load_ns = 0, update_ns = 0, restore_ns = 0;
+
+    gbc_get_components(gbc, &c);
+    size_t size = gbc_state_size(&c);
+    uint8_t *full = malloc_memory(size);
+    uint8_t *incremental = malloc_memory(size);
+    if (!full || !incremental) {
+        free_memory(full);
+        free_memory(incremental);
+        return 1;
+    }
+
+    gbc_state_save(&c, incremental, size);
+    for (uint32_t i = 0; i < iterations; i++) {
+        gbc_run_frame(gbc);
+        uint64_t t0 = get_time();
+        gbc_state_update(&c, incremental, size);
+        uint64_t t1 = get_time();
+        gbc_run_frame(gbc);
+        uint64_t t2 = get_time();
+        gbc_state_restore(&c, incremental, size);
+        uint64_t t3 = get_time();
+        gbc_state_save(&c, full, size);
+        uint64_t t4 = get_time();
+        gbc_load_state(gbc, full, size);
+        uint64_t t5 = get_time();
+
+        /* a load leaves every page dirty, which is not what the next update measures */
+        gbc_state_update(&c, incremental, size);
+
+        update_ns += t1 - t0;
+        restore_ns += t3 - t2;
+        save_ns += t4 - t3;
+        load_ns += t5 - t4;
+    }
+
+    uint64_t n = iterations ? iterations : 1;
+    printf("state: %zu bytes, save %.1f us, load %.1f us, update %.1f us, restore %.1f us\n",
+        size, save_ns / 1e3 / n, load_ns / 1e3 / n, update_ns / 1e3 / n, restore_ns / 1e3 / n);
+
+    free_memory(full);
+    free_memory(incremental);
+    return 0;
+}
+
+/* Headless throughput of the embedding API on one thread */
+int main(int argc, char **argv)
+{
+    const char *rom;
+    char *roms[GBCBENCH_MAX_ROMS];
+    int count = 0;
+    uint32_t frames = 0;
+    uint32_t per_step = 1;
+    int inputs = 0;
+    unsigned obs_w = 0, obs_h = 0;
+    int consumer = 0;
+    int audio = 0;
+    uint32_t switches = 0;
+    uint32_t contexts = 0;
+    uint32_t latency = 0;
+    uint32_t stores = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-f") && i + 1 < argc)
+            frames = strtoul(argv[++i], NULL, 0);
+        else if (!strcmp(argv[i], "-n") && i + 1 < argc)
+            per_step = strtoul(argv[++i], NULL, 0);
+        else if (!strcmp(argv[i], "-i"))
+            inputs = 1;
+        else if (!strcmp(argv[i], "-a"))
+            audio = 1;
+        else if (!strcmp(argv[i], "-b") && i + 1 < argc)
+            switches = strtoul(argv[++i], NULL, 0);
+        else if (!strcmp(argv[i], "-l") && i + 1 < argc)
+            latency = strtoul(argv[++i], NULL, 0);
+        else if (!strcmp(argv[i], "-w") && i + 1 < argc)
+            stores = strtoul(argv[++i], NULL, 0);
+        else if (!strcmp(argv[i], "-s") && i + 1 < argc)
+            contexts = strtoul(argv[++i], NULL, 0);
+        else if ((!strcmp(argv[i], "-o") || !strcmp(argv[i], "-d")) && i + 1 < argc) {
+            consumer = argv[i][1] == 'd';
+            if (sscanf(argv[++i], "%ux%u", &obs_w, &obs_h) != 2) {
+                usage(argv[0]);
+                return 1;
+            }
+        }
+        else if (argv[i][0] != '-' && count < GBCBENCH_MAX_ROMS)
+            roms[count++] = argv[i];
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (contexts && count == 1)
+        return stress_check(roms[0], contexts, frames ? frames : GBCBENCH_STRESS_FRAMES);
+    if (!frames)
+        frames = GBCBENCH_DEFAULT_FRAMES;
+    if (audio && count)
+        return audio_check(roms, count, frames);
+    if (audio || contexts || count != 1 || !per_step) {
+        usage(argv[0]);
+        return 1;
+    }
+    rom = roms[0];
+
+    gbc_t *gbc = gbc_api_create(rom);
+    if (!gbc)
+        return 1;
+
+    if (switches) {
+        gbc_mbc_benchmark(&gbc->mbc, switches);
+        gbc_api_destroy(gbc);
+        return 0;
+    }
+    if (stores) {
+        mem_wram_benchmark(&gbc->mem, stores);
+        gbc_api_destroy(gbc);
+        return 0;
+    }
+    if (latency) {
+        int ret = state_latency(gbc, latency);
+        gbc_api_destroy(gbc);
+        return ret;
+    }
+
+    /* -d: what agent pipelines do today, -o: the renderer does it */
+    gbc_obs_t downscaled;
+    const uint8_t *obs = NULL;
+    if (obs_w && consumer) {
+        if (gbc_obs_init(&downscaled, obs_w, obs_h)) {
+            gbc_api_destroy(gbc);
+            return 1;
+        }
+        obs = downscaled.out;
+    } else if (obs_w) {
+        uint16_t w, h;
+        if (gbc_api_set_observation(gbc, obs_w, obs_h)) {
+            gbc_api_destroy(gbc);
+            return 1;
+        }
+        gbc_api_set_color_output(gbc, 0);
+        obs = gbc_api_get_observation(gbc, &w, &h);
+    }
+
+    uint32_t seed = 1;
+    uint64_t checksum = 0;
+    size_t size;
+    uint64_t start = get_time();
+
+    for (uint32_t f = 0; f < frames; f += per_step) {
+        uint8_t buttons = 0;
+        if (inputs) {
+            seed = seed * 1103515245 + 12345;
+            buttons = seed >> 24;
+        }
+        gbc_api_step(gbc, buttons, per_step);
+
+        /* touch the observations so nothing is optimized away */
+        if (obs && consumer)
+            gbc_obs_downscale(&downscaled, gbc_api_get_frame(gbc));
+        if (obs)
+            checksum += obs[f % (obs_w * obs_h)];
+        else
+            checksum += gbc_api_get_frame(gbc)[f % (GBC_API_SCREEN_WIDTH * GBC_API_SCREEN_HEIGHT)];
+        checksum += gbc_api_get_ram(gbc, GBC_API_RAM_WRAM, &size)[f % size];
+    }
+
+    uint64_t ns = get_time() - start;
+    double fps = ns ? gbc_api_frame_count(gbc) * 1e9 / ns : 0.0;
+
+    printf("%lu frames in %.2f s, %.0f frames/s (%.0fx real time), target %d: %s [%016llx]\n",
+        (unsigned long)gbc_api_frame_count(gbc), ns / 1e9, fps, fps / 60.0, GBCBENCH_TARGET_FPS,
+        fps >= GBCBENCH_TARGET_FPS ? "met" : "missed", (unsigned long long)checksum);
+
+    if (obs_w && consumer)
+        gbc_obs_free(&downscaled);
+    gbc_api_destroy(gbc);
+    return fps >= GBCBENCH_TARGET_FPS ? 0 : 2;
+}
@@ -0,0 +1,55 @@
+#include <string.h>
+#include "graphics.h"
+#include "common.h"
+#include "utils.h"
+
+/* the second VRAM bank only exists in CGB mode */
+int gbc_graphic_alloc_vram(gbc_graphic_t *graphic, cartridge_t *cart)
+{
+    graphic->vram_banks = cartridge_is_cgb(cart) ? VRAM_MAX_BANKS : 1;
+    graphic->vram = malloc_memory(VRAM_BANK_SIZE * graphic->vram_banks);
+    if (!graphic->vram) {
+        LOG_ERROR("[GRAPHIC] failed to allocate %d VRAM banks\n", graphic->vram_banks);
+        graphic->vram_banks = 0;
+        return -1;
+    }
+
+    memset(graphic->vram, 0, VRAM_BANK_SIZE * graphic->vram_banks);
+    return 0;
+}
+
+void gbc_graphic_free_vram(gbc_graphic_t *graphic)
+{
+    gbc_cow_release(&graphic->vram_cow, graphic->vram);
+    free_memory(graphic->vram);
+    graphic->vram = NULL;
+    graphic->vram_banks = 0;
+}
+
+static uint8_t vram_read(void *udata, uint16_t addr)
+{
+    gbc_graphic_t *graphic = (gbc_graphic_t*)udata;
+    return GRAPHIC_VRAM_READ(graphic, VRAM_CURRENT_BANK(graphic) * VRAM_BANK_SIZE + addr - VRAM_START);
+}
+
+static uint8_t vram_write(void *udata, uint16_t addr, uint8_t data)
+{
+    gbc_graphic_t *graphic = (gbc_graphic_t*)udata;
+    GRAPHIC_VRAM_WRITE(graphic, VRAM_CURRENT_BANK(graphic) * VRAM_BANK_SIZE + addr - VRAM_START, data);
+    return 0;
+}
+
+/* CPU access to 8000-9FFF in the bank VBK selects, through the dirty and COW macros */
+void gbc_graphic_connect_vram(gbc_graphic_t *graphic, gbc_memory_t *mem)
+{
+    memory_map_entry_t entry;
+
+    graphic->mem = mem;
+    entry.id = VRAM_START_ID;
+    entry.addr_begin = VRAM_START;
+    entry.addr_end = VRAM_END;
+    entry.read = vram_read;
+    entry.write = vram_write;
+    entry.udata = graphic;
+    register_memory_map(mem, &entry);
+}
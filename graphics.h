@@ -2,6 +2,7 @@
 #include<stdint.h>
 
 #include "memory.h"
+#include "obs.h"
 #define VRAM_BANK_SIZE (VRAM_END-VRAM_START+1)
 
 
@@ -108,23 +109,62 @@ typedef struct{
     uint8_t attributes;
 } gbc_obj;
 
+#define VRAM_MAX_BANKS 2
+
 typedef struct 
 {
     uint32_t dots;   /* dots to next graphic update */
-    uint8_t vram[VRAM_BANK_SIZE * 2]; /* 2x8KB */
+    uint8_t *vram;          /* VRAM_BANK_SIZE * vram_banks */
+    uint8_t vram_banks;     /* 2 on CGB, 1 on DMG */
+    uint64_t vram_dirty[DIRTY_WORDS(VRAM_BANK_SIZE * VRAM_MAX_BANKS)];
+    gbc_cow_table_t vram_cow;
     uint8_t scanline;
     uint8_t mode;
 
     void *screen_udata;
     void (*screen_update)(void *udata);
-    screen_write screen_write;
+    screen_write screen_write;      /* NULL skips full colour output */
+    gbc_obs_t *obs;                 /* optional downscaled luminance output */
 
     gbc_memory_t *mem;
 } gbc_graphic_t;
 
+/* Scanline renderer output: each pixel goes to whichever targets are attached */
+#define GRAPHIC_PIXEL(graphic, x, y, color)                                     \
+    do {                                                                        \
+        if ((graphic)->screen_write)                                            \
+            (graphic)->screen_write((graphic)->screen_udata,                    \
+                (y) * VISIBLE_HORIZONTAL_PIXELS + (x), (color));                \
+        if ((graphic)->obs)                                                     \
+            gbc_obs_pixel((graphic)->obs, (x), (color));                        \
+    } while (0)
+
+/* Nothing consumes pixels: the renderer may skip composing the line */
+#define GRAPHIC_HAS_OUTPUT(graphic) ((graphic)->screen_write || (graphic)->obs)
+
+#define GRAPHIC_LINE_DONE(graphic, y) \
+    do { if ((graphic)->obs) gbc_obs_line((graphic)->obs, (y)); } while (0)
+
+#define GRAPHIC_VRAM_WRITE(graphic, offset, data)                              \
+    do {                                                                        \
+        COW_TOUCH(&(graphic)->vram_cow, (graphic)->vram, (offset));             \
+        (graphic)->vram[(offset)] = (data);                                     \
+        DIRTY_MARK((graphic)->vram_dirty, (offset));                            \
+    } while (0)
+#define GRAPHIC_VRAM_READ(graphic, offset) \
+    gbc_cow_read(&(graphic)->vram_cow, (graphic)->vram, (offset))
+#define GRAPHIC_VRAM_PTR(graphic, offset) \
+    gbc_cow_ptr(&(graphic)->vram_cow, (graphic)->vram, (offset))
+
+/* VBK only switches banks in CGB mode */
+#define VRAM_CURRENT_BANK(graphic) \
+    ((graphic)->vram_banks > 1 ? (IO_PORT_READ((graphic)->mem, IO_PORT_VBK) & 0x1) : 0)
 
 void gbc_graphic_connect(gbc_graphic_t *graphic, gbc_memory_t *mem);
 void gbc_graphic_init(gbc_graphic_t *graphic);
 void gbc_graphic_cycle(gbc_graphic_t *graphic);
 uint8_t* gbc_graphic_get_tile_attr(gbc_graphic_t *graphic, uint8_t type, uint8_t idx);
 gbc_tile* gbc_graphic_get_tile(gbc_graphic_t *graphic, uint8_t type, uint8_t idx, uint8_t bank);
+int gbc_graphic_alloc_vram(gbc_graphic_t *graphic, cartridge_t *cart);
+void gbc_graphic_free_vram(gbc_graphic_t *graphic);
+void gbc_graphic_connect_vram(gbc_graphic_t *graphic, gbc_memory_t *mem);
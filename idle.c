@@ -0,0 +1,271 @@
+#include <string.h>
+#include "idle.h"
+#include "isa.h"
+#include "common.h"
+
+#define INTERRUPT_MASK 0x1F
+
+#define IDLE_HASH(addr) (((addr) ^ ((addr) >> 6)) & (IDLE_CACHE_SIZE - 1))
+
+/* opcodes a loop may contain, anything else rejects it */
+#define OP_NOP      0x00
+#define OP_JR       0x18
+#define OP_JR_NZ    0x20
+#define OP_JR_Z     0x28
+#define OP_JR_NC    0x30
+#define OP_JR_C     0x38
+#define OP_AND_A    0xA7
+#define OP_OR_A     0xB7
+#define OP_JP_NZ    0xC2
+#define OP_JP       0xC3
+#define OP_JP_Z     0xCA
+#define OP_JP_NC    0xD2
+#define OP_JP_C     0xDA
+#define OP_AND_I8   0xE6
+#define OP_XOR_I8   0xEE
+#define OP_LDH_A_M8 0xF0
+#define OP_OR_I8    0xF6
+#define OP_LD_A_M16 0xFA
+#define OP_CP_I8    0xFE
+
+#define CB_BIT_A(op) (((op) & 0xC7) == 0x47)
+
+static uint8_t polled_port(uint16_t addr)
+{
+    switch (addr) {
+    case IO_PORT_ADDR(IO_PORT_LY):   return IDLE_PORT_LY;
+    case IO_PORT_ADDR(IO_PORT_STAT): return IDLE_PORT_STAT;
+    case IO_PORT_ADDR(IO_PORT_IF):   return IDLE_PORT_IF;
+    case IO_PORT_ADDR(IO_PORT_P1):   return IDLE_PORT_P1;
+    }
+    return 0;
+}
+
+static uint8_t code_addr(uint16_t addr)
+{
+    return addr <= ROM_BANK_SWITCH_END ||
+        IN_RANGE(addr, WRAM_BANK_0_START, WRAM_BANK_SWITCH_END) ||
+        IN_RANGE(addr, HRAM_START, HRAM_END);
+}
+
+static uint8_t condition(uint8_t op, uint8_t f)
+{
+    switch (op) {
+    case OP_JR_NZ: case OP_JP_NZ: return !(f & FLAG_Z);
+    case OP_JR_Z:  case OP_JP_Z:  return (f & FLAG_Z) != 0;
+    case OP_JR_NC: case OP_JP_NC: return !(f & FLAG_C);
+    case OP_JR_C:  case OP_JP_C:  return (f & FLAG_C) != 0;
+    }
+    return 1;
+}
+
+/* Run one iteration on A/F only. Returns 1 if the closing jump is taken. With 'loop->state'
+ * still EMPTY it also validates the code and fills in ports/cycles/size; 0 rejects it. */
+static uint8_t run_loop(gbc_idle_t *idle, gbc_idle_loop_t *loop, uint16_t from, uint8_t *a, uint8_t *f)
+{
+    gbc_cpu_t *cpu = idle->cpu;
+    uint8_t *code = loop->code;
+    uint8_t analyse = loop->state == IDLE_LOOP_EMPTY;
+    uint8_t a_loaded = 0;
+    uint8_t pc = 0;
+    uint16_t cycles = 0;
+    uint16_t addr;
+
+    while (pc < IDLE_MAX_LOOP_BYTES - 2) {
+        uint8_t op = code[pc];
+        uint8_t n = code[pc + 1];
+
+        switch (op) {
+        case OP_NOP:
+            pc += 1;
+            cycles += 4;
+            continue;
+        case OP_LDH_A_M8:
+        case OP_LD_A_M16:
+            addr = op == OP_LDH_A_M8 ? 0xFF00 + n : (uint16_t)(n | (code[pc + 2] << 8));
+            if (analyse && !polled_port(addr))
+                return 0;
+            loop->ports |= polled_port(addr);
+            *a = cpu->mem_read(cpu->mem_data, addr);
+            a_loaded = 1;
+            pc += op == OP_LDH_A_M8 ? 2 : 3;
+            cycles += op == OP_LDH_A_M8 ? 12 : 16;
+            continue;
+        case OP_CP_I8:
+            if (!a_loaded)
+                return 0;
+            *f = (*a == n ? FLAG_Z : 0) | FLAG_N |
+                ((*a & UINT4_MASK) < (n & UINT4_MASK) ? FLAG_H : 0) | (*a < n ? FLAG_C : 0);
+            pc += 2;
+            cycles += 8;
+            continue;
+        case OP_AND_I8:
+        case OP_OR_I8:
+        case OP_XOR_I8:
+            if (!a_loaded)
+                return 0;
+            *a = op == OP_AND_I8 ? (*a & n) : op == OP_OR_I8 ? (*a | n) : (*a ^ n);
+            *f = (*a ? 0 : FLAG_Z) | (op == OP_AND_I8 ? FLAG_H : 0);
+            pc += 2;
+            cycles += 8;
+            continue;
+        case OP_AND_A:
+        case OP_OR_A:
+            if (!a_loaded)
+                return 0;
+            *f = (*a ? 0 : FLAG_Z) | (op == OP_AND_A ? FLAG_H : 0);
+            pc += 1;
+            cycles += 4;
+            continue;
+        case PREFIX_CB:
+            if (!a_loaded || !CB_BIT_A(n))
+                return 0;
+            *f = ((*a >> ((n >> 3) & 7)) & 1 ? 0 : FLAG_Z) | FLAG_H | (*f & FLAG_C);
+            pc += 2;
+            cycles += 8;
+            continue;
+        }
+
+        /* the only jump allowed is the one closing the loop */
+        uint8_t size;
+        if (op == OP_JR || op == OP_JR_NZ || op == OP_JR_Z || op == OP_JR_NC || op == OP_JR_C) {
+            addr = loop->addr + pc + 2 + (int8_t)n;
+            size = 2;
+            cycles += 12;
+        } else if (op == OP_JP || op == OP_JP_NZ || op == OP_JP_Z || op == OP_JP_NC || op == OP_JP_C) {
+            addr = n | (code[pc + 2] << 8);
+            size = 3;
+            cycles += 16;
+        } else {
+            return 0;
+        }
+
+        if (addr != loop->addr || (uint16_t)(loop->addr + pc) != from)
+            return 0;
+
+        if (analyse) {
+            loop->size = pc + size;
+            loop->cycles = cycles;
+        }
+        return condition(op, *f);
+    }
+
+    return 0;
+}
+
+static void fetch_code(gbc_cpu_t *cpu, uint16_t addr, uint8_t *code)
+{
+    for (int i = 0; i < IDLE_MAX_LOOP_BYTES; i++)
+        code[i] = cpu->mem_read(cpu->mem_data, addr + i);
+}
+
+static gbc_idle_loop_t* lookup(gbc_idle_t *idle, uint16_t from, uint16_t to)
+{
+    gbc_cpu_t *cpu = idle->cpu;
+    gbc_idle_loop_t *loop = idle->loops + IDLE_HASH(to);
+    uint8_t code[IDLE_MAX_LOOP_BYTES];
+
+    if (loop->state == IDLE_LOOP_BUSY && loop->addr == to && loop->size == from - to)
+        return NULL;
+
+    fetch_code(cpu, to, code);
+
+    /* the code may have been bank switched or rewritten since it was analysed */
+    if (loop->state == IDLE_LOOP_IDLE && loop->addr == to && !memcmp(code, loop->code, loop->size))
+        return loop;
+
+    if (loop->state == IDLE_LOOP_IDLE) {
+        LOG_DEBUG("[IDLE] loop %04x evicted after %lu skips\n", loop->addr, (unsigned long)loop->skips);
+    }
+
+    memset(loop, 0, sizeof(gbc_idle_loop_t));
+    loop->addr = to;
+    memcpy(loop->code, code, IDLE_MAX_LOOP_BYTES);
+
+    uint8_t a = READ_R8(&cpu->reg, REG_A);
+    uint8_t f = READ_R8(&cpu->reg, REG_F);
+    if (run_loop(idle, loop, from, &a, &f) && loop->size) {
+        loop->state = IDLE_LOOP_IDLE;
+        idle->detected++;
+        LOG_DEBUG("[IDLE] loop at %04x, %u bytes, %u cycles, ports %x\n",
+            loop->addr, loop->size, loop->cycles, loop->ports);
+        return loop;
+    }
+
+    /* remember the rejection by address and size only, the cheap check above */
+    loop->state = IDLE_LOOP_BUSY;
+    loop->size = from - to;
+    return NULL;
+}
+
+void gbc_idle_init(gbc_idle_t *idle)
+{
+    memset(idle, 0, sizeof(gbc_idle_t));
+}
+
+void gbc_idle_connect(gbc_idle_t *idle, gbc_cpu_t *cpu, gbc_scheduler_t *sched)
+{
+    idle->cpu = cpu;
+    idle->sched = sched;
+}
+
+/* Called at the instruction boundary after a jump from 'from' back to 'to'. If the loop
+ * is an idle poll and the state it computes is a fixed point with the current port
+ * values, whole iterations are skipped up to the next event. Returns the cycles skipped. */
+uint64_t gbc_idle_branch(gbc_idle_t *idle, uint16_t from, uint16_t to)
+{
+    gbc_cpu_t *cpu = idle->cpu;
+
+    if (to > from || from - to >= IDLE_MAX_LOOP_BYTES - 2)
+        return 0;
+    if (!code_addr(to) || !code_addr(from))
+        return 0;
+
+    /* an interrupt is about to be taken, let the cpu do it */
+    if ((cpu->ime || cpu->ime_insts) && (cpu->ier & *cpu->ifp & INTERRUPT_MASK))
+        return 0;
+
+    gbc_idle_loop_t *loop = lookup(idle, from, to);
+    if (!loop)
+        return 0;
+
+    uint8_t a = READ_R8(&cpu->reg, REG_A);
+    uint8_t f = READ_R8(&cpu->reg, REG_F);
+    if (!run_loop(idle, loop, from, &a, &f))
+        return 0;
+    if (a != READ_R8(&cpu->reg, REG_A) || f != READ_R8(&cpu->reg, REG_F))
+        return 0;
+
+    uint64_t next = gbc_scheduler_next_event(idle->sched);
+    if (next == SCHEDULER_NO_EVENT || next <= cpu->cycles + loop->cycles)
+        return 0;
+
+    uint64_t skip = (next - cpu->cycles - 1) / loop->cycles * loop->cycles;
+    gbc_scheduler_advance(idle->sched, skip);
+
+    loop->skips++;
+    loop->skipped += skip;
+    idle->skips++;
+    idle->skipped += skip;
+
+    return skip;
+}
+
+void gbc_idle_report(gbc_idle_t *idle)
+{
+    LOG_INFO("[IDLE] %u loops detected, %lu skips, %lu cycles skipped\n",
+        idle->detected, (unsigned long)idle->skips, (unsigned long)idle->skipped);
+
+    for (int i = 0; i < IDLE_CACHE_SIZE; i++) {
+        gbc_idle_loop_t *loop = idle->loops + i;
+        if (loop->state != IDLE_LOOP_IDLE)
+            continue;
+        LOG_INFO("[IDLE]   %04x: %2u bytes, %3u cycles/iter, ports %s%s%s%s, %lu skips, %lu cycles\n",
+            loop->addr, loop->size, loop->cycles,
+            (loop->ports & IDLE_PORT_LY) ? "LY " : "",
+            (loop->ports & IDLE_PORT_STAT) ? "STAT " : "",
+            (loop->ports & IDLE_PORT_IF) ? "IF " : "",
+            (loop->ports & IDLE_PORT_P1) ? "P1 " : "",
+            (unsigned long)loop->skips, (unsigned long)loop->skipped);
+    }
+}
@@ -0,0 +1,60 @@
+#ifndef IDLE_H
+#define IDLE_H
+
+#include <stdint.h>
+#include "cpu.h"
+#include "scheduler.h"
+
+#define IDLE_MAX_LOOP_BYTES 16
+#define IDLE_CACHE_SIZE 64      /* power of 2 */
+
+#define IDLE_PORT_LY   0x01
+#define IDLE_PORT_STAT 0x02
+#define IDLE_PORT_IF   0x04
+#define IDLE_PORT_P1   0x08
+
+#define IDLE_LOOP_EMPTY 0
+#define IDLE_LOOP_IDLE  1
+#define IDLE_LOOP_BUSY  2       /* analysed and rejected */
+
+typedef struct {
+    uint16_t addr;          /* loop start, the backward jump target */
+    uint8_t state;
+    uint8_t size;           /* bytes from addr to the end of the jump */
+    uint8_t code[IDLE_MAX_LOOP_BYTES];
+    uint8_t ports;          /* IDLE_PORT_* polled by the loop */
+    uint16_t cycles;        /* one iteration, jump taken */
+
+    uint64_t skips;
+    uint64_t skipped;       /* cycles */
+} gbc_idle_loop_t;
+
+/* Detects polling loops that only read LY/STAT/IF/P1 and skips them to the next event */
+typedef struct gbc_idle {
+    gbc_cpu_t *cpu;
+    gbc_scheduler_t *sched;
+
+    gbc_idle_loop_t loops[IDLE_CACHE_SIZE];
+
+    uint32_t detected;      /* distinct idle loops found */
+    uint64_t skips;
+    uint64_t skipped;       /* cycles */
+} gbc_idle_t;
+
+void gbc_idle_init(gbc_idle_t *idle);
+void gbc_idle_connect(gbc_idle_t *idle, gbc_cpu_t *cpu, gbc_scheduler_t *sched);
+uint64_t gbc_idle_branch(gbc_idle_t *idle, uint16_t from, uint16_t to);
+void gbc_idle_report(gbc_idle_t *idle);
+
+/* Run loop hook after the instruction at 'pc', with cpu->reg current: only a short
+ * backward jump can close a polling loop */
+static inline uint64_t gbc_idle_step(gbc_idle_t *idle, uint16_t pc)
+{
+    uint16_t to = READ_R16(&idle->cpu->reg, REG_PC);
+
+    if (to >= pc || pc - to >= IDLE_MAX_LOOP_BYTES - 2)
+        return 0;
+    return gbc_idle_branch(idle, pc, to);
+}
+
+#endif
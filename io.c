@@ -0,0 +1,75 @@
+#include <string.h>
+#include "io.h"
+#include "cpu.h"
+
+void io_init(gbc_io_t *io)
+{
+    memset(io, 0, sizeof(gbc_io_t));
+}
+
+static uint8_t p1_read(void *udata, uint16_t addr)
+{
+    (void)addr;
+    return io_read_p1((gbc_io_t*)udata);
+}
+
+/* Only the select lines are writable */
+static uint8_t p1_write(void *udata, uint16_t addr, uint8_t data)
+{
+    gbc_io_t *io = (gbc_io_t*)udata;
+
+    (void)addr;
+    io->memory[IO_PORT_P1] = data & (P1_SELECT_DPAD | P1_SELECT_BUTTON);
+    io->memory[IO_PORT_P1] = io_read_p1(io);
+    return 0;
+}
+
+void io_connect(gbc_io_t *io, gbc_memory_t *mem)
+{
+    io->memory = mem->io_ports;
+    io->memory[IO_PORT_P1] = io_read_p1(io);
+
+    memory_map_entry_t entry;
+    entry.id = JOYPAD_ID;
+    entry.addr_begin = JOYPAD_PORT;
+    entry.addr_end = JOYPAD_PORT;
+    entry.read = p1_read;
+    entry.write = p1_write;
+    entry.udata = io;
+
+    register_memory_map(mem, &entry);
+}
+
+void io_cleanup(gbc_io_t *io)
+{
+    io->memory = NULL;
+}
+
+/* https://gbdev.io/pandocs/Joypad_Input.html: the low nibble reads 0 for pressed keys of
+ * the selected group(s) */
+uint8_t io_read_p1(gbc_io_t *io)
+{
+    uint8_t select = io->memory ? io->memory[IO_PORT_P1] & (P1_SELECT_DPAD | P1_SELECT_BUTTON) : 0;
+    uint8_t pressed = 0;
+
+    if (!(select & P1_SELECT_DPAD))
+        pressed |= (io->buttons & DPAD_MASK) >> 4;
+    if (!(select & P1_SELECT_BUTTON))
+        pressed |= io->buttons & BUTTON_MASK;
+
+    return 0xC0 | select | (~pressed & 0x0F);
+}
+
+/* Called between frames with the new key state; a press raises the joypad interrupt */
+void io_set_buttons(gbc_io_t *io, uint8_t buttons)
+{
+    uint8_t pressed = buttons & ~io->buttons;
+
+    io->buttons = buttons;
+    if (!io->memory)
+        return;
+
+    io->memory[IO_PORT_P1] = io_read_p1(io);
+    if (pressed)
+        io->memory[IO_PORT_IF] |= INTERRUPT_JOYPAD;
+}
@@ -2,6 +2,7 @@
 #define IO_H
 
 #include <stdint.h>
+#include "memory.h"
 
 #define KEY_DPAD     0x10
 #define KEY_BUTTON   0x20
@@ -17,14 +18,21 @@
 // D-Pad and Button bit masks
 #define DPAD_MASK    (KEY_UP | KEY_DOWN | KEY_LEFT | KEY_RIGHT)
 #define BUTTON_MASK  (KEY_A | KEY_B | KEY_START | KEY_SELECT)
+// P1 select lines, active low
+#define P1_SELECT_DPAD   0x10
+#define P1_SELECT_BUTTON 0x20
+
 // Memory struct
 typedef struct {
-    uint8_t *memory;
+    uint8_t *memory;        /* io port array, indexed by IO_PORT_* */
+    uint8_t buttons;        /* pressed keys: BUTTON_MASK bits, DPAD_MASK bits */
 } gbc_io_t;
 
 // Function declarations
-void io_connect(gbc_io_t *io, uint8_t *memory);
+void io_connect(gbc_io_t *io, gbc_memory_t *mem);
 void io_init(gbc_io_t *io);
 void io_cleanup(gbc_io_t *io);
+void io_set_buttons(gbc_io_t *io, uint8_t buttons);
+uint8_t io_read_p1(gbc_io_t *io);
 
 #endif 
@@ -2,6 +2,7 @@
 #include "common.h"
 #include "cpu.h"
 #include "isa.h"
+#include "gbc.h"
 
 
 
@@ -18,6 +19,7 @@ static void stop(gbc_cpu_t *cpu, gbc_instruction_t *ins) {
 
         key1 &= ~KEY1_CPU_SWITCH_ARMED;
         IO_PORT_WRITE(mem, IO_PORT_KEY1, key1);
+        gbc_speed_switch(mem);
     }
 
     LOG_INFO("[CPU] Speed Switch %s -> %s\n",
@@ -1886,10 +1888,10 @@ static void cb_set_m16(gbc_cpu_t *cpu, gbc_instruction_t *ins) {
 
 }
 
-/* The following fields in instruction will be modified during the execution:
-    r_cycles, op1, op2, opcode_ext
+/* Read-only and indexed by opcode at compile time. decode() copies an entry into the
+   caller's instruction, which is the one modified during execution (r_cycles, opcode_ext).
  */
-static gbc_instruction_t instruction_set[INSTRUCTIONS_SET_SIZE] = {
+static const gbc_instruction_t instruction_set[INSTRUCTIONS_SET_SIZE] = {
     /* 0x00 */
     INSTRUCTION_ADD(0x00, 1, nop, NULL, NULL, 4, 4, "NOP"),
     INSTRUCTION_ADD(0x01, 3, ld_r16_i16, REG_BC, NULL, 12, 12, "LD BC, n16"),
@@ -2179,7 +2181,7 @@ static gbc_instruction_t instruction_set[INSTRUCTIONS_SET_SIZE] = {
     INSTRUCTION_ADD(0xff, 1, rst, 0x38, NULL, 16, 16, "RST 38H"),
 };
 
-static gbc_instruction_t prefixed_instruction_set[INSTRUCTIONS_SET_SIZE] = {
+static const gbc_instruction_t prefixed_instruction_set[INSTRUCTIONS_SET_SIZE] = {
     /* 0x00 */
     INSTRUCTION_ADD(0x00, 2, cb_rlc_r8, REG_B, NULL, 8, 8, "RLC B"),
     INSTRUCTION_ADD(0x01, 2, cb_rlc_r8, REG_C, NULL, 8, 8, "RLC C"),
@@ -2469,37 +2471,17 @@ static gbc_instruction_t prefixed_instruction_set[INSTRUCTIONS_SET_SIZE] = {
     INSTRUCTION_ADD(0xff, 2, cb_set_r8, 7, REG_A, 8, 8, "SET 7, A"),
 };
 
+/* Nothing left to set up: the tables are const and in opcode order. Kept so callers do
+   not change; decoding touches no shared state, any number of cpus can run at once. */
 void init_instruction_set()
 {
-    int idx;
-    gbc_instruction_t t;
-    for (int i = 0; i < INSTRUCTIONS_SET_SIZE; i++) {
-
-        if (instruction_set[i].func) {
-            idx = instruction_set[i].opcode;
-            if (idx != i) {
-                t = instruction_set[idx];
-                instruction_set[idx] = instruction_set[i];
-                instruction_set[i] = t;
-            }
-        }
-
-        if (prefixed_instruction_set[i].func) {
-            idx = prefixed_instruction_set[i].opcode;
-            if (idx != i) {
-                t = instruction_set[idx];
-                prefixed_instruction_set[idx] = prefixed_instruction_set[i];
-                instruction_set[i] = t;
-            }
-        }
-    }
 }
 
-gbc_instruction_t* decode(uint8_t *data)
+gbc_instruction_t* decode(const uint8_t *data, gbc_instruction_t *inst)
 {
     uint8_t opcode = data[0];
     int size = 0;
-    gbc_instruction_t *inst_set = instruction_set;
+    const gbc_instruction_t *inst_set = instruction_set;
 
     if (opcode == PREFIX_CB) {
         inst_set = prefixed_instruction_set;
@@ -2507,7 +2489,7 @@ gbc_instruction_t* decode(uint8_t *data)
         opcode = READ_I8(data[1]);
     }
 
-    gbc_instruction_t *inst = inst_set + opcode;
+    *inst = inst_set[opcode];
 
     inst->r_cycles = inst->cycles;
     size += inst->size;
@@ -2527,11 +2509,11 @@ gbc_instruction_t* decode(uint8_t *data)
     return inst;
 }
 
-gbc_instruction_t* decode_mem(memory_read read, uint16_t addr, void *udata)
+gbc_instruction_t* decode_mem(memory_read read, uint16_t addr, void *udata, gbc_instruction_t *inst)
 {
     uint8_t opcode = read(udata, addr);
     int size = 0;
-    gbc_instruction_t *inst_set = instruction_set;
+    const gbc_instruction_t *inst_set = instruction_set;
 
     if (opcode == PREFIX_CB) {
         inst_set = prefixed_instruction_set;
@@ -2539,7 +2521,7 @@ gbc_instruction_t* decode_mem(memory_read read, uint16_t addr, void *udata)
         opcode = READ_I8(read(udata, addr + 1));
     }
 
-    gbc_instruction_t *inst = inst_set + opcode;
+    *inst = inst_set[opcode];
 
     inst->r_cycles = inst->cycles;
     size += inst->size;
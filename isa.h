@@ -12,7 +12,7 @@ typedef void (*instruction_func)(gbc_cpu_t *cpu, gbc_instruction_t *ins);
 
 #define PREFIX_CB 0xcb
 
-#define INSTRUCTION_ADD(opcode, size, func, op1, op2, c1, c2, name) {(opcode), (size), (c1), (c2), (c1), (func), ((void*)(op1)), ((void*)(op2)), 0, (name)}
+#define INSTRUCTION_ADD(opcode, size, func, op1, op2, c1, c2, name) [(opcode)] = {(opcode), (size), (c1), (c2), (c1), (func), ((void*)(op1)), ((void*)(op2)), 0, (name)}
 
 struct gbc_instruction {
     uint8_t opcode;
@@ -31,7 +31,8 @@ struct gbc_instruction {
 };
 
 void init_instruction_set();
-gbc_instruction_t* decode(uint8_t *data);
+gbc_instruction_t* decode(const uint8_t *data, gbc_instruction_t *inst);
+gbc_instruction_t* decode_mem(memory_read read, uint16_t addr, void *udata, gbc_instruction_t *inst);
 void int_call_i16(gbc_cpu_t *cpu, uint16_t addr);
 
 #endif 
@@ -0,0 +1,464 @@
+#include <string.h>
+#include "lockstep.h"
+#include "isa.h"
+#include "common.h"
+#include "utils.h"
+
+#define INTERRUPT_MASK 0x1F
+
+#define LANE_BIT(i) (1u << (i))
+
+/* cpu_register_t fields in lane order */
+static const size_t lane_reg[8] = { REG_B, REG_C, REG_D, REG_E, REG_H, REG_L, REG_F, REG_A };
+
+static void load_lane(gbc_lockstep_t *ls, int i)
+{
+    cpu_register_t *reg = &ls->lanes[i]->cpu.reg;
+
+    for (int k = 0; k < 8; k++)
+        ls->regs.r[k][i] = READ_R8(reg, lane_reg[k]);
+    ls->regs.sp[i] = READ_R16(reg, REG_SP);
+    ls->regs.pc[i] = READ_R16(reg, REG_PC);
+}
+
+static void store_lane(gbc_lockstep_t *ls, int i)
+{
+    cpu_register_t *reg = &ls->lanes[i]->cpu.reg;
+
+    for (int k = 0; k < 8; k++)
+        WRITE_R8(reg, lane_reg[k], ls->regs.r[k][i]);
+    WRITE_R16(reg, REG_SP, ls->regs.sp[i]);
+    WRITE_R16(reg, REG_PC, ls->regs.pc[i]);
+}
+
+/* Register-only opcodes with a vector implementation. (HL) operands, HALT and anything
+ * touching memory, SP-relative stack or IME stay scalar. */
+static uint8_t vectorizable(uint8_t op)
+{
+    if (op >= 0x40 && op < 0x80)                    /* LD r, r' */
+        return op != 0x76 && (op & 0x07) != 6 && ((op >> 3) & 0x07) != 6;
+    if (op >= 0x80 && op < 0xC0)                    /* ALU A, r */
+        return (op & 0x07) != 6;
+
+    switch (op & 0xC7) {
+    case 0x04: case 0x05: case 0x06:                /* INC r, DEC r, LD r, d8 */
+        return ((op >> 3) & 0x07) != 6;
+    case 0xC6:                                      /* ALU A, d8 */
+        return 1;
+    }
+
+    switch (op) {
+    case 0x00:                                      /* NOP */
+    case 0x01: case 0x11: case 0x21: case 0x31:     /* LD rr, d16 */
+    case 0x03: case 0x13: case 0x23: case 0x33:     /* INC rr */
+    case 0x0B: case 0x1B: case 0x2B: case 0x3B:     /* DEC rr */
+    case 0x2F: case 0x37: case 0x3F:                /* CPL, SCF, CCF */
+    case 0x18: case 0x20: case 0x28: case 0x30: case 0x38:
+    case 0xC3: case 0xC2: case 0xCA: case 0xD2: case 0xDA:
+        return 1;
+    }
+
+    return 0;
+}
+
+#define BLEND(m, new, old) (((new) & (m)) | ((old) & ~(m)))
+
+/* lane_u16 is 32 bytes, wider than an SSE register: it only crosses function
+ * boundaries by pointer, so the ABI does not depend on -mavx2 */
+static void get_pair(gbc_lockstep_t *ls, int rr, lane_u16 *pair)
+{
+    if (rr == 3) {
+        *pair = ls->regs.sp;
+        return;
+    }
+    lane_u16 hi = __builtin_convertvector(ls->regs.r[rr * 2], lane_u16);
+    lane_u16 lo = __builtin_convertvector(ls->regs.r[rr * 2 + 1], lane_u16);
+    *pair = (hi << 8) | lo;
+}
+
+static void set_pair(gbc_lockstep_t *ls, int rr, const lane_u16 *value, const lane_u16 *m16)
+{
+    if (rr == 3) {
+        ls->regs.sp = BLEND(*m16, *value, ls->regs.sp);
+        return;
+    }
+    lane_u8 m8 = __builtin_convertvector(*m16, lane_u8);
+    lane_u8 hi = __builtin_convertvector(*value >> 8, lane_u8);
+    lane_u8 lo = __builtin_convertvector(*value, lane_u8);
+    ls->regs.r[rr * 2] = BLEND(m8, hi, ls->regs.r[rr * 2]);
+    ls->regs.r[rr * 2 + 1] = BLEND(m8, lo, ls->regs.r[rr * 2 + 1]);
+}
+
+/* a comparison result narrowed to one flag bit */
+#define FLAG_IF(cond, flag) (((lane_u8)(cond)) & (flag))
+
+/* ADD ADC SUB SBC AND XOR OR CP on A, flags exactly as the scalar handlers set them */
+static void alu(gbc_lockstep_t *ls, uint8_t kind, lane_u8 y, lane_u8 m)
+{
+    lane_u8 a = ls->regs.r[LANE_A];
+    lane_u8 f = ls->regs.r[LANE_F];
+    lane_u8 carry = (f >> 4) & 1;
+    lane_u8 res, flags;
+    lane_i8 c, h;
+
+    switch (kind) {
+    case 0: /* ADD */
+        res = a + y;
+        c = res < a;
+        h = (((a & 0x0F) + (y & 0x0F)) & 0x10) != 0;
+        flags = FLAG_IF(res == 0, FLAG_Z) | FLAG_IF(h, FLAG_H) | FLAG_IF(c, FLAG_C);
+        break;
+    case 1: /* ADC */
+        res = a + y + carry;
+        c = (res < a) | ((res == a) & (carry != 0));
+        h = (((a & 0x0F) + (y & 0x0F) + carry) & 0x10) != 0;
+        flags = FLAG_IF((res == 0) & ~c, FLAG_Z) | FLAG_IF(h, FLAG_H) | FLAG_IF(c, FLAG_C);
+        break;
+    case 2: /* SUB */
+    case 7: /* CP */
+        res = a - y;
+        c = a < y;
+        h = (a & 0x0F) < (y & 0x0F);
+        flags = FLAG_IF(res == 0, FLAG_Z) | FLAG_N | FLAG_IF(h, FLAG_H) | FLAG_IF(c, FLAG_C);
+        break;
+    case 3: /* SBC */
+        res = a - y - carry;
+        c = (a < y) | ((a == y) & (carry != 0));
+        h = ((a & 0x0F) < (y & 0x0F)) | (((a & 0x0F) == (y & 0x0F)) & (carry != 0));
+        flags = FLAG_IF((res == 0) & ~c, FLAG_Z) | FLAG_N | FLAG_IF(h, FLAG_H) | FLAG_IF(c, FLAG_C);
+        break;
+    case 4: /* AND */
+        res = a & y;
+        flags = FLAG_IF(res == 0, FLAG_Z) | FLAG_H;
+        break;
+    case 5: /* XOR */
+        res = a ^ y;
+        flags = FLAG_IF(res == 0, FLAG_Z);
+        break;
+    default: /* OR */
+        res = a | y;
+        flags = FLAG_IF(res == 0, FLAG_Z);
+        break;
+    }
+
+    flags |= f & 0x0F;
+    if (kind != 7)
+        ls->regs.r[LANE_A] = BLEND(m, res, a);
+    ls->regs.r[LANE_F] = BLEND(m, flags, f);
+}
+
+/* Executes 'inst' on every lane in 'm8' and stores the per-lane cycle cost in 'cost' */
+static void execute(gbc_lockstep_t *ls, const gbc_instruction_t *inst, lane_i8 m8, lane_u16 *cost)
+{
+    uint8_t op = inst->opcode;
+    lane_u8 m = (lane_u8)m8;
+    lane_u16 m16 = (lane_u16)__builtin_convertvector(m8, lane_i16);
+    lane_u8 *r = ls->regs.r;
+    lane_u16 pc = ls->regs.pc + inst->size;
+    lane_u16 cycles = (lane_u16){ 0 } + inst->cycles;
+    lane_u16 pair;
+    uint8_t dst = (op >> 3) & 0x07;
+    int rr = (op >> 4) & 0x03;
+
+    if (op >= 0x40 && op < 0x80) {
+        r[dst] = BLEND(m, r[op & 0x07], r[dst]);
+    } else if (op >= 0x80 && op < 0xC0) {
+        alu(ls, dst, r[op & 0x07], m);
+    } else if ((op & 0xC7) == 0xC6) {
+        alu(ls, dst, (lane_u8){ 0 } + inst->opcode_ext.i8, m);
+    } else if ((op & 0xC7) == 0x06) {
+        r[dst] = BLEND(m, (lane_u8){ 0 } + inst->opcode_ext.i8, r[dst]);
+    } else if ((op & 0xC7) == 0x04 || (op & 0xC7) == 0x05) {
+        lane_u8 x = r[dst];
+        lane_u8 f = r[LANE_F] & (FLAG_C | 0x0F);
+        lane_u8 res;
+        if ((op & 0xC7) == 0x04) {
+            res = x + 1;
+            f |= FLAG_IF((x & 0x0F) == 0x0F, FLAG_H);
+        } else {
+            res = x - 1;
+            f |= FLAG_IF((x & 0x0F) == 0, FLAG_H) | FLAG_N;
+        }
+        f |= FLAG_IF(res == 0, FLAG_Z);
+        r[dst] = BLEND(m, res, x);
+        r[LANE_F] = BLEND(m, f, r[LANE_F]);
+    } else {
+        lane_u8 f = r[LANE_F];
+        lane_i16 taken = (lane_i16){ 0 } - 1;
+        uint8_t cc = dst & 0x03;
+
+        /* JR cc / JP cc: NZ Z NC C */
+        if ((op & 0xE7) == 0x20 || (op & 0xE7) == 0xC2) {
+            uint8_t flag = cc < 2 ? FLAG_Z : FLAG_C;
+            lane_i8 set = (f & flag) != 0;
+            taken = __builtin_convertvector((cc & 1) ? set : ~set, lane_i16);
+            cycles = BLEND((lane_u16)taken, (lane_u16){ 0 } + inst->cycles2, cycles);
+        }
+
+        switch (op) {
+        case 0x01: case 0x11: case 0x21: case 0x31:
+            pair = (lane_u16){ 0 } + inst->opcode_ext.i16;
+            set_pair(ls, rr, &pair, &m16);
+            break;
+        case 0x03: case 0x13: case 0x23: case 0x33:
+            get_pair(ls, rr, &pair);
+            pair += 1;
+            set_pair(ls, rr, &pair, &m16);
+            break;
+        case 0x0B: case 0x1B: case 0x2B: case 0x3B:
+            get_pair(ls, rr, &pair);
+            pair -= 1;
+            set_pair(ls, rr, &pair, &m16);
+            break;
+        case 0x2F:
+            r[LANE_A] = BLEND(m, ~r[LANE_A], r[LANE_A]);
+            r[LANE_F] = BLEND(m, f | FLAG_N | FLAG_H, f);
+            break;
+        case 0x37:
+            r[LANE_F] = BLEND(m, (f & (uint8_t)~(FLAG_N | FLAG_H)) | FLAG_C, f);
+            break;
+        case 0x3F:
+            r[LANE_F] = BLEND(m, (f & (uint8_t)~(FLAG_N | FLAG_H)) ^ FLAG_C, f);
+            break;
+        case 0x18: case 0x20: case 0x28: case 0x30: case 0x38:
+            pc = BLEND((lane_u16)taken, pc + (uint16_t)(int8_t)inst->opcode_ext.i8, pc);
+            break;
+        case 0xC3: case 0xC2: case 0xCA: case 0xD2: case 0xDA:
+            pc = BLEND((lane_u16)taken, (lane_u16){ 0 } + inst->opcode_ext.i16, pc);
+            break;
+        }
+    }
+
+    ls->regs.pc = BLEND(m16, pc, ls->regs.pc);
+    *cost = cycles;
+}
+
+/* What gbc_run_frame does for one instruction, with the lane's registers swapped in */
+static void scalar_step(gbc_lockstep_t *ls, int i)
+{
+    gbc_t *gbc = ls->lanes[i];
+    uint16_t pc = ls->regs.pc[i];
+
+    store_lane(ls, i);
+    gbc_scheduler_skip_halt(&gbc->sched);
+    gbc_cpu_cycle(&gbc->cpu);
+    gbc_graphic_cycle(&gbc->graphic);
+    gbc_timer_cycle(&gbc->timer);
+    gbc_idle_step(&gbc->idle, pc);
+    load_lane(ls, i);
+
+    ls->scalar_insts++;
+}
+
+/* A lane may share a vector instruction only when gbc_cpu_cycle would just execute */
+static uint8_t lane_ready(gbc_cpu_t *cpu)
+{
+    if (cpu->halt || cpu->ime_insts)
+        return 0;
+    return !(cpu->ime && (cpu->ier & *cpu->ifp & INTERRUPT_MASK));
+}
+
+/* Without a boot ROM overlay, ROM code is the same whenever both lanes map the same bank */
+static uint8_t same_rom(gbc_t *a, gbc_t *b, uint16_t pc, uint8_t size)
+{
+    uint32_t last = pc + size - 1;
+
+    if (a->mem.boot_rom_enabled || b->mem.boot_rom_enabled || last > ROM_BANK_SWITCH_END)
+        return 0;
+    if (last <= ROM_BANK_00_END)
+        return a->mbc.rom_bank0 && a->mbc.rom_bank0 == b->mbc.rom_bank0;
+    if (pc >= ROM_BANK_SWITCH_START)
+        return a->mbc.rom_bankn && a->mbc.rom_bankn == b->mbc.rom_bankn;
+    return 0;
+}
+
+static uint8_t same_code(gbc_t *lead, gbc_t *lane, uint16_t pc, uint8_t size)
+{
+    gbc_cpu_t *a = &lead->cpu, *b = &lane->cpu;
+
+    if (same_rom(lead, lane, pc, size))
+        return 1;
+    for (uint8_t k = 0; k < size; k++) {
+        if (a->mem_read(a->mem_data, pc + k) != b->mem_read(b->mem_data, pc + k))
+            return 0;
+    }
+    return 1;
+}
+
+/* One instruction on every lane in 'pending' */
+static void tick(gbc_lockstep_t *ls, uint32_t pending)
+{
+    uint32_t ready = 0;
+    gbc_instruction_t inst;
+
+    for (int i = 0; i < ls->count; i++) {
+        if ((pending & LANE_BIT(i)) && lane_ready(&ls->lanes[i]->cpu))
+            ready |= LANE_BIT(i);
+    }
+
+    while (pending) {
+        int i = __builtin_ctz(pending);
+        gbc_cpu_t *cpu = &ls->lanes[i]->cpu;
+        uint16_t pc = ls->regs.pc[i];
+        uint32_t group = LANE_BIT(i);
+
+        if (ready & group) {
+            uint8_t op = cpu->mem_read(cpu->mem_data, pc);
+            if (vectorizable(op)) {
+                decode_mem(cpu->mem_read, pc, cpu->mem_data, &inst);
+
+                lane_i16 same = ls->regs.pc == pc;
+                for (int j = i + 1; j < ls->count; j++) {
+                    if ((ready & pending & LANE_BIT(j)) && same[j] &&
+                        same_code(ls->lanes[i], ls->lanes[j], pc, inst.size))
+                        group |= LANE_BIT(j);
+                }
+            }
+        }
+
+        pending &= ~group;
+        if (group == LANE_BIT(i)) {
+            scalar_step(ls, i);
+            continue;
+        }
+
+        lane_i8 m = { 0 };
+        for (int j = 0; j < ls->count; j++)
+            m[j] = (group & LANE_BIT(j)) ? -1 : 0;
+
+        lane_u16 cycles;
+        execute(ls, &inst, m, &cycles);
+        ls->vector_insts++;
+        ls->vector_lanes += __builtin_popcount(group);
+
+        for (int j = 0; j < ls->count; j++) {
+            if (!(group & LANE_BIT(j)))
+                continue;
+            gbc_t *gbc = ls->lanes[j];
+            gbc->cpu.ins_cycles = cycles[j];
+            gbc->cpu.cycles += cycles[j];
+            gbc_graphic_cycle(&gbc->graphic);
+            gbc_timer_cycle(&gbc->timer);
+
+            /* the jump closing a polling loop is register-only and may run here */
+            if (ls->regs.pc[j] < pc) {
+                store_lane(ls, j);
+                gbc_idle_step(&gbc->idle, pc);
+            }
+        }
+    }
+}
+
+int gbc_lockstep_init(gbc_lockstep_t *ls, gbc_t **instances, int count)
+{
+    if (count < 1 || count > LOCKSTEP_LANES) {
+        LOG_ERROR("[LOCKSTEP] %d lanes, 1 to %d supported\n", count, LOCKSTEP_LANES);
+        return -1;
+    }
+
+    memset(ls, 0, sizeof(gbc_lockstep_t));
+    memcpy(ls->lanes, instances, count * sizeof(gbc_t*));
+    ls->count = count;
+    return 0;
+}
+
+/* Same as gbc_run_frame on every lane */
+void gbc_lockstep_run_frame(gbc_lockstep_t *ls)
+{
+    uint64_t start = get_time();
+    uint32_t running = 0;
+
+    for (int i = 0; i < ls->count; i++) {
+        gbc_t *gbc = ls->lanes[i];
+        gbc_scheduler_begin_frame(&gbc->sched, (uint64_t)CYCLES_PER_FRAME << gbc->cpu.dspeed);
+        load_lane(ls, i);
+        running |= LANE_BIT(i);
+    }
+
+    while (running) {
+        tick(ls, running);
+        for (int i = 0; i < ls->count; i++) {
+            gbc_t *gbc = ls->lanes[i];
+            if (gbc->cpu.cycles >= gbc->sched.frame_end)
+                running &= ~LANE_BIT(i);
+        }
+    }
+
+    for (int i = 0; i < ls->count; i++) {
+        gbc_t *gbc = ls->lanes[i];
+        store_lane(ls, i);
+        gbc_scheduler_end_frame(&gbc->sched);
+        gbc->frames++;
+
+        if (gbc->audio_log && !gbc->audio_log->speculating)
+            gbc_audio_log_end_frame(gbc->audio_log);
+    }
+
+    ls->frames++;
+    ls->ns += get_time() - start;
+}
+
+/* average fraction of the lanes a vector instruction covered */
+double gbc_lockstep_occupancy(gbc_lockstep_t *ls)
+{
+    return ls->vector_insts ? (double)ls->vector_lanes / (ls->vector_insts * ls->count) : 0.0;
+}
+
+void gbc_lockstep_report(gbc_lockstep_t *ls)
+{
+    uint64_t total = ls->vector_lanes + ls->scalar_insts;
+
+    LOG_INFO("[LOCKSTEP] %d lanes, %lu frames, %.1f%% of instructions vectorized, %.1f%% lane occupancy, %.1f us/frame\n",
+        ls->count, (unsigned long)ls->frames, total ? 100.0 * ls->vector_lanes / total : 0.0,
+        100.0 * gbc_lockstep_occupancy(ls), ls->frames ? ls->ns / 1000.0 / ls->frames : 0.0);
+}
+
+/* Runs 'frames' frames on 'lanes' instances independently and on as many in lockstep,
+ * checks both end in the same cpu state and returns the speedup of lockstep. */
+double gbc_lockstep_benchmark(const gbc_config_t *config, int lanes, uint32_t frames)
+{
+    gbc_t *solo[LOCKSTEP_LANES] = { 0 };
+    gbc_t *group[LOCKSTEP_LANES] = { 0 };
+    gbc_lockstep_t ls;
+    double speedup = 0.0;
+
+    if (lanes < 1 || lanes > LOCKSTEP_LANES)
+        return 0.0;
+
+    for (int i = 0; i < lanes; i++) {
+        solo[i] = gbc_create(config);
+        group[i] = gbc_create(config);
+        if (!solo[i] || !group[i])
+            goto out;
+    }
+    if (gbc_lockstep_init(&ls, group, lanes))
+        goto out;
+
+    uint64_t start = get_time();
+    for (uint32_t f = 0; f < frames; f++) {
+        for (int i = 0; i < lanes; i++)
+            gbc_run_frame(solo[i]);
+    }
+    uint64_t solo_ns = get_time() - start;
+
+    for (uint32_t f = 0; f < frames; f++)
+        gbc_lockstep_run_frame(&ls);
+
+    for (int i = 0; i < lanes; i++) {
+        if (memcmp(&solo[i]->cpu.reg, &group[i]->cpu.reg, sizeof(cpu_register_t)) ||
+            solo[i]->cpu.cycles != group[i]->cpu.cycles)
+            LOG_ERROR("[LOCKSTEP] lane %d diverged from the scalar run\n", i);
+    }
+
+    speedup = ls.ns ? (double)solo_ns / ls.ns : 0.0;
+    gbc_lockstep_report(&ls);
+    LOG_INFO("[LOCKSTEP] independent %.1f us/frame, lockstep %.1f us/frame, %.2fx\n",
+        solo_ns / 1000.0 / frames, ls.ns / 1000.0 / frames, speedup);
+
+out:
+    for (int i = 0; i < lanes; i++) {
+        gbc_destroy(solo[i]);
+        gbc_destroy(group[i]);
+    }
+    return speedup;
+}
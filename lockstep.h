@@ -0,0 +1,56 @@
+#ifndef LOCKSTEP_H
+#define LOCKSTEP_H
+
+#include <stdint.h>
+#include "gbc.h"
+
+/* 16 x u8 and 16 x u16 vectors: one SSE and one AVX2 register. Build with -mavx2 to
+ * keep lane_u16 in one register; without it GCC splits it in two SSE halves. */
+#define LOCKSTEP_LANES 16
+
+typedef uint8_t  lane_u8  __attribute__((vector_size(LOCKSTEP_LANES)));
+typedef int8_t   lane_i8  __attribute__((vector_size(LOCKSTEP_LANES)));
+typedef uint16_t lane_u16 __attribute__((vector_size(LOCKSTEP_LANES * 2)));
+typedef int16_t  lane_i16 __attribute__((vector_size(LOCKSTEP_LANES * 2)));
+
+/* r[] is in opcode operand order B C D E H L - A, slot 6 ((HL) in the encoding) holds F */
+#define LANE_B 0
+#define LANE_C 1
+#define LANE_D 2
+#define LANE_E 3
+#define LANE_H 4
+#define LANE_L 5
+#define LANE_F 6
+#define LANE_A 7
+
+/* cpu_register_t of every lane, structure of arrays */
+typedef struct gbc_lockstep_regs {
+    lane_u8 r[8];
+    lane_u16 sp;
+    lane_u16 pc;
+} gbc_lockstep_regs_t;
+
+/* Runs up to LOCKSTEP_LANES instances of the same ROM one instruction at a time each.
+ * Lanes whose PC and opcode bytes match execute register-only instructions together on
+ * the vectors; everything else (memory access, interrupts, halt) goes through the scalar
+ * gbc_cpu_cycle for that lane alone. Lanes regroup by themselves once their PCs meet. */
+typedef struct gbc_lockstep {
+    gbc_t *lanes[LOCKSTEP_LANES];
+    int count;
+    gbc_lockstep_regs_t regs;   /* authoritative during a frame, cpu->reg outside */
+
+    /* statistics */
+    uint64_t vector_insts;      /* instructions issued on the vectors */
+    uint64_t vector_lanes;      /* lane-instructions they covered */
+    uint64_t scalar_insts;
+    uint64_t frames;
+    uint64_t ns;
+} gbc_lockstep_t;
+
+int gbc_lockstep_init(gbc_lockstep_t *ls, gbc_t **instances, int count);
+void gbc_lockstep_run_frame(gbc_lockstep_t *ls);
+double gbc_lockstep_occupancy(gbc_lockstep_t *ls);
+void gbc_lockstep_report(gbc_lockstep_t *ls);
+double gbc_lockstep_benchmark(const gbc_config_t *config, int lanes, uint32_t frames);
+
+#endif
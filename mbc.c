@@ -0,0 +1,430 @@
+#include <string.h>
+#include "mbc.h"
+#include "common.h"
+#include "utils.h"
+
+#define MBC_REG_RAM_ENABLE(addr)   ((addr) <= MBC_RAM_ENABLE_END)     /* starts at 0x0000 */
+#define MBC_REG_ROM_BANK(addr)     IN_RANGE(addr, MBC1_ROM_BANK_NUMBER_START, MBC1_ROM_BANK_NUMBER_END)
+#define MBC_REG_RAM_BANK(addr)     IN_RANGE(addr, MBC1_RAM_BANK_NUMBER_START, MBC1_RAM_BANK_NUMBER_END)
+#define MBC_REG_MODE(addr)         IN_RANGE(addr, MBC1_BANKING_MODE_START, MBC1_BANKING_MODE_END)
+
+#define MBC_ROM_BANK_PTR(mbc, bank) ((mbc)->rom_bank_map ? \
+    (mbc)->rom_bank_map[(bank) & ((mbc)->rom_bank_size - 1)] : \
+    (mbc)->rom_banks + ((uint32_t)((bank) & ((mbc)->rom_bank_size - 1)) * ROM_BANK_SIZE))
+
+#define MBC_RAM_BANK_BASE(mbc, bank) \
+    (((mbc)->ram_enabled && (mbc)->ram_size) ? \
+    (int32_t)(((bank) % (mbc)->ram_bank_size) * RAM_BANK_SIZE) : MBC_RAM_UNMAPPED)
+
+/* ---- reads shared by every type: a cached bank pointer plus an offset ---- */
+
+static uint8_t mbc_rom0_read(void *udata, uint16_t addr)
+{
+    return ((gbc_mbc_t*)udata)->rom_bank0[addr];
+}
+
+static uint8_t mbc_romn_read(void *udata, uint16_t addr)
+{
+    return ((gbc_mbc_t*)udata)->rom_bankn[addr - MBC1_ROM_BANK_N_BEGIN];
+}
+
+static uint8_t mbc_ram_read(void *udata, uint16_t addr)
+{
+    gbc_mbc_t *mbc = (gbc_mbc_t*)udata;
+
+    if (mbc->ram_base == MBC_RAM_UNMAPPED)
+        return 0xFF;
+    return MBC_RAM_READ(mbc, mbc->ram_base + addr - MBC1_RAM_BEGIN);
+}
+
+static uint8_t mbc_ram_write(void *udata, uint16_t addr, uint8_t data)
+{
+    gbc_mbc_t *mbc = (gbc_mbc_t*)udata;
+
+    if (mbc->ram_base != MBC_RAM_UNMAPPED)
+        MBC_RAM_WRITE(mbc, mbc->ram_base + addr - MBC1_RAM_BEGIN, data);
+    return data;
+}
+
+/* MBC2 has 512 half-bytes, mirrored over the whole RAM area */
+static uint8_t mbc2_ram_read(void *udata, uint16_t addr)
+{
+    gbc_mbc_t *mbc = (gbc_mbc_t*)udata;
+
+    if (mbc->ram_base == MBC_RAM_UNMAPPED)
+        return 0xFF;
+    return MBC_RAM_READ(mbc, (addr - MBC1_RAM_BEGIN) & (MBC2_RAM_SIZE - 1)) | ~MBC2_RAM_VALUE_MASK;
+}
+
+static uint8_t mbc2_ram_write(void *udata, uint16_t addr, uint8_t data)
+{
+    gbc_mbc_t *mbc = (gbc_mbc_t*)udata;
+
+    if (mbc->ram_base != MBC_RAM_UNMAPPED)
+        MBC_RAM_WRITE(mbc, (addr - MBC1_RAM_BEGIN) & (MBC2_RAM_SIZE - 1), data & MBC2_RAM_VALUE_MASK);
+    return data;
+}
+
+/* MBC3 maps the clock registers in place of RAM for banks 08-0C */
+static uint8_t mbc3_ram_read(void *udata, uint16_t addr)
+{
+    gbc_mbc_t *mbc = (gbc_mbc_t*)udata;
+
+    if (mbc->ram_base != MBC_RAM_UNMAPPED)
+        return MBC_RAM_READ(mbc, mbc->ram_base + addr - MBC1_RAM_BEGIN);
+    if (mbc->rtc.present && mbc->ram_enabled && IS_RTC_REG(mbc->ram_bank))
+        return gbc_rtc_read(&mbc->rtc, mbc->ram_bank);
+    return 0xFF;
+}
+
+static uint8_t mbc3_ram_write(void *udata, uint16_t addr, uint8_t data)
+{
+    gbc_mbc_t *mbc = (gbc_mbc_t*)udata;
+
+    if (mbc->ram_base != MBC_RAM_UNMAPPED)
+        MBC_RAM_WRITE(mbc, mbc->ram_base + addr - MBC1_RAM_BEGIN, data);
+    else if (mbc->rtc.present && mbc->ram_enabled && IS_RTC_REG(mbc->ram_bank))
+        gbc_rtc_write(&mbc->rtc, mbc->ram_bank, data);
+    return data;
+}
+
+/* ---- per type: bank register writes and the bank pointers they select ---- */
+
+static inline void rom_only_control(gbc_mbc_t *mbc, uint16_t addr, uint8_t data)
+{
+    (void)mbc;
+    (void)addr;
+    (void)data;
+}
+
+static inline void rom_only_banks(gbc_mbc_t *mbc)
+{
+    mbc->rom_bank0 = MBC_ROM_BANK_PTR(mbc, 0);
+    mbc->rom_bankn = MBC_ROM_BANK_PTR(mbc, 1);
+    mbc->ram_base = mbc->ram_size ? 0 : MBC_RAM_UNMAPPED;
+}
+
+static inline void mbc1_control(gbc_mbc_t *mbc, uint16_t addr, uint8_t data)
+{
+    if (MBC_REG_RAM_ENABLE(addr))
+        mbc->ram_enabled = (data & UINT4_MASK) == MBC1_RAM_ENABLE;
+    else if (MBC_REG_ROM_BANK(addr))
+        mbc->rom_bank = data & MBC1_ROM_BANK_MASK;
+    else if (MBC_REG_RAM_BANK(addr))
+        mbc->ram_bank = data & MBC1_RAM_BANK_MASK;
+    else
+        mbc->mode = data & 0x1;
+}
+
+/* the 2-bit register is the upper ROM bank bits, and in mode 1 also banks 0x0000 and RAM */
+static inline void mbc1_banks(gbc_mbc_t *mbc)
+{
+    uint16_t low = mbc->rom_bank ? mbc->rom_bank : 1;
+    uint16_t high = mbc->ram_bank << MBC1_ROM_BANK_MASK_SHIFT;
+
+    mbc->rom_bank0 = MBC_ROM_BANK_PTR(mbc, mbc->mode == MBC1_BANKING_MODE_RAM ? high : 0);
+    mbc->rom_bankn = MBC_ROM_BANK_PTR(mbc, high | low);
+    mbc->ram_base = MBC_RAM_BANK_BASE(mbc, mbc->mode == MBC1_BANKING_MODE_RAM ? mbc->ram_bank : 0);
+}
+
+static inline void mbc2_control(gbc_mbc_t *mbc, uint16_t addr, uint8_t data)
+{
+    if (addr > MBC1_ROM_BANK_NUMBER_END)
+        return;
+
+    if (addr & MBC2_REG_SELECT)
+        mbc->rom_bank = data & MBC2_ROM_BANK_MASK;
+    else
+        mbc->ram_enabled = (data & UINT4_MASK) == MBC1_RAM_ENABLE;
+}
+
+static inline void mbc2_banks(gbc_mbc_t *mbc)
+{
+    mbc->rom_bank0 = MBC_ROM_BANK_PTR(mbc, 0);
+    mbc->rom_bankn = MBC_ROM_BANK_PTR(mbc, mbc->rom_bank ? mbc->rom_bank : 1);
+    mbc->ram_base = mbc->ram_enabled ? 0 : MBC_RAM_UNMAPPED;
+}
+
+static inline void mbc3_control(gbc_mbc_t *mbc, uint16_t addr, uint8_t data)
+{
+    if (MBC_REG_RAM_ENABLE(addr))
+        mbc->ram_enabled = (data & UINT4_MASK) == MBC1_RAM_ENABLE;
+    else if (MBC_REG_ROM_BANK(addr))
+        mbc->rom_bank = data & MBC3_ROM_BANK_MASK;
+    else if (MBC_REG_RAM_BANK(addr))
+        mbc->ram_bank = data;
+    else if (mbc->rtc.present)
+        gbc_rtc_latch(&mbc->rtc, data);
+}
+
+static inline void mbc3_banks(gbc_mbc_t *mbc)
+{
+    mbc->rom_bank0 = MBC_ROM_BANK_PTR(mbc, 0);
+    mbc->rom_bankn = MBC_ROM_BANK_PTR(mbc, mbc->rom_bank ? mbc->rom_bank : 1);
+    mbc->ram_base = mbc->ram_bank <= MBC3_RAM_BANK_MASK ?
+        MBC_RAM_BANK_BASE(mbc, mbc->ram_bank) : MBC_RAM_UNMAPPED;
+}
+
+static inline void mbc5_control(gbc_mbc_t *mbc, uint16_t addr, uint8_t data)
+{
+    if (MBC_REG_RAM_ENABLE(addr))
+        mbc->ram_enabled = (data & UINT4_MASK) == MBC1_RAM_ENABLE;
+    else if (IN_RANGE(addr, MBC5_ROM_BANK_LSB_START, MBC5_ROM_BANK_LSB_END))
+        mbc->rom_bank = (mbc->rom_bank & ~UINT8_MASK) | data;
+    else if (IN_RANGE(addr, MBC5_ROM_BANK_MSB_START, MBC5_ROM_BANK_MSB_END))
+        mbc->rom_bank = (mbc->rom_bank & UINT8_MASK) |
+            ((data & MBC5_REG_ROM_BANK_MSB_MASK) << MBC5_REG_ROM_BANK_MSB_SHIFT);
+    else if (MBC_REG_RAM_BANK(addr))
+        mbc->ram_bank = data & (mbc->mode ? MBC5_RUMBLE_RAM_BANK_MASK : MBC5_RAM_BANK_MASK);
+}
+
+/* bank 0 is selectable at 0x4000 on MBC5 */
+static inline void mbc5_banks(gbc_mbc_t *mbc)
+{
+    mbc->rom_bank0 = MBC_ROM_BANK_PTR(mbc, 0);
+    mbc->rom_bankn = MBC_ROM_BANK_PTR(mbc, mbc->rom_bank & MBC5_ROM_BANK_MASK);
+    mbc->ram_base = MBC_RAM_BANK_BASE(mbc, mbc->ram_bank);
+}
+
+/* One register write handler per type, with the type's control/banks functions inlined */
+#define MBC_HANDLERS(name, ram_read_func, ram_write_func)                       \
+    static uint8_t name##_write(void *udata, uint16_t addr, uint8_t data)       \
+    {                                                                           \
+        gbc_mbc_t *mbc = (gbc_mbc_t*)udata;                                     \
+        name##_control(mbc, addr, data);                                        \
+        name##_banks(mbc);                                                      \
+        return data;                                                            \
+    }                                                                           \
+    static void name##_select(gbc_mbc_t *mbc)                                   \
+    {                                                                           \
+        mbc->write = name##_write;                                              \
+        mbc->ram_read = ram_read_func;                                          \
+        mbc->ram_write = ram_write_func;                                        \
+        name##_banks(mbc);                                                      \
+    }
+
+MBC_HANDLERS(rom_only, mbc_ram_read, mbc_ram_write)
+MBC_HANDLERS(mbc1, mbc_ram_read, mbc_ram_write)
+MBC_HANDLERS(mbc2, mbc2_ram_read, mbc2_ram_write)
+MBC_HANDLERS(mbc3, mbc3_ram_read, mbc3_ram_write)
+MBC_HANDLERS(mbc5, mbc_ram_read, mbc_ram_write)
+
+void gbc_mbc_init(gbc_mbc_t *mbc)
+{
+    memset(mbc, 0, sizeof(gbc_mbc_t));
+    mbc->ram_base = MBC_RAM_UNMAPPED;
+}
+
+/* Picks the handlers once from the header; RAM must already be allocated */
+void gbc_mbc_init_with_cart(gbc_mbc_t *mbc, cartridge_t *cart)
+{
+    mbc->cart = cart;
+    if (!mbc->rom_banks)
+        mbc->rom_banks = (uint8_t*)cart - CARTRIDGE_HEADER_OFFSET;
+
+    mbc->rom_bank_size = cartridge_rom_banks(cart);
+    mbc->rom_bank = 1;
+    mbc->ram_bank = 0;
+    mbc->ram_enabled = 0;
+    mbc->mode = 0;
+
+    switch (cart->cartridge_type) {
+    case CART_TYPE_MBC1:
+    case CART_TYPE_MBC1_RAM:
+    case CART_TYPE_MBC1_RAM_BATTERY:
+        mbc->type = MBC_TYPE_MBC1;
+        mbc1_select(mbc);
+        break;
+    case CART_TYPE_MBC2:
+    case CART_TYPE_MBC2_BATTERY:
+        mbc->type = MBC_TYPE_MBC2;
+        mbc2_select(mbc);
+        break;
+    case CART_TYPE_MBC3_TIMER_BATTERY:
+    case CART_TYPE_MBC3_TIMER_RAM_BATTERY:
+    case CART_TYPE_MBC3:
+    case CART_TYPE_MBC3_RAM:
+    case CART_TYPE_MBC3_RAM_BATTERY:
+        mbc->type = MBC_TYPE_MBC3;
+        mbc3_select(mbc);
+        break;
+    case CART_TYPE_MBC5_RUMBLE:
+    case CART_TYPE_MBC5_RUMBLE_RAM:
+    case CART_TYPE_MBC5_RUMBLE_RAM_BATTERY:
+        /* mode has no other use on MBC5, it marks the rumble RAM bank mask */
+        mbc->mode = 1;
+        /* fall through */
+    case CART_TYPE_MBC5:
+    case CART_TYPE_MBC5_RAM:
+    case CART_TYPE_MBC5_RAM_BATTERY:
+        mbc->type = MBC_TYPE_MBC5;
+        mbc5_select(mbc);
+        break;
+    default:
+        if (cart->cartridge_type != CART_TYPE_ROM_ONLY &&
+            cart->cartridge_type != CART_TYPE_ROM_RAM &&
+            cart->cartridge_type != CART_TYPE_ROM_RAM_BATTERY)
+            LOG_ERROR("[MBC] unsupported cartridge type %02x, treating as ROM only\n", cart->cartridge_type);
+        mbc->type = MBC_TYPE_NONE;
+        rom_only_select(mbc);
+        break;
+    }
+
+    LOG_INFO("[MBC] type %d, %d ROM banks, %u bytes RAM\n", mbc->type, mbc->rom_bank_size, mbc->ram_size);
+}
+
+/* Recomputes the cached bank pointers after the registers were set from outside */
+void gbc_mbc_update_banks(gbc_mbc_t *mbc)
+{
+    switch (mbc->type) {
+    case MBC_TYPE_MBC1: mbc1_banks(mbc); break;
+    case MBC_TYPE_MBC2: mbc2_banks(mbc); break;
+    case MBC_TYPE_MBC3: mbc3_banks(mbc); break;
+    case MBC_TYPE_MBC5: mbc5_banks(mbc); break;
+    default:            rom_only_banks(mbc); break;
+    }
+}
+
+/* Bank switch heavy microbenchmark: 'switches' ROM bank register writes through the
+ * cartridge's handler, each followed by a read from the new bank and one from cartridge
+ * RAM. The registers are put back afterwards. Returns switches per second. */
+double gbc_mbc_benchmark(gbc_mbc_t *mbc, uint32_t switches)
+{
+    uint16_t rom_bank = mbc->rom_bank;
+    uint8_t ram_bank = mbc->ram_bank;
+    uint8_t ram_enabled = mbc->ram_enabled;
+    uint16_t banks = mbc->rom_bank_size > 1 ? mbc->rom_bank_size - 1 : 1;
+    uint32_t sum = 0;
+
+    mbc->write(mbc, MBC_RAM_ENABLE_START, MBC1_RAM_ENABLE);
+    uint64_t start = get_time();
+    for (uint32_t i = 0; i < switches; i++) {
+        /* address bit 8 selects the ROM bank register on MBC2, the others ignore it */
+        mbc->write(mbc, MBC1_ROM_BANK_NUMBER_START | MBC2_REG_SELECT, i % banks + 1);
+        sum += mbc_romn_read(mbc, MBC1_ROM_BANK_N_BEGIN + (i & (ROM_BANK_SIZE - 1)));
+        sum += mbc->ram_read(mbc, MBC1_RAM_BEGIN + (i & (RAM_BANK_SIZE - 1)));
+    }
+    uint64_t ns = get_time() - start;
+
+    mbc->rom_bank = rom_bank;
+    mbc->ram_bank = ram_bank;
+    mbc->ram_enabled = ram_enabled;
+    gbc_mbc_update_banks(mbc);
+
+    double rate = ns ? switches * 1e9 / ns : 0.0;
+    LOG_INFO("[MBC] type %d: %u bank switches in %.3f ms, %.1f ns each [%08x]\n",
+        mbc->type, switches, ns / 1e6, switches ? (double)ns / switches : 0.0, sum);
+    return rate;
+}
+
+void gbc_mbc_connect(gbc_mbc_t *mbc, gbc_memory_t *mem)
+{
+    memory_map_entry_t entry;
+
+    mbc->mem = mem;
+    entry.udata = mbc;
+
+    entry.id = ROM_BANK_0_START_ID;
+    entry.addr_begin = ROM_BANK_00_START;
+    entry.addr_end = ROM_BANK_00_END;
+    entry.read = mbc_rom0_read;
+    entry.write = mbc->write;
+    register_memory_map(mem, &entry);
+
+    entry.id = ROM_BANK_SWITCH_START_ID;
+    entry.addr_begin = ROM_BANK_SWITCH_START;
+    entry.addr_end = ROM_BANK_SWITCH_END;
+    entry.read = mbc_romn_read;
+    entry.write = mbc->write;
+    register_memory_map(mem, &entry);
+
+    entry.id = EXTERNAL_RAM_START_ID;
+    entry.addr_begin = EXTERNAL_RAM_START;
+    entry.addr_end = EXTERNAL_RAM_END;
+    entry.read = mbc->ram_read;
+    entry.write = mbc->ram_write;
+    register_memory_map(mem, &entry);
+}
+
+/* Cartridge RAM is sized from the header; ROM-only carts get none at all */
+int gbc_mbc_alloc_ram(gbc_mbc_t *mbc, cartridge_t *cart, uint8_t rtc_clock)
+{
+    uint32_t size = cartridge_ram_size(cart);
+
+    if (cart->cartridge_type == CART_TYPE_MBC2 || cart->cartridge_type == CART_TYPE_MBC2_BATTERY)
+        size = MBC2_RAM_SIZE;
+
+    mbc->ram_banks = NULL;
+    mbc->ram_size = size;
+    mbc->ram_bank_size = (size && size < RAM_BANK_SIZE) ? 1 : size / RAM_BANK_SIZE;
+
+    /* the clock is chosen before the save footer loads, so only host clocks
+     * pick up the time that passed since the .sav was written */
+    if (cartridge_has_rtc(cart))
+        gbc_rtc_init(&mbc->rtc, rtc_clock);
+
+    if (!size)
+        return 0;
+
+    mbc->ram_banks = malloc_memory(size);
+    if (!mbc->ram_banks) {
+        LOG_ERROR("[MBC] failed to allocate %u bytes of cartridge RAM\n", size);
+        mbc->ram_size = 0;
+        mbc->ram_bank_size = 0;
+        return -1;
+    }
+
+    memset(mbc->ram_banks, 0xFF, size);
+    return 0;
+}
+
+/* Battery-backed carts keep their RAM in the mapped save file instead of the heap.
+ * Timer carts append the clock footer after the RAM. */
+int gbc_mbc_open_save(gbc_mbc_t *mbc, cartridge_t *cart, const char *path, uint32_t interval_ms,
+                      uint8_t rtc_clock)
+{
+    if (!cartridge_has_battery(cart))
+        return gbc_mbc_alloc_ram(mbc, cart, rtc_clock);
+
+    if (gbc_mbc_alloc_ram(mbc, cart, rtc_clock))
+        return -1;
+
+    uint32_t save_size = mbc->ram_size + (mbc->rtc.present ? RTC_SAVE_SIZE : 0);
+    if (!save_size)
+        return 0;
+
+    gbc_battery_t *bat = malloc_memory(sizeof(gbc_battery_t));
+    if (!bat || gbc_battery_open(bat, path, save_size, interval_ms)) {
+        LOG_ERROR("[MBC] saves for %s will not persist\n", path);
+        free_memory(bat);
+        return 0;
+    }
+
+    if (mbc->ram_size) {
+        free_memory(mbc->ram_banks);
+        mbc->ram_banks = bat->data;
+    }
+    mbc->battery = bat;
+
+    if (mbc->rtc.present)
+        gbc_rtc_load(&mbc->rtc, bat, mbc->ram_size);
+    return 0;
+}
+
+void gbc_mbc_free_ram(gbc_mbc_t *mbc)
+{
+    gbc_cow_release(&mbc->ram_cow, mbc->ram_banks);
+    if (mbc->battery) {
+        gbc_rtc_save(&mbc->rtc);
+        mbc->rtc.save = NULL;
+        gbc_battery_close(mbc->battery);
+        free_memory(mbc->battery);
+        mbc->battery = NULL;
+        mbc->ram_banks = NULL;
+    }
+
+    free_memory(mbc->ram_banks);
+    mbc->ram_banks = NULL;
+    mbc->ram_size = 0;
+    mbc->ram_bank_size = 0;
+}
@@ -4,11 +4,14 @@
 #include <stdint.h>
 #include "memory.h"
 #include "cartridge.h"
+#include "battery.h"
+#include "rtc.h"
 
 #define MAX_ROM_BANKS 512
 #define MAX_RAM_BANKS 16
 #define ROM_BANK_SIZE 0x4000    /* 16KB */
 #define RAM_BANK_SIZE 0x2000    /* 8KB */
+#define MAX_RAM_SIZE (MAX_RAM_BANKS * RAM_BANK_SIZE)
 
 #define MBC1_ROM_BEGIN 0x0000
 #define MBC1_ROM_END   0x7fff
@@ -57,32 +60,86 @@
 #define MBC5_REG_ROM_BANK_MSB_MASK 0x1
 #define MBC5_REG_ROM_BANK_MSB_SHIFT 8
 
-typedef uint8_t (*mbc_read_func)(gbc_mbc_t *mbc, uint16_t addr);
-typedef uint8_t (*mbc_write_func)(gbc_mbc_t *mbc, uint16_t addr, uint8_t data);
+#define MBC2_RAM_SIZE 0x200     /* 512 x 4 bits, built into the MBC */
 
-typedef struct
+typedef struct gbc_mbc gbc_mbc_t;
+
+#define MBC2_ROM_BANK_MASK      0x0f
+#define MBC2_REG_SELECT         0x100   /* address bit 8: 0 = RAM enable, 1 = ROM bank */
+#define MBC2_RAM_VALUE_MASK     0x0f
+
+#define MBC3_ROM_BANK_MASK      0x7f
+#define MBC3_RAM_BANK_MASK      0x03
+
+#define MBC5_RUMBLE_RAM_BANK_MASK 0x07  /* bit 3 drives the rumble motor */
+
+#define MBC_TYPE_NONE 0
+#define MBC_TYPE_MBC1 1
+#define MBC_TYPE_MBC2 2
+#define MBC_TYPE_MBC3 3
+#define MBC_TYPE_MBC5 5
+
+#define MBC_RAM_UNMAPPED (-1)
+
+/* Handlers have the memory_read/memory_write signature, with the mbc as udata,
+ * so they are registered in the memory map directly. */
+typedef uint8_t (*mbc_read_func)(void *udata, uint16_t addr);
+typedef uint8_t (*mbc_write_func)(void *udata, uint16_t addr, uint8_t data);
+
+struct gbc_mbc
 {
     uint16_t rom_bank;
-    uint16_t rom_bank_size;
+    uint16_t rom_bank_size;     /* number of ROM banks */
     uint8_t ram_bank;
-    uint8_t ram_bank_size;
+    uint8_t ram_bank_size;      /* number of RAM banks */
     uint8_t ram_enabled;
     uint8_t mode;
-    uint8_t type;
+    uint8_t type;               /* MBC_TYPE_* */
 
-    mbc_read_func read;
-    mbc_write_func write;
+    /* selected once from cartridge_type */
+    mbc_write_func write;       /* bank registers, 0x0000-0x7FFF */
+    mbc_read_func ram_read;     /* 0xA000-0xBFFF */
+    mbc_write_func ram_write;
+
+    /* recomputed on every bank register write */
+    uint8_t *rom_bank0;         /* mapped at 0x0000-0x3FFF */
+    uint8_t *rom_bankn;         /* mapped at 0x4000-0x7FFF */
+    int32_t ram_base;           /* offset of the mapped RAM bank, MBC_RAM_UNMAPPED if none */
 
     gbc_memory_t *mem;
     cartridge_t *cart;
 
     uint8_t *rom_banks;
-    uint8_t ram_banks[MAX_RAM_BANKS * RAM_BANK_SIZE];
-
-} gbc_mbc_t;
+    uint8_t **rom_bank_map; /* per-bank pointers of a deduplicated ROM, or NULL if contiguous */
+    uint8_t *ram_banks;     /* sized from the header, NULL without cartridge RAM */
+    uint32_t ram_size;
+    gbc_battery_t *battery; /* set when ram_banks is the mapped .sav file */
+    uint64_t ram_dirty[DIRTY_WORDS(MAX_RAM_SIZE)];
+    gbc_cow_table_t ram_cow;
+    gbc_rtc_t rtc;          /* MBC3 timer carts, 'present' is 0 otherwise */
+
+};
+
+/* every cartridge RAM store goes through here so battery saves see it */
+#define MBC_RAM_WRITE(mbc, offset, data)                        \
+    do {                                                        \
+        COW_TOUCH(&(mbc)->ram_cow, (mbc)->ram_banks, (offset)); \
+        (mbc)->ram_banks[(offset)] = (data);                    \
+        DIRTY_MARK((mbc)->ram_dirty, (offset));                 \
+        if ((mbc)->battery)                                     \
+            gbc_battery_mark((mbc)->battery, (offset));         \
+    } while (0)
+
+#define MBC_RAM_READ(mbc, offset) gbc_cow_read(&(mbc)->ram_cow, (mbc)->ram_banks, (offset))
 
 void gbc_mbc_init(gbc_mbc_t *mbc);
 void gbc_mbc_connect(gbc_mbc_t *mbc, gbc_memory_t *mem);
 void gbc_mbc_init_with_cart(gbc_mbc_t *mbc, cartridge_t *cart);
+void gbc_mbc_update_banks(gbc_mbc_t *mbc);
+int gbc_mbc_alloc_ram(gbc_mbc_t *mbc, cartridge_t *cart, uint8_t rtc_clock);
+int gbc_mbc_open_save(gbc_mbc_t *mbc, cartridge_t *cart, const char *path, uint32_t interval_ms,
+                      uint8_t rtc_clock);
+void gbc_mbc_free_ram(gbc_mbc_t *mbc);
+double gbc_mbc_benchmark(gbc_mbc_t *mbc, uint32_t switches);
 
 #endif 
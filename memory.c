@@ -0,0 +1,139 @@
+#include <string.h>
+#include "memory.h"
+#include "common.h"
+#include "utils.h"
+
+/* DMG cartridges only see WRAM banks 0 and 1 */
+int mem_alloc_banks(gbc_memory_t *mem, cartridge_t *cart)
+{
+    mem->wram_banks = cartridge_is_cgb(cart) ? WRAM_MAX_BANKS : WRAM_DMG_BANKS;
+    mem->wram = malloc_memory(WRAM_BANK_SIZE * mem->wram_banks);
+    if (!mem->wram) {
+        LOG_ERROR("[MEM] failed to allocate %d WRAM banks\n", mem->wram_banks);
+        mem->wram_banks = 0;
+        return -1;
+    }
+
+    memset(mem->wram, 0, WRAM_BANK_SIZE * mem->wram_banks);
+    return 0;
+}
+
+void mem_free_banks(gbc_memory_t *mem)
+{
+    gbc_cow_release(&mem->wram_cow, mem->wram);
+    free_memory(mem->wram);
+    mem->wram = NULL;
+    mem->wram_banks = 0;
+}
+
+/* C000-DFFF, and E000-FDFF mirroring C000-DDFF */
+static uint32_t wram_offset(gbc_memory_t *mem, uint16_t addr)
+{
+    if (addr >= ECHO_RAM_START)
+        addr -= ECHO_RAM_START - WRAM_BANK_0_START;
+    if (addr <= WRAM_BANK_0_END)
+        return addr - WRAM_BANK_0_START;
+    return WRAM_SWITCH_BANK(mem) * WRAM_BANK_SIZE + addr - WRAM_BANK_SWITCH_START;
+}
+
+static uint8_t wram_read(void *udata, uint16_t addr)
+{
+    gbc_memory_t *mem = (gbc_memory_t*)udata;
+    return MEM_WRAM_READ(mem, wram_offset(mem, addr));
+}
+
+static uint8_t wram_write(void *udata, uint16_t addr, uint8_t data)
+{
+    gbc_memory_t *mem = (gbc_memory_t*)udata;
+    MEM_WRAM_WRITE(mem, wram_offset(mem, addr), data);
+    return 0;
+}
+
+static uint8_t oam_read(void *udata, uint16_t addr)
+{
+    return ((gbc_memory_t*)udata)->oam[addr - OAM_START];
+}
+
+static uint8_t oam_write(void *udata, uint16_t addr, uint8_t data)
+{
+    ((gbc_memory_t*)udata)->oam[addr - OAM_START] = data;
+    return 0;
+}
+
+static uint8_t hram_read(void *udata, uint16_t addr)
+{
+    return ((gbc_memory_t*)udata)->hraw[addr - HRAM_START];
+}
+
+static uint8_t hram_write(void *udata, uint16_t addr, uint8_t data)
+{
+    ((gbc_memory_t*)udata)->hraw[addr - HRAM_START] = data;
+    return 0;
+}
+
+/* Cost of the dirty page mark on the WRAM store path: MEM_WRAM_WRITE against the same
+ * stores with only its COW test. WRAM is unshared first and put back afterwards; the
+ * pages stay marked. Returns the extra ns per store. */
+double mem_wram_benchmark(gbc_memory_t *mem, uint32_t stores)
+{
+    uint32_t size = WRAM_BANK_SIZE * mem->wram_banks;
+    uint8_t *saved = malloc_memory(size);
+    uint32_t sum = 0;
+
+    if (!saved)
+        return 0.0;
+    gbc_cow_unshare_all(&mem->wram_cow, mem->wram);
+    memcpy(saved, mem->wram, size);
+
+    /* a stride that visits every page, like a game clearing or copying buffers */
+    uint64_t start = get_time();
+    for (uint32_t i = 0; i < stores; i++) {
+        uint32_t offset = (i * 17) & (size - 1);
+        COW_TOUCH(&mem->wram_cow, mem->wram, offset);
+        mem->wram[offset] = i;
+    }
+    uint64_t plain_ns = get_time() - start;
+    sum += mem->wram[stores & (size - 1)];
+
+    start = get_time();
+    for (uint32_t i = 0; i < stores; i++)
+        MEM_WRAM_WRITE(mem, (i * 17) & (size - 1), i);
+    uint64_t marked_ns = get_time() - start;
+    sum += mem->wram[stores & (size - 1)];
+
+    memcpy(mem->wram, saved, size);
+    free_memory(saved);
+
+    double plain = stores ? (double)plain_ns / stores : 0.0;
+    double marked = stores ? (double)marked_ns / stores : 0.0;
+    LOG_INFO("[MEM] %u WRAM stores: %.2f ns unmarked, %.2f ns marked dirty, %+.2f ns each [%08x]\n",
+        stores, plain, marked, marked - plain, sum);
+    return marked - plain;
+}
+
+/* The RAM the bus owns itself; WRAM stores are marked dirty and unshared here */
+void mem_connect_ram(gbc_memory_t *mem)
+{
+    static const struct {
+        uint16_t id, begin, end;
+        memory_read read;
+        memory_write write;
+    } regions[] = {
+        { WRAM_BANK_0_START_ID, WRAM_BANK_0_START, WRAM_BANK_0_END, wram_read, wram_write },
+        { WRAM_BANK_SWITCH_START_ID, WRAM_BANK_SWITCH_START, WRAM_BANK_SWITCH_END, wram_read, wram_write },
+        { ECHO_RAM_START_ID, ECHO_RAM_START, ECHO_RAM_END, wram_read, wram_write },
+        { OAM_START_ID, OAM_START, OAM_END, oam_read, oam_write },
+        { HRAM_START_ID, HRAM_START, HRAM_END, hram_read, hram_write },
+    };
+    memory_map_entry_t entry;
+
+    entry.udata = mem;
+    for (size_t i = 0; i < sizeof(regions) / sizeof(regions[0]); i++) {
+        entry.id = regions[i].id;
+        entry.addr_begin = regions[i].begin;
+        entry.addr_end = regions[i].end;
+        entry.read = regions[i].read;
+        entry.write = regions[i].write;
+        register_memory_map(mem, &entry);
+    }
+}
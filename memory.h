@@ -3,8 +3,11 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include "cartridge.h"
+#include "dirty.h"
+#include "cow.h"
 
-#define MEMORY_MAP_ENTRIES 14
+#define MEMORY_MAP_ENTRIES 16
 
 #define ROM_BANK_00_START   0x0000
 #define ROM_BANK_00_END     0x3FFF
@@ -26,6 +29,9 @@
 #define NON_USABLE_END   0xFEFF
 #define IO_REGISTERS_START_1 0xFF00
 #define IO_REGISTERS_END_1   0xFF0F
+#define JOYPAD_PORT 0xFF00
+#define TIMER_BEGIN 0xFF04
+#define TIMER_END   0xFF07
 #define AUDIO_BEGIN 0xFF10
 #define AUDIO_END 0xFF3F
 #define IO_REGISTERS_START_2 0xFF40
@@ -45,10 +51,12 @@
 #define OAM_START_ID 8
 #define NON_USABLE_START_ID 9
 #define IO_REGISTERS_START_ID 10
-#define AUDIO_ID 10
+#define AUDIO_ID 11
 #define IO_REGISTERS_START_ID_2 12
 #define HRAM_START_ID 13
 #define INTERRUPT_ENABLE_REGISTER_ID 14
+#define TIMER_ID 15
+#define JOYPAD_ID 16
 
 
 #define VRAM_BANK_SIZE 0x2000
@@ -98,8 +106,10 @@
 #define IO_PORT_OBP1 0x49
 #define IO_PORT_WY 0x4A
 #define IO_PORT_WX 0x4B
+#define IO_PORT_KEY0 0x4C
 #define IO_PORT_KEY1 0x4D
 #define IO_PORT_VBK 0x4F
+#define IO_PORT_BANK 0x50
 #define IO_PORT_HDMA1 0x51
 #define IO_PORT_HDMA2 0x52
 #define IO_PORT_HDMA3 0x53
@@ -133,12 +143,18 @@ typedef struct
     uint16_t c[4];
 } gbc_palette_t;
 
+#define WRAM_MAX_BANKS 8
+#define WRAM_DMG_BANKS 2
+
 typedef struct
 {
     memory_read read;
     memory_write write;
     memory_map_entry_t map[MEMORY_MAP_ENTRIES];
-    uint8_t wram[WRAM_BANK_SIZE * 8]; /* 8 WRAM banks */
+    uint8_t *wram;          /* WRAM_BANK_SIZE * wram_banks */
+    uint8_t wram_banks;     /* 8 on CGB, 2 on DMG */
+    uint64_t wram_dirty[DIRTY_WORDS(WRAM_BANK_SIZE * WRAM_MAX_BANKS)];
+    gbc_cow_table_t wram_cow;   /* pages still shared with a fork parent or child */
     uint8_t hraw[HRAM_END - HRAM_START + 1];
 
     uint8_t io_ports[IO_REGISTERS_END_2 - IO_REGISTERS_START_1 + 1];
@@ -159,6 +175,21 @@ typedef struct
 
 #define REQUEST_INTERRUPT(mem, intp) ((mem)->io_ports[IO_PORT_IF] |= (intp))
 
+/* SVBK selects bank 1-7 in CGB mode, 0 maps to 1; DMG has a fixed bank 1 */
+#define WRAM_SWITCH_BANK(mem) \
+    (((mem)->wram_banks > WRAM_DMG_BANKS && (IO_PORT_READ(mem, IO_PORT_SVBK) & 0x7)) ? \
+    (IO_PORT_READ(mem, IO_PORT_SVBK) & 0x7) : 1)
+
+/* Every WRAM store goes through here so snapshots see it. HRAM and OAM are smaller than
+ * a dirty page and are saved whole with the rest of gbc_memory_t. */
+#define MEM_WRAM_WRITE(mem, offset, data)                                       \
+    do {                                                                        \
+        COW_TOUCH(&(mem)->wram_cow, (mem)->wram, (offset));                     \
+        (mem)->wram[(offset)] = (data);                                         \
+        DIRTY_MARK((mem)->wram_dirty, (offset));                                \
+    } while (0)
+#define MEM_WRAM_READ(mem, offset) gbc_cow_read(&(mem)->wram_cow, (mem)->wram, (offset))
+
 #define BG_PALETTE_READ(mem, idx) ((mem)->bg_palette + ((idx)))
 #define OBJ_PALETTE_READ(mem, idx) ((mem)->obj_palette + ((idx)))
 #define OAM_ADDR(mem) ((mem)->oam)
@@ -166,6 +197,10 @@ typedef struct
 void mem_init(gbc_memory_t *memory);
 void register_memory_map(gbc_memory_t *mem, memory_map_entry_t *entry);
 void* connect_io_port(gbc_memory_t *mem, uint16_t addr);
+int mem_alloc_banks(gbc_memory_t *mem, cartridge_t *cart);
+void mem_free_banks(gbc_memory_t *mem);
+void mem_connect_ram(gbc_memory_t *mem);
+double mem_wram_benchmark(gbc_memory_t *mem, uint32_t stores);
 
 typedef uint8_t (*memory_read)(void *udata, uint16_t addr);
 typedef uint8_t (*memory_write)(void *udata, uint16_t addr, uint8_t data);
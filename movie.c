@@ -0,0 +1,404 @@
+#include <stdio.h>
+#include <string.h>
+#include "movie.h"
+#include "common.h"
+#include "utils.h"
+
+typedef struct movie_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint64_t rom_hash;
+    uint64_t start_hash;
+    uint64_t frames;
+    uint32_t check_interval;
+    uint32_t check_count;
+    uint64_t input_size;        /* run-length coded bytes that follow */
+} movie_header_t;
+
+void gbc_movie_init(gbc_movie_t *movie)
+{
+    memset(movie, 0, sizeof(gbc_movie_t));
+    movie->first_desync = UINT64_MAX;
+}
+
+static void free_keyframes(gbc_movie_t *movie)
+{
+    for (uint32_t k = 0; k < movie->keyframe_count; k++)
+        free_memory(movie->keyframes[k]);
+    free_memory(movie->keyframes);
+    movie->keyframes = NULL;
+    movie->keyframe_count = 0;
+}
+
+void gbc_movie_free(gbc_movie_t *movie)
+{
+    free_keyframes(movie);
+    free_memory(movie->inputs);
+    free_memory(movie->checks);
+    gbc_movie_init(movie);
+}
+
+/* One frame with 'buttons' held. A frame that gets hashed is drawn even when colour
+ * output is off, so headless playback can still check it. */
+static void movie_frame(gbc_movie_t *movie, uint8_t buttons, uint8_t hashed)
+{
+    gbc_t *gbc = movie->gbc;
+    screen_write write = gbc->graphic.screen_write;
+
+    io_set_buttons(&gbc->io, buttons);
+    if (hashed)
+        gbc_set_color_output(gbc, 1);
+    gbc_run_frame(gbc);
+    gbc->graphic.screen_write = write;
+    movie->position++;
+}
+
+static void take_check(gbc_movie_t *movie, gbc_movie_check_t *check)
+{
+    gbc_state_components_t c;
+
+    gbc_get_components(movie->gbc, &c);
+    check->frame = movie->position;
+    check->frame_hash = hash64(movie->gbc->framebuffer, sizeof(movie->gbc->framebuffer), 0);
+    check->state_hash = gbc_state_hash(&c);
+}
+
+static uint64_t start_hash(gbc_t *gbc)
+{
+    gbc_state_components_t c;
+
+    gbc_get_components(gbc, &c);
+    return gbc_state_hash(&c);
+}
+
+/* Records from the current state, or from power-on with MOVIE_FROM_POWER_ON */
+int gbc_movie_record_begin(gbc_movie_t *movie, gbc_t *gbc, uint32_t flags, uint32_t check_interval)
+{
+    gbc_movie_free(movie);
+
+    if ((flags & MOVIE_FROM_POWER_ON) && gbc_reset(gbc))
+        return -1;
+    if (gbc->mbc.rtc.present && gbc->mbc.rtc.clock != RTC_CLOCK_EMULATED)
+        LOG_ERROR("[MOVIE] the cartridge clock follows host time, replays will desync\n");
+
+    movie->gbc = gbc;
+    movie->flags = flags;
+    movie->check_interval = check_interval;
+    movie->rom_hash = gbc_rom_hash(gbc->rom);
+    movie->start_hash = start_hash(gbc);
+    return 0;
+}
+
+int gbc_movie_record_frame(gbc_movie_t *movie, uint8_t buttons)
+{
+    if (movie->frames == movie->capacity) {
+        uint64_t capacity = movie->capacity ? movie->capacity * 2 : 4096;
+        uint8_t *inputs = malloc_memory(capacity);
+        if (!inputs)
+            return -1;
+        memcpy(inputs, movie->inputs, movie->frames);
+        free_memory(movie->inputs);
+        movie->inputs = inputs;
+        movie->capacity = capacity;
+    }
+
+    uint8_t hashed = movie->check_interval && (movie->position + 1) % movie->check_interval == 0;
+    if (hashed && movie->check_count == movie->check_capacity) {
+        uint32_t capacity = movie->check_capacity ? movie->check_capacity * 2 : 64;
+        gbc_movie_check_t *checks = malloc_memory(capacity * sizeof(gbc_movie_check_t));
+        if (!checks)
+            return -1;
+        memcpy(checks, movie->checks, movie->check_count * sizeof(gbc_movie_check_t));
+        free_memory(movie->checks);
+        movie->checks = checks;
+        movie->check_capacity = capacity;
+    }
+
+    movie->inputs[movie->frames++] = buttons;
+    movie_frame(movie, buttons, hashed);
+    if (hashed)
+        take_check(movie, movie->checks + movie->check_count++);
+    return 0;
+}
+
+/* Runs of the same input as (mask, LEB128 length) pairs; returns the bytes written */
+static size_t rle_encode(const uint8_t *inputs, uint64_t frames, uint8_t *out)
+{
+    uint8_t *p = out;
+
+    for (uint64_t i = 0; i < frames;) {
+        uint64_t run = 1;
+        while (i + run < frames && inputs[i + run] == inputs[i])
+            run++;
+
+        *p++ = inputs[i];
+        for (uint64_t n = run; ; n >>= 7) {
+            *p++ = (n & 0x7F) | (n >= 0x80 ? 0x80 : 0);
+            if (n < 0x80)
+                break;
+        }
+        i += run;
+    }
+
+    return p - out;
+}
+
+static int rle_decode(const uint8_t *in, size_t size, uint8_t *inputs, uint64_t frames)
+{
+    const uint8_t *end = in + size;
+    uint64_t i = 0;
+
+    while (in < end) {
+        uint8_t mask = *in++;
+        uint64_t run = 0;
+        int shift = 0;
+
+        do {
+            if (in == end || shift > 63)
+                return -1;
+            run |= (uint64_t)(*in & 0x7F) << shift;
+            shift += 7;
+        } while (*in++ & 0x80);
+
+        if (run > frames - i)
+            return -1;
+        memset(inputs + i, mask, run);
+        i += run;
+    }
+
+    return i == frames ? 0 : -1;
+}
+
+int gbc_movie_save(gbc_movie_t *movie, const char *path)
+{
+    uint8_t *rle = malloc_memory(movie->frames * 2 + 1);
+    if (!rle)
+        return -1;
+
+    movie_header_t header = {
+        MOVIE_MAGIC, MOVIE_VERSION, movie->flags, movie->rom_hash, movie->start_hash,
+        movie->frames, movie->check_interval, movie->check_count, 0
+    };
+    header.input_size = rle_encode(movie->inputs, movie->frames, rle);
+
+    FILE *fp = fopen(path, "wb");
+    int ok = fp && fwrite(&header, sizeof(header), 1, fp) == 1 &&
+        fwrite(rle, 1, header.input_size, fp) == header.input_size &&
+        fwrite(movie->checks, sizeof(gbc_movie_check_t), movie->check_count, fp) == movie->check_count;
+    if (fp && fclose(fp))
+        ok = 0;
+    free_memory(rle);
+
+    if (!ok) {
+        LOG_ERROR("[MOVIE] failed to write %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+/* Sizes a loaded header asks for must fit in memory and in each other before anything is allocated */
+static int header_sane(const movie_header_t *header)
+{
+    if (header->frames > (SIZE_MAX - 1) / 2 || header->input_size > header->frames * 2 + 1)
+        return 0;
+    if (!header->check_interval)
+        return header->check_count == 0;
+    return header->check_count <= header->frames / header->check_interval + 1;
+}
+
+int gbc_movie_load(gbc_movie_t *movie, const char *path)
+{
+    movie_header_t header;
+    uint8_t *rle = NULL;
+    int ret = -1;
+
+    gbc_movie_free(movie);
+
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        LOG_ERROR("[MOVIE] cannot open %s\n", path);
+        return -1;
+    }
+
+    if (fread(&header, sizeof(header), 1, fp) != 1 || header.magic != MOVIE_MAGIC ||
+        header.version != MOVIE_VERSION || !header_sane(&header)) {
+        LOG_ERROR("[MOVIE] %s is not a version %d movie\n", path, MOVIE_VERSION);
+        goto out;
+    }
+
+    rle = malloc_memory((size_t)header.input_size + 1);
+    movie->inputs = malloc_memory((size_t)header.frames + 1);
+    movie->checks = malloc_memory(((size_t)header.check_count + 1) * sizeof(gbc_movie_check_t));
+    if (!rle || !movie->inputs || !movie->checks)
+        goto out;
+
+    if (fread(rle, 1, header.input_size, fp) != header.input_size ||
+        rle_decode(rle, header.input_size, movie->inputs, header.frames) ||
+        fread(movie->checks, sizeof(gbc_movie_check_t), header.check_count, fp) != header.check_count) {
+        LOG_ERROR("[MOVIE] %s is truncated or corrupt\n", path);
+        goto out;
+    }
+
+    movie->flags = header.flags;
+    movie->check_interval = header.check_interval;
+    movie->rom_hash = header.rom_hash;
+    movie->start_hash = header.start_hash;
+    movie->frames = header.frames;
+    movie->capacity = header.frames;
+    movie->check_count = header.check_count;
+    movie->check_capacity = header.check_count;
+    ret = 0;
+
+out:
+    fclose(fp);
+    free_memory(rle);
+    if (ret)
+        gbc_movie_free(movie);
+    return ret;
+}
+
+/* Keyframe k holds the state after k * keyframe_interval frames */
+static void keep_keyframe(gbc_movie_t *movie)
+{
+    gbc_state_components_t c;
+
+    if (movie->position % movie->keyframe_interval ||
+        movie->position / movie->keyframe_interval != movie->keyframe_count)
+        return;
+
+    uint8_t *state = malloc_memory(movie->state_size);
+    if (!state)
+        return;
+
+    gbc_get_components(movie->gbc, &c);
+    gbc_state_save(&c, state, movie->state_size);
+    movie->keyframes[movie->keyframe_count++] = state;
+}
+
+/* Puts 'gbc' at the start of the movie. 'start' is the start state unless the movie
+ * begins at power-on; either way it must hash to what was recorded. */
+int gbc_movie_play_begin(gbc_movie_t *movie, gbc_t *gbc, const uint8_t *start, size_t size, uint32_t keyframe_interval)
+{
+    gbc_state_components_t c;
+
+    if (gbc_rom_hash(gbc->rom) != movie->rom_hash) {
+        LOG_ERROR("[MOVIE] recorded with a different ROM\n");
+        return -1;
+    }
+
+    gbc_get_components(gbc, &c);
+    if (movie->flags & MOVIE_FROM_POWER_ON) {
+        if (gbc_reset(gbc))
+            return -1;
+    } else if (!start || gbc_load_state(gbc, start, size)) {
+        LOG_ERROR("[MOVIE] needs its start state\n");
+        return -1;
+    }
+
+    if (gbc_state_hash(&c) != movie->start_hash) {
+        LOG_ERROR("[MOVIE] start state does not match the recording\n");
+        return -1;
+    }
+
+    free_keyframes(movie);
+    movie->gbc = gbc;
+    movie->position = 0;
+    movie->next_check = 0;
+    movie->desyncs = 0;
+    movie->first_desync = UINT64_MAX;
+    gbc->frames = 0;
+
+    movie->keyframe_interval = keyframe_interval ? keyframe_interval : MOVIE_DEFAULT_KEYFRAMES;
+    movie->state_size = gbc_state_size(&c);
+    uint64_t count = movie->frames / movie->keyframe_interval + 1;
+    movie->keyframes = malloc_memory(count * sizeof(uint8_t*));
+    if (!movie->keyframes)
+        return -1;
+    memset(movie->keyframes, 0, count * sizeof(uint8_t*));
+    keep_keyframe(movie);
+    return movie->keyframe_count ? 0 : -1;
+}
+
+/* Plays one frame and checks it if the recording has hashes for it. Returns 0 at the end. */
+int gbc_movie_play_frame(gbc_movie_t *movie)
+{
+    if (movie->position >= movie->frames)
+        return 0;
+
+    keep_keyframe(movie);
+
+    gbc_movie_check_t *expected = movie->next_check < movie->check_count ?
+        movie->checks + movie->next_check : NULL;
+    uint8_t hashed = expected && expected->frame == movie->position + 1;
+
+    movie_frame(movie, movie->inputs[movie->position], hashed);
+
+    if (hashed) {
+        gbc_movie_check_t got;
+        take_check(movie, &got);
+        if (got.frame_hash != expected->frame_hash || got.state_hash != expected->state_hash) {
+            if (!movie->desyncs)
+                LOG_ERROR("[MOVIE] desync at frame %lu\n", (unsigned long)movie->position);
+            if (movie->position < movie->first_desync)
+                movie->first_desync = movie->position;
+            movie->desyncs++;
+        }
+        movie->next_check++;
+    }
+
+    return 1;
+}
+
+/* Unthrottled to the end; returns the checks that failed */
+uint64_t gbc_movie_play(gbc_movie_t *movie)
+{
+    uint64_t start = get_time();
+    uint64_t from = movie->position;
+
+    while (gbc_movie_play_frame(movie))
+        ;
+
+    movie->play_ns += get_time() - start;
+    movie->played += movie->position - from;
+    return movie->desyncs;
+}
+
+/* Loads the last keyframe at or before 'frame' and plays forward from it */
+int gbc_movie_seek(gbc_movie_t *movie, uint64_t frame)
+{
+    if (frame > movie->frames || !movie->keyframes)
+        return -1;
+
+    uint64_t k = frame / movie->keyframe_interval;
+    if (k >= movie->keyframe_count)
+        k = movie->keyframe_count - 1;
+
+    /* already between that keyframe and the target: just keep going */
+    if (movie->position > frame || movie->position < k * movie->keyframe_interval) {
+        if (gbc_load_state(movie->gbc, movie->keyframes[k], movie->state_size))
+            return -1;
+        movie->position = k * movie->keyframe_interval;
+        movie->gbc->frames = movie->position;
+
+        movie->next_check = 0;
+        while (movie->next_check < movie->check_count &&
+            movie->checks[movie->next_check].frame <= movie->position)
+            movie->next_check++;
+    }
+
+    while (movie->position < frame)
+        gbc_movie_play_frame(movie);
+    return 0;
+}
+
+void gbc_movie_report(gbc_movie_t *movie)
+{
+    double fps = movie->play_ns ? movie->played * 1e9 / movie->play_ns : 0.0;
+
+    LOG_INFO("[MOVIE] %lu frames, %u checks every %u frames, %u keyframes\n",
+        (unsigned long)movie->frames, movie->check_count, movie->check_interval, movie->keyframe_count);
+    LOG_INFO("[MOVIE] played %lu frames in %.2f s, %.0f frames/s, %lu desyncs (first at frame %ld)\n",
+        (unsigned long)movie->played, movie->play_ns / 1e9, fps, (unsigned long)movie->desyncs,
+        movie->desyncs ? (long)movie->first_desync : -1L);
+}
@@ -0,0 +1,68 @@
+#ifndef MOVIE_H
+#define MOVIE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "gbc.h"
+
+#define MOVIE_MAGIC   0x4549564f4d434247ULL    /* "GBCMOVIE" */
+#define MOVIE_VERSION 1
+
+#define MOVIE_FROM_POWER_ON 0x01                /* starts at gbc_reset, no start state needed */
+
+#define MOVIE_DEFAULT_KEYFRAMES 600             /* frames between seek snapshots, 10 s */
+
+/* Hashes recorded every 'check_interval' frames to catch a desync where it happens */
+typedef struct gbc_movie_check {
+    uint64_t frame;                             /* frames played when it was taken */
+    uint64_t frame_hash;                        /* RGB555 framebuffer */
+    uint64_t state_hash;                        /* gbc_state_hash */
+} gbc_movie_check_t;
+
+/* One joypad byte (io_set_buttons KEY_* bits) per frame, from a start state identified
+ * by its hash. On disk the inputs are run-length coded. Replays are only deterministic
+ * with RTC_CLOCK_EMULATED. */
+typedef struct gbc_movie {
+    uint32_t flags;                             /* MOVIE_* */
+    uint32_t check_interval;                    /* 0: no checks */
+    uint64_t rom_hash;                          /* gbc_rom_hash */
+    uint64_t start_hash;                        /* gbc_state_hash of the start state */
+
+    uint8_t *inputs;
+    uint64_t frames;
+    uint64_t capacity;
+    gbc_movie_check_t *checks;
+    uint32_t check_count;
+    uint32_t check_capacity;
+
+    /* recording or playback */
+    gbc_t *gbc;
+    uint64_t position;                          /* next frame to record or play */
+    uint32_t next_check;                        /* playback: next entry of 'checks' */
+
+    /* playback keyframes, one state every 'keyframe_interval' frames from the start */
+    uint32_t keyframe_interval;
+    uint8_t **keyframes;
+    uint32_t keyframe_count;
+    size_t state_size;
+
+    /* playback statistics */
+    uint64_t desyncs;
+    uint64_t first_desync;                      /* frame of the first mismatch, UINT64_MAX if none */
+    uint64_t played;
+    uint64_t play_ns;
+} gbc_movie_t;
+
+void gbc_movie_init(gbc_movie_t *movie);
+void gbc_movie_free(gbc_movie_t *movie);
+int gbc_movie_record_begin(gbc_movie_t *movie, gbc_t *gbc, uint32_t flags, uint32_t check_interval);
+int gbc_movie_record_frame(gbc_movie_t *movie, uint8_t buttons);
+int gbc_movie_save(gbc_movie_t *movie, const char *path);
+int gbc_movie_load(gbc_movie_t *movie, const char *path);
+int gbc_movie_play_begin(gbc_movie_t *movie, gbc_t *gbc, const uint8_t *start, size_t size, uint32_t keyframe_interval);
+int gbc_movie_play_frame(gbc_movie_t *movie);
+uint64_t gbc_movie_play(gbc_movie_t *movie);
+int gbc_movie_seek(gbc_movie_t *movie, uint64_t frame);
+void gbc_movie_report(gbc_movie_t *movie);
+
+#endif
@@ -0,0 +1,97 @@
+#include <string.h>
+#include "obs.h"
+#include "common.h"
+#include "utils.h"
+
+/* first output cell and its weight for each of 'in' source cells mapped onto 'out' */
+static void build_taps(uint8_t *first, uint8_t *weight, uint16_t in, uint16_t out)
+{
+    for (uint16_t i = 0; i < in; i++) {
+        uint32_t begin = (uint32_t)i * out;
+        uint32_t end = begin + out;
+        uint32_t cell = begin / in;
+        uint32_t boundary = (cell + 1) * in;
+
+        first[i] = cell;
+        weight[i] = (end < boundary ? end : boundary) - begin;
+    }
+}
+
+int gbc_obs_init(gbc_obs_t *obs, uint16_t width, uint16_t height)
+{
+    memset(obs, 0, sizeof(gbc_obs_t));
+
+    if (!width || !height || width > OBS_SOURCE_WIDTH || height > OBS_SOURCE_HEIGHT) {
+        LOG_ERROR("[OBS] %ux%u observation, at most %ux%u\n", width, height, OBS_SOURCE_WIDTH, OBS_SOURCE_HEIGHT);
+        return -1;
+    }
+
+    obs->out = malloc_memory((size_t)width * height);
+    if (!obs->out)
+        return -1;
+    memset(obs->out, 0, (size_t)width * height);
+
+    obs->width = width;
+    obs->height = height;
+    build_taps(obs->col, obs->col_w, OBS_SOURCE_WIDTH, width);
+    build_taps(obs->row, obs->row_w, OBS_SOURCE_HEIGHT, height);
+    return 0;
+}
+
+void gbc_obs_free(gbc_obs_t *obs)
+{
+    free_memory(obs->out);
+    memset(obs, 0, sizeof(gbc_obs_t));
+}
+
+/* Called when scanline 'y' is complete: filters it horizontally into the pending output
+ * rows and writes out a row once its last source line is in. */
+void gbc_obs_line(gbc_obs_t *obs, uint8_t y)
+{
+    uint32_t h[OBS_SOURCE_WIDTH + 1];
+    uint16_t width = obs->width;
+
+    if (y >= OBS_SOURCE_HEIGHT)
+        return;
+
+    memset(h, 0, (width + 1) * sizeof(uint32_t));
+    for (int x = 0; x < OBS_SOURCE_WIDTH; x++) {
+        uint8_t c = obs->col[x];
+        uint32_t w = obs->col_w[x];
+        h[c] += obs->line[x] * w;
+        h[c + 1] += obs->line[x] * (width - w);
+    }
+
+    uint32_t w0 = obs->row_w[y];
+    uint32_t w1 = obs->height - w0;
+    for (int c = 0; c < width; c++) {
+        obs->acc[0][c] += h[c] * w0;
+        obs->acc[1][c] += h[c] * w1;
+    }
+
+    uint8_t r = obs->row[y];
+    if (y + 1 < OBS_SOURCE_HEIGHT && obs->row[y + 1] == r)
+        return;
+
+    /* every output pixel covers OBS_SOURCE_WIDTH * OBS_SOURCE_HEIGHT units */
+    const uint32_t area = OBS_SOURCE_WIDTH * OBS_SOURCE_HEIGHT;
+    uint8_t *out = obs->out + (size_t)r * width;
+    for (int c = 0; c < width; c++)
+        out[c] = (obs->acc[0][c] + area / 2) / area;
+
+    memcpy(obs->acc[0], obs->acc[1], width * sizeof(uint32_t));
+    memset(obs->acc[1], 0, width * sizeof(uint32_t));
+
+    if (y == OBS_SOURCE_HEIGHT - 1)
+        obs->frames++;
+}
+
+/* The consumer-side path: the same filter over a finished RGB555 frame */
+void gbc_obs_downscale(gbc_obs_t *obs, const uint16_t *frame)
+{
+    for (int y = 0; y < OBS_SOURCE_HEIGHT; y++) {
+        for (int x = 0; x < OBS_SOURCE_WIDTH; x++)
+            gbc_obs_pixel(obs, x, frame[y * OBS_SOURCE_WIDTH + x]);
+        gbc_obs_line(obs, y);
+    }
+}
@@ -0,0 +1,46 @@
+#ifndef OBS_H
+#define OBS_H
+
+#include <stdint.h>
+
+#define OBS_SOURCE_WIDTH  160
+#define OBS_SOURCE_HEIGHT 144
+
+/* RGB555 to 8-bit luminance, BT.601 weights prescaled for 5-bit channels */
+#define OBS_LUMA(c) \
+    (((((c) & 0x1F) * 633) + ((((c) >> 5) & 0x1F) * 1234) + ((((c) >> 10) & 0x1F) * 238)) >> 8)
+
+/* Downscaled grayscale observation, filled one scanline at a time. Every source pixel is
+ * an area of width x height units and every output pixel one of 160 x 144 units, so each
+ * source pixel spreads over at most two output columns and two output rows with integer
+ * weights: an exact box (area) filter for any target size up to the screen size. */
+typedef struct gbc_obs {
+    uint16_t width;
+    uint16_t height;
+    uint8_t *out;                               /* width * height, row major */
+
+    uint8_t line[OBS_SOURCE_WIDTH];             /* luminance of the scanline being drawn */
+
+    /* per source column/row: first output column/row and the weight that goes to it,
+     * the rest of width/height goes to the next one */
+    uint8_t col[OBS_SOURCE_WIDTH];
+    uint8_t col_w[OBS_SOURCE_WIDTH];
+    uint8_t row[OBS_SOURCE_HEIGHT];
+    uint8_t row_w[OBS_SOURCE_HEIGHT];
+
+    uint32_t acc[2][OBS_SOURCE_WIDTH];          /* output rows row[y] and row[y] + 1 */
+    uint64_t frames;
+} gbc_obs_t;
+
+/* renderer side: one pixel of the current scanline */
+static inline void gbc_obs_pixel(gbc_obs_t *obs, uint8_t x, uint16_t color)
+{
+    obs->line[x] = OBS_LUMA(color);
+}
+
+int gbc_obs_init(gbc_obs_t *obs, uint16_t width, uint16_t height);
+void gbc_obs_free(gbc_obs_t *obs);
+void gbc_obs_line(gbc_obs_t *obs, uint8_t y);
+void gbc_obs_downscale(gbc_obs_t *obs, const uint16_t *frame);
+
+#endif
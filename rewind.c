@@ -0,0 +1,340 @@
+#include <string.h>
+#include "rewind.h"
+#include "common.h"
+#include "utils.h"
+
+/* Delta coding: a sequence of runs, each a LEB128 varint (length << 1 | literal) followed
+ * by 'length' bytes for a literal run. Zero runs, unchanged bytes, carry no data. */
+#define RUN_LITERAL 1
+#define RUN_ZERO    0
+
+/* worst case: one varint per literal byte pair and the data */
+#define DELTA_BOUND(size) ((size) + (size) / 2 + 16)
+
+static uint8_t* put_varint(uint8_t *p, size_t v)
+{
+    while (v >= 0x80) {
+        *p++ = (v & 0x7F) | 0x80;
+        v >>= 7;
+    }
+    *p++ = v;
+    return p;
+}
+
+static const uint8_t* get_varint(const uint8_t *p, size_t *v)
+{
+    size_t value = 0;
+    int shift = 0;
+
+    do {
+        value |= (size_t)(*p & 0x7F) << shift;
+        shift += 7;
+    } while (*p++ & 0x80);
+
+    *v = value;
+    return p;
+}
+
+/* Encodes cur ^ prev; literal runs end only at 8 or more equal bytes */
+static size_t encode_delta(const uint8_t *cur, const uint8_t *prev, size_t size, uint8_t *out)
+{
+    uint8_t *p = out;
+    size_t i = 0;
+
+    while (i < size) {
+        size_t start = i;
+        uint64_t a, b;
+
+        /* unchanged words */
+        while (i + 8 <= size) {
+            memcpy(&a, cur + i, 8);
+            memcpy(&b, prev + i, 8);
+            if (a != b)
+                break;
+            i += 8;
+        }
+        while (i < size && cur[i] == prev[i])
+            i++;
+        if (i > start)
+            p = put_varint(p, (i - start) << 1 | RUN_ZERO);
+        if (i >= size)
+            break;
+
+        /* changed bytes, until a full unchanged word */
+        start = i;
+        while (i < size) {
+            if (i + 8 <= size) {
+                memcpy(&a, cur + i, 8);
+                memcpy(&b, prev + i, 8);
+                if (a == b)
+                    break;
+            }
+            i++;
+        }
+        p = put_varint(p, (i - start) << 1 | RUN_LITERAL);
+        for (size_t j = start; j < i; j++)
+            *p++ = cur[j] ^ prev[j];
+    }
+
+    return p - out;
+}
+
+static void apply_delta(uint8_t *state, const uint8_t *delta, size_t delta_size)
+{
+    const uint8_t *p = delta;
+    const uint8_t *end = delta + delta_size;
+    size_t pos = 0, run;
+
+    while (p < end) {
+        p = get_varint(p, &run);
+        if (run & RUN_LITERAL) {
+            for (size_t j = 0; j < run >> 1; j++)
+                state[pos + j] ^= p[j];
+            p += run >> 1;
+        }
+        pos += run >> 1;
+    }
+}
+
+#define ENTRY(rw, i) ((rw)->entries + (((rw)->first + (i)) % REWIND_MAX_ENTRIES))
+
+static void evict_oldest(gbc_rewind_t *rw)
+{
+    rw->used -= ENTRY(rw, 0)->size;
+    rw->first = (rw->first + 1) % REWIND_MAX_ENTRIES;
+    rw->count--;
+}
+
+/* Appends a delta after the newest one, dropping the oldest deltas it would overwrite */
+static void ring_push(gbc_rewind_t *rw, const uint8_t *data, size_t size)
+{
+    if (size > rw->budget) {
+        /* the chain back from head would have a hole, nothing older is usable */
+        while (rw->count)
+            evict_oldest(rw);
+        return;
+    }
+
+    size_t pos = 0;
+    if (rw->count) {
+        gbc_rewind_entry_t *newest = ENTRY(rw, rw->count - 1);
+        pos = newest->offset + newest->size;
+    }
+
+    uint8_t wrapped = pos + size > rw->budget;
+    size_t gap = pos;
+    if (wrapped)
+        pos = 0;
+
+    while (rw->count) {
+        gbc_rewind_entry_t *oldest = ENTRY(rw, 0);
+        uint8_t overlaps = oldest->offset < pos + size && oldest->offset + oldest->size > pos;
+        uint8_t in_gap = wrapped && oldest->offset >= gap;
+        if (!overlaps && !in_gap && rw->count < REWIND_MAX_ENTRIES)
+            break;
+        evict_oldest(rw);
+    }
+
+    memcpy(rw->ring + pos, data, size);
+    gbc_rewind_entry_t *entry = ENTRY(rw, rw->count);
+    entry->offset = pos;
+    entry->size = size;
+    rw->count++;
+    rw->used += size;
+}
+
+/* Worker side: turns one full snapshot into a delta against the current head */
+static void compress_slot(gbc_rewind_t *rw, const uint8_t *snapshot)
+{
+    uint64_t start = get_time();
+
+    if (rw->head_valid) {
+        /* XOR the newer snapshot back into the older one: the delta goes backwards */
+        size_t size = encode_delta(rw->head, snapshot, rw->state_size, rw->delta);
+        pthread_mutex_lock(&rw->lock);
+        ring_push(rw, rw->delta, size);
+        pthread_mutex_unlock(&rw->lock);
+        rw->packed_bytes += size;
+    }
+
+    memcpy(rw->head, snapshot, rw->state_size);
+    rw->head_valid = 1;
+    rw->raw_bytes += rw->state_size;
+    rw->compress_ns += get_time() - start;
+}
+
+static void* rewind_worker(void *arg)
+{
+    gbc_rewind_t *rw = (gbc_rewind_t*)arg;
+
+    pthread_mutex_lock(&rw->lock);
+    for (;;) {
+        while (rw->running && !rw->slot_full[rw->slot_work])
+            pthread_cond_wait(&rw->wake, &rw->lock);
+        if (!rw->slot_full[rw->slot_work])
+            break;
+
+        uint8_t slot = rw->slot_work;
+        pthread_mutex_unlock(&rw->lock);
+        compress_slot(rw, rw->slots[slot]);
+        pthread_mutex_lock(&rw->lock);
+
+        rw->slot_full[slot] = 0;
+        rw->slot_work = (slot + 1) % REWIND_SLOTS;
+        pthread_cond_broadcast(&rw->idle);
+    }
+    pthread_mutex_unlock(&rw->lock);
+
+    return NULL;
+}
+
+int gbc_rewind_init(gbc_rewind_t *rw, gbc_t *gbc, size_t budget, uint32_t interval)
+{
+    memset(rw, 0, sizeof(gbc_rewind_t));
+    rw->gbc = gbc;
+    gbc_get_components(gbc, &rw->components);
+    rw->interval = interval ? interval : REWIND_DEFAULT_INTERVAL;
+    rw->state_size = gbc_state_size(&rw->components);
+    rw->budget = budget;
+
+    rw->head = malloc_memory(rw->state_size);
+    rw->delta = malloc_memory(DELTA_BOUND(rw->state_size));
+    rw->ring = malloc_memory(budget);
+    for (int i = 0; i < REWIND_SLOTS; i++)
+        rw->slots[i] = malloc_memory(rw->state_size);
+
+    if (!rw->head || !rw->delta || !rw->ring || !rw->slots[0] || !rw->slots[1]) {
+        LOG_ERROR("[REWIND] cannot allocate a %zu byte ring\n", budget);
+        gbc_rewind_cleanup(rw);
+        return -1;
+    }
+
+    pthread_mutex_init(&rw->lock, NULL);
+    pthread_cond_init(&rw->wake, NULL);
+    pthread_cond_init(&rw->idle, NULL);
+    rw->running = 1;
+    if (pthread_create(&rw->worker, NULL, rewind_worker, rw)) {
+        LOG_ERROR("[REWIND] failed to start the worker\n");
+        rw->running = 0;
+        pthread_mutex_destroy(&rw->lock);
+        pthread_cond_destroy(&rw->wake);
+        pthread_cond_destroy(&rw->idle);
+        gbc_rewind_cleanup(rw);
+        return -1;
+    }
+
+    LOG_INFO("[REWIND] %zu byte states, %zu KB ring, snapshot every %u frames\n",
+        rw->state_size, budget / 1024, rw->interval);
+    return 0;
+}
+
+void gbc_rewind_cleanup(gbc_rewind_t *rw)
+{
+    if (rw->running) {
+        pthread_mutex_lock(&rw->lock);
+        rw->running = 0;
+        pthread_cond_signal(&rw->wake);
+        pthread_mutex_unlock(&rw->lock);
+        pthread_join(rw->worker, NULL);
+
+        pthread_mutex_destroy(&rw->lock);
+        pthread_cond_destroy(&rw->wake);
+        pthread_cond_destroy(&rw->idle);
+    }
+
+    free_memory(rw->head);
+    free_memory(rw->delta);
+    free_memory(rw->ring);
+    for (int i = 0; i < REWIND_SLOTS; i++)
+        free_memory(rw->slots[i]);
+    memset(rw, 0, sizeof(gbc_rewind_t));
+}
+
+/* Called once per emulated frame */
+void gbc_rewind_frame(gbc_rewind_t *rw)
+{
+    if (++rw->frame < rw->interval)
+        return;
+    rw->frame = 0;
+
+    uint64_t start = get_time();
+
+    pthread_mutex_lock(&rw->lock);
+    uint8_t slot = rw->slot_next;
+    uint8_t busy = rw->slot_full[slot];
+    pthread_mutex_unlock(&rw->lock);
+
+    if (busy) {
+        rw->dropped++;
+    } else {
+        gbc_state_save(&rw->components, rw->slots[slot], rw->state_size);
+
+        pthread_mutex_lock(&rw->lock);
+        rw->slot_full[slot] = 1;
+        rw->slot_next = (slot + 1) % REWIND_SLOTS;
+        pthread_cond_signal(&rw->wake);
+        pthread_mutex_unlock(&rw->lock);
+        rw->snapshots++;
+    }
+
+    rw->frame_ns += get_time() - start;
+    rw->frames += rw->interval;
+}
+
+/* waits until every handed-off snapshot is in the ring */
+void gbc_rewind_sync(gbc_rewind_t *rw)
+{
+    pthread_mutex_lock(&rw->lock);
+    for (int i = 0; i < REWIND_SLOTS; i++) {
+        while (rw->slot_full[i])
+            pthread_cond_wait(&rw->idle, &rw->lock);
+    }
+    pthread_mutex_unlock(&rw->lock);
+}
+
+/* Goes back one snapshot interval and loads it. Returns -1 when the ring is empty. */
+int gbc_rewind_step(gbc_rewind_t *rw)
+{
+    gbc_rewind_sync(rw);
+
+    pthread_mutex_lock(&rw->lock);
+    if (!rw->count || !rw->head_valid) {
+        pthread_mutex_unlock(&rw->lock);
+        return -1;
+    }
+
+    gbc_rewind_entry_t *newest = ENTRY(rw, rw->count - 1);
+    apply_delta(rw->head, rw->ring + newest->offset, newest->size);
+    rw->used -= newest->size;
+    rw->count--;
+    pthread_mutex_unlock(&rw->lock);
+
+    rw->frame = 0;
+    return gbc_load_state(rw->gbc, rw->head, rw->state_size);
+}
+
+/* frames that can be rewound */
+uint32_t gbc_rewind_depth(gbc_rewind_t *rw)
+{
+    return rw->count * rw->interval;
+}
+
+size_t gbc_rewind_memory(gbc_rewind_t *rw)
+{
+    return rw->budget + rw->state_size * (REWIND_SLOTS + 1) + DELTA_BOUND(rw->state_size);
+}
+
+void gbc_rewind_report(gbc_rewind_t *rw)
+{
+    gbc_rewind_sync(rw);
+
+    LOG_INFO("[REWIND] %u snapshots, %u frames (%.1f s) deep, %zu/%zu KB ring, %zu KB total\n",
+        rw->count, gbc_rewind_depth(rw), gbc_rewind_depth(rw) / (double)FRAME_RATE,
+        rw->used / 1024, rw->budget / 1024, gbc_rewind_memory(rw) / 1024);
+    if (rw->snapshots) {
+        LOG_INFO("[REWIND] %.1fx compression, %.2f us/frame on the emulation thread, %.1f us/snapshot on the worker, %lu dropped\n",
+            rw->packed_bytes ? (double)rw->raw_bytes / rw->packed_bytes : 0.0,
+            rw->frames ? rw->frame_ns / 1000.0 / rw->frames : 0.0,
+            rw->compress_ns / 1000.0 / rw->snapshots, (unsigned long)rw->dropped);
+    }
+}
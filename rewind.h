@@ -0,0 +1,72 @@
+#ifndef REWIND_H
+#define REWIND_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "state.h"
+#include "gbc.h"
+
+#define REWIND_MAX_ENTRIES 8192
+#define REWIND_SLOTS 2                  /* snapshots handed to the worker, not yet compressed */
+#define REWIND_DEFAULT_INTERVAL 4       /* frames between snapshots */
+
+typedef struct gbc_rewind_entry {
+    size_t offset;                      /* in 'ring' */
+    size_t size;
+} gbc_rewind_entry_t;
+
+/* Snapshots every 'interval' frames. The newest one is kept whole in 'head'; older ones are
+ * XOR deltas against the next newer snapshot, run-length coded into a byte ring of 'budget'
+ * bytes. Going back one snapshot XORs the newest delta into 'head', so the oldest deltas
+ * can be dropped whenever the ring is full. The emulation thread only copies the state out
+ * (gbc_state_save); diffing and compression happen on the worker. */
+typedef struct gbc_rewind {
+    gbc_t *gbc;
+    gbc_state_components_t components;
+    uint32_t interval;
+    uint32_t frame;
+    size_t state_size;
+
+    uint8_t *head;                      /* newest snapshot the ring is relative to */
+    uint8_t head_valid;
+    uint8_t *delta;                     /* worker scratch, worst case encoded size */
+
+    uint8_t *slots[REWIND_SLOTS];
+    uint8_t slot_full[REWIND_SLOTS];
+    uint8_t slot_next;                  /* next slot to fill */
+    uint8_t slot_work;                  /* next slot to compress */
+
+    uint8_t *ring;
+    size_t budget;
+    gbc_rewind_entry_t entries[REWIND_MAX_ENTRIES];
+    uint32_t first;                     /* oldest entry */
+    uint32_t count;
+    size_t used;
+
+    pthread_t worker;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;                /* worker: a slot was filled or stop */
+    pthread_cond_t idle;                /* emulation thread: a slot was released */
+    uint8_t running;
+
+    /* statistics */
+    uint64_t snapshots;
+    uint64_t dropped;                   /* worker still busy with both slots */
+    uint64_t raw_bytes;
+    uint64_t packed_bytes;
+    uint64_t frame_ns;                  /* emulation thread time spent in gbc_rewind_frame */
+    uint64_t frames;
+    uint64_t compress_ns;
+} gbc_rewind_t;
+
+int gbc_rewind_init(gbc_rewind_t *rw, gbc_t *gbc, size_t budget, uint32_t interval);
+void gbc_rewind_cleanup(gbc_rewind_t *rw);
+void gbc_rewind_frame(gbc_rewind_t *rw);
+int gbc_rewind_step(gbc_rewind_t *rw);
+void gbc_rewind_sync(gbc_rewind_t *rw);
+uint32_t gbc_rewind_depth(gbc_rewind_t *rw);
+size_t gbc_rewind_memory(gbc_rewind_t *rw);
+void gbc_rewind_report(gbc_rewind_t *rw);
+
+#endif
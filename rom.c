@@ -0,0 +1,372 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "rom.h"
+#include "mbc.h"
+#include "common.h"
+#include "utils.h"
+
+/* every mapped ROM in the process */
+static gbc_rom_t *roms;
+static pthread_mutex_t roms_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* deduplicated banks by content hash, also guarded by roms_lock */
+static gbc_rom_bank_t *bank_buckets[GBC_ROM_BANK_BUCKETS];
+
+/* https://gbdev.io/pandocs/The_Cartridge_Header.html#014d--header-checksum */
+int gbc_rom_check_header(const uint8_t *data, size_t size)
+{
+    if (size < CARTRIDGE_CODE_OFFSET) {
+        LOG_ERROR("[ROM] %zu bytes is too small for a header\n", size);
+        return -1;
+    }
+
+    const cartridge_t *cart = (const cartridge_t*)(data + CARTRIDGE_HEADER_OFFSET);
+    uint8_t checksum = 0;
+    for (int addr = CARTRIDGE_CHECKSUM_BEGIN; addr <= CARTRIDGE_CHECKSUM_END; addr++)
+        checksum = checksum - data[addr] - 1;
+
+    if (checksum != cart->header_checksum) {
+        LOG_ERROR("[ROM] bad header checksum %02x, expected %02x\n", cart->header_checksum, checksum);
+        return -1;
+    }
+
+    if (cart->rom_size > CARTRIDGE_MAX_ROM_SIZE_CODE || (size_t)cartridge_rom_size(cart) > size) {
+        LOG_ERROR("[ROM] header declares %d bytes, file has %zu\n", cartridge_rom_size(cart), size);
+        return -1;
+    }
+
+    return 0;
+}
+
+static gbc_rom_t* rom_map(int fd, struct stat *st, uint32_t flags)
+{
+    int mmap_flags = MAP_PRIVATE;
+    if (flags & GBC_ROM_POPULATE)
+        mmap_flags |= MAP_POPULATE;
+
+    uint8_t *data = mmap(NULL, st->st_size, PROT_READ, mmap_flags, fd, 0);
+    if (data == MAP_FAILED) {
+        LOG_ERROR("[ROM] mmap failed\n");
+        return NULL;
+    }
+
+#ifdef MADV_HUGEPAGE
+    if (flags & GBC_ROM_HUGEPAGE)
+        madvise(data, st->st_size, MADV_HUGEPAGE);
+#endif
+
+    if (gbc_rom_check_header(data, st->st_size)) {
+        munmap(data, st->st_size);
+        return NULL;
+    }
+
+    gbc_rom_t *rom = malloc_memory(sizeof(gbc_rom_t));
+    if (!rom) {
+        munmap(data, st->st_size);
+        return NULL;
+    }
+
+    memset(rom, 0, sizeof(gbc_rom_t));
+    rom->data = data;
+    rom->size = st->st_size;
+    rom->cart = (cartridge_t*)(data + CARTRIDGE_HEADER_OFFSET);
+    rom->dev = st->st_dev;
+    rom->ino = st->st_ino;
+    rom->mtime = st->st_mtime;
+    rom->refs = 1;
+
+    return rom;
+}
+
+static gbc_rom_bank_t* bank_get(const uint8_t *data)
+{
+    uint64_t hash = hash64(data, ROM_BANK_SIZE, 0);
+    gbc_rom_bank_t **bucket = bank_buckets + (hash & (GBC_ROM_BANK_BUCKETS - 1));
+    gbc_rom_bank_t *bank;
+
+    for (bank = *bucket; bank; bank = bank->next) {
+        if (bank->hash == hash && !memcmp(bank->data, data, ROM_BANK_SIZE)) {
+            bank->refs++;
+            return bank;
+        }
+    }
+
+    bank = malloc_memory(sizeof(gbc_rom_bank_t));
+    if (!bank)
+        return NULL;
+
+    /* a page-aligned copy of its own, read-only like the file mapping */
+    bank->data = mmap(NULL, ROM_BANK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (bank->data == MAP_FAILED) {
+        free_memory(bank);
+        return NULL;
+    }
+    memcpy(bank->data, data, ROM_BANK_SIZE);
+    mprotect(bank->data, ROM_BANK_SIZE, PROT_READ);
+
+    bank->hash = hash;
+    bank->refs = 1;
+    bank->next = *bucket;
+    *bucket = bank;
+    return bank;
+}
+
+static void bank_put(gbc_rom_bank_t *bank)
+{
+    if (--bank->refs)
+        return;
+
+    for (gbc_rom_bank_t **p = bank_buckets + (bank->hash & (GBC_ROM_BANK_BUCKETS - 1)); *p; p = &(*p)->next) {
+        if (*p == bank) {
+            *p = bank->next;
+            break;
+        }
+    }
+
+    munmap(bank->data, ROM_BANK_SIZE);
+    free_memory(bank);
+}
+
+static void rom_free_banks(gbc_rom_t *rom)
+{
+    for (uint32_t i = 0; i < rom->bank_count; i++) {
+        if (rom->banks[i])
+            bank_put(rom->banks[i]);
+    }
+    free_memory(rom->banks);
+    free_memory(rom->bank_map);
+    rom->banks = NULL;
+    rom->bank_map = NULL;
+    rom->bank_count = 0;
+}
+
+/* Swaps the file mapping for shared banks. Called with roms_lock held. */
+static int rom_dedup(gbc_rom_t *rom)
+{
+    uint8_t tail[ROM_BANK_SIZE];
+
+    rom->bank_count = (rom->size + ROM_BANK_SIZE - 1) / ROM_BANK_SIZE;
+    rom->banks = malloc_memory(rom->bank_count * sizeof(gbc_rom_bank_t*));
+    rom->bank_map = malloc_memory(rom->bank_count * sizeof(uint8_t*));
+    if (!rom->banks || !rom->bank_map) {
+        free_memory(rom->banks);
+        free_memory(rom->bank_map);
+        rom->banks = NULL;
+        rom->bank_map = NULL;
+        rom->bank_count = 0;
+        return -1;
+    }
+    memset(rom->banks, 0, rom->bank_count * sizeof(gbc_rom_bank_t*));
+
+    for (uint32_t i = 0; i < rom->bank_count; i++) {
+        const uint8_t *data = rom->data + (size_t)i * ROM_BANK_SIZE;
+
+        /* a short last bank reads as open bus past the end of the file */
+        if ((size_t)(i + 1) * ROM_BANK_SIZE > rom->size) {
+            size_t left = rom->size - (size_t)i * ROM_BANK_SIZE;
+            memcpy(tail, data, left);
+            memset(tail + left, 0xFF, ROM_BANK_SIZE - left);
+            data = tail;
+        }
+
+        rom->banks[i] = bank_get(data);
+        if (!rom->banks[i]) {
+            rom_free_banks(rom);
+            return -1;
+        }
+        rom->bank_map[i] = rom->banks[i]->data;
+    }
+
+    munmap(rom->data, rom->size);
+    rom->data = NULL;
+    rom->cart = (cartridge_t*)(rom->bank_map[0] + CARTRIDGE_HEADER_OFFSET);
+    return 0;
+}
+
+gbc_rom_t* gbc_rom_open(const char *path, uint32_t flags)
+{
+    struct stat st;
+    gbc_rom_t *rom;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        LOG_ERROR("[ROM] cannot open %s\n", path);
+        return NULL;
+    }
+    if (fstat(fd, &st)) {
+        close(fd);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&roms_lock);
+
+    for (rom = roms; rom; rom = rom->next) {
+        /* a plain mapping and a deduplicated one are not interchangeable */
+        if (rom->dev == st.st_dev && rom->ino == st.st_ino &&
+            rom->mtime == st.st_mtime && rom->size == (size_t)st.st_size &&
+            (rom->flags & GBC_ROM_DEDUP) == (flags & GBC_ROM_DEDUP)) {
+            rom->refs++;
+            break;
+        }
+    }
+
+    if (!rom) {
+        rom = rom_map(fd, &st, flags);
+        if (rom && (flags & GBC_ROM_DEDUP) && rom_dedup(rom))
+            LOG_ERROR("[ROM] cannot deduplicate %s, keeping the mapping\n", path);
+        if (rom) {
+            rom->flags = flags;
+            rom->next = roms;
+            roms = rom;
+            LOG_INFO("[ROM] mapped %s, %zu bytes, type %02x\n", path, rom->size, rom->cart->cartridge_type);
+        }
+    }
+
+    pthread_mutex_unlock(&roms_lock);
+    close(fd);
+
+    return rom;
+}
+
+/* Another reference to an open ROM, for forked instances */
+void gbc_rom_retain(gbc_rom_t *rom)
+{
+    pthread_mutex_lock(&roms_lock);
+    rom->refs++;
+    pthread_mutex_unlock(&roms_lock);
+}
+
+void gbc_rom_release(gbc_rom_t *rom)
+{
+    pthread_mutex_lock(&roms_lock);
+
+    if (--rom->refs) {
+        pthread_mutex_unlock(&roms_lock);
+        return;
+    }
+
+    for (gbc_rom_t **p = &roms; *p; p = &(*p)->next) {
+        if (*p == rom) {
+            *p = rom->next;
+            break;
+        }
+    }
+
+    if (rom->banks)
+        rom_free_banks(rom);
+
+    pthread_mutex_unlock(&roms_lock);
+
+    if (rom->data)
+        munmap(rom->data, rom->size);
+    free_memory(rom);
+}
+
+/* one 16 KB bank, the last one padded with 0xFF like a deduplicated copy */
+static uint64_t bank_hash(const uint8_t *data, size_t size, size_t offset)
+{
+    uint8_t tail[ROM_BANK_SIZE];
+
+    if (offset + ROM_BANK_SIZE <= size)
+        return hash64(data + offset, ROM_BANK_SIZE, 0);
+
+    memcpy(tail, data + offset, size - offset);
+    memset(tail + size - offset, 0xFF, ROM_BANK_SIZE - (size - offset));
+    return hash64(tail, ROM_BANK_SIZE, 0);
+}
+
+/* Hash of the 16 KB bank hashes of a ROM image. The ROM library indexes files by it, so
+ * a library entry and a mapped or deduplicated ROM of the same file hash the same. */
+uint64_t gbc_rom_hash_data(const uint8_t *data, size_t size)
+{
+    uint64_t hash = size;
+
+    for (size_t offset = 0; offset < size; offset += ROM_BANK_SIZE) {
+        uint64_t bank = bank_hash(data, size, offset);
+        hash = hash64(&bank, sizeof(bank), hash);
+    }
+    return hash ? hash : 1;
+}
+
+/* gbc_rom_hash_data of the ROM, from the shared banks' hashes when deduplicated.
+ * Computed on first use; racing callers compute the same value. */
+uint64_t gbc_rom_hash(gbc_rom_t *rom)
+{
+    uint64_t hash = __atomic_load_n(&rom->hash, __ATOMIC_RELAXED);
+
+    if (hash)
+        return hash;
+
+    if (rom->banks) {
+        hash = rom->size;
+        for (size_t offset = 0; offset < rom->size; offset += ROM_BANK_SIZE) {
+            uint64_t bank = rom->banks[offset / ROM_BANK_SIZE]->hash;
+            hash = hash64(&bank, sizeof(bank), hash);
+        }
+        if (!hash)
+            hash = 1;
+    } else {
+        hash = gbc_rom_hash_data(rom->data, rom->size);
+    }
+
+    __atomic_store_n(&rom->hash, hash, __ATOMIC_RELAXED);
+    return hash;
+}
+
+/* bytes of the mapping currently in memory */
+size_t gbc_rom_resident(gbc_rom_t *rom)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t pages = (rom->size + page - 1) / page;
+    size_t resident = 0;
+
+    /* anonymous bank copies are always resident, and shared */
+    if (!rom->data)
+        return (size_t)rom->bank_count * ROM_BANK_SIZE;
+
+    unsigned char *vec = malloc_memory(pages);
+    if (!vec)
+        return 0;
+
+    if (!mincore(rom->data, rom->size, vec)) {
+        for (size_t i = 0; i < pages; i++)
+            resident += vec[i] & 1;
+    }
+
+    free_memory(vec);
+    return resident * page;
+}
+
+void gbc_rom_report(gbc_rom_t *rom)
+{
+    size_t resident = gbc_rom_resident(rom);
+
+    LOG_INFO("[ROM] %.16s: %zu KB resident shared by %u instances, %zu KB per instance (%zu KB with a private copy)\n",
+        rom->cart->title, resident / 1024, rom->refs, resident / 1024 / rom->refs, rom->size / 1024);
+}
+
+/* How much the bank store saves over one private copy per ROM */
+void gbc_rom_dedup_report(void)
+{
+    uint64_t unique = 0, refs = 0;
+
+    pthread_mutex_lock(&roms_lock);
+    for (int i = 0; i < GBC_ROM_BANK_BUCKETS; i++) {
+        for (gbc_rom_bank_t *bank = bank_buckets[i]; bank; bank = bank->next) {
+            unique++;
+            refs += bank->refs;
+        }
+    }
+    pthread_mutex_unlock(&roms_lock);
+
+    if (!unique)
+        return;
+
+    LOG_INFO("[ROM] %lu bank references backed by %lu unique banks, dedup ratio %.2f, %lu KB resident, %lu KB saved\n",
+        (unsigned long)refs, (unsigned long)unique, (double)refs / unique,
+        (unsigned long)(unique * ROM_BANK_SIZE / 1024), (unsigned long)((refs - unique) * ROM_BANK_SIZE / 1024));
+}
@@ -0,0 +1,55 @@
+#ifndef ROM_H
+#define ROM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include "cartridge.h"
+
+#define GBC_ROM_POPULATE 0x01   /* prefault the whole mapping (MAP_POPULATE) */
+#define GBC_ROM_HUGEPAGE 0x02   /* ask for transparent hugepages, a hint only */
+#define GBC_ROM_DEDUP    0x04   /* back identical banks of every ROM with one shared copy */
+
+#define GBC_ROM_BANK_BUCKETS 4096
+
+/* A 16 KB bank shared by every deduplicated ROM that contains it */
+typedef struct gbc_rom_bank {
+    uint64_t hash;
+    uint32_t refs;
+    uint8_t *data;
+    struct gbc_rom_bank *next;
+} gbc_rom_bank_t;
+
+/* A read-only mapping of a ROM file, shared by every instance in the process that opens
+ * the same file. mbc->rom_banks points straight into 'data'. A deduplicated ROM has no
+ * mapping left: 'bank_map' goes in mbc->rom_bank_map and 'cart' points into bank 0. */
+typedef struct gbc_rom {
+    uint8_t *data;
+    size_t size;
+    cartridge_t *cart;      /* header, in place */
+
+    gbc_rom_bank_t **banks; /* GBC_ROM_DEDUP only */
+    uint8_t **bank_map;
+    uint32_t bank_count;
+
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+    uint32_t flags;         /* GBC_ROM_* it was opened with */
+    uint32_t refs;
+    uint64_t hash;          /* content hash, 0 until gbc_rom_hash computes it */
+
+    struct gbc_rom *next;
+} gbc_rom_t;
+
+gbc_rom_t* gbc_rom_open(const char *path, uint32_t flags);
+void gbc_rom_retain(gbc_rom_t *rom);
+void gbc_rom_release(gbc_rom_t *rom);
+uint64_t gbc_rom_hash(gbc_rom_t *rom);
+uint64_t gbc_rom_hash_data(const uint8_t *data, size_t size);
+int gbc_rom_check_header(const uint8_t *data, size_t size);
+size_t gbc_rom_resident(gbc_rom_t *rom);
+void gbc_rom_report(gbc_rom_t *rom);
+void gbc_rom_dedup_report(void);
+
+#endif
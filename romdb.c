@@ -0,0 +1,395 @@
+#define _GNU_SOURCE    /* qsort_r */
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "romdb.h"
+#include "rom.h"
+#include "common.h"
+#include "utils.h"
+
+#define ROMDB_GLOBAL_CHECKSUM_ADDR 0x14E    /* big endian, excluded from its own sum */
+#define ROMDB_PATH_MAX 4096
+
+typedef struct romdb_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t entry_size;
+    uint32_t count;
+    uint32_t strings_size;
+} romdb_header_t;
+
+/* a scan in progress: the new entry table and the part workers still have to fill */
+typedef struct romdb_scan {
+    gbc_romdb_t *db;
+    uint32_t capacity;
+    uint32_t strings_capacity;
+
+    uint32_t *work;
+    uint32_t work_count;
+    uint32_t next;              /* atomic, next index in 'work' */
+} romdb_scan_t;
+
+void gbc_romdb_init(gbc_romdb_t *db)
+{
+    memset(db, 0, sizeof(gbc_romdb_t));
+}
+
+void gbc_romdb_free(gbc_romdb_t *db)
+{
+    free_memory(db->entries);
+    free_memory(db->strings);
+    gbc_romdb_init(db);
+}
+
+int gbc_romdb_load(gbc_romdb_t *db, const char *path)
+{
+    romdb_header_t header;
+
+    gbc_romdb_init(db);
+
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+        return -1;
+
+    if (fread(&header, sizeof(header), 1, fp) != 1 || header.magic != ROMDB_MAGIC ||
+        header.version != ROMDB_VERSION || header.entry_size != sizeof(gbc_romdb_entry_t)) {
+        LOG_ERROR("[ROMDB] %s is not a version %d index\n", path, ROMDB_VERSION);
+        fclose(fp);
+        return -1;
+    }
+
+    db->entries = malloc_memory((size_t)header.count * sizeof(gbc_romdb_entry_t) + 1);
+    db->strings = malloc_memory(header.strings_size + 1);
+    if (!db->entries || !db->strings ||
+        fread(db->entries, sizeof(gbc_romdb_entry_t), header.count, fp) != header.count ||
+        fread(db->strings, 1, header.strings_size, fp) != header.strings_size) {
+        LOG_ERROR("[ROMDB] %s is truncated\n", path);
+        fclose(fp);
+        gbc_romdb_free(db);
+        return -1;
+    }
+    fclose(fp);
+
+    db->count = header.count;
+    db->strings_size = header.strings_size;
+    db->strings[db->strings_size] = '\0';
+
+    for (uint32_t i = 0; i < db->count; i++) {
+        if (db->entries[i].path >= db->strings_size) {
+            LOG_ERROR("[ROMDB] %s has a bad path offset\n", path);
+            gbc_romdb_free(db);
+            return -1;
+        }
+    }
+
+    LOG_INFO("[ROMDB] loaded %u entries from %s\n", db->count, path);
+    return 0;
+}
+
+/* written to a temporary file and renamed, so a crash never leaves half an index */
+int gbc_romdb_save(gbc_romdb_t *db, const char *path)
+{
+    char tmp[ROMDB_PATH_MAX];
+    romdb_header_t header = {
+        .magic = ROMDB_MAGIC,
+        .version = ROMDB_VERSION,
+        .entry_size = sizeof(gbc_romdb_entry_t),
+        .count = db->count,
+        .strings_size = db->strings_size,
+    };
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *fp = fopen(tmp, "wb");
+    if (!fp) {
+        LOG_ERROR("[ROMDB] cannot write %s\n", tmp);
+        return -1;
+    }
+
+    int ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+        fwrite(db->entries, sizeof(gbc_romdb_entry_t), db->count, fp) == db->count &&
+        fwrite(db->strings, 1, db->strings_size, fp) == db->strings_size;
+
+    if (fclose(fp) || !ok || rename(tmp, path)) {
+        LOG_ERROR("[ROMDB] failed to write %s\n", path);
+        unlink(tmp);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int compare_entry_path(const void *key, const void *elem)
+{
+    const gbc_romdb_t *db = ((const gbc_romdb_t**)key)[0];
+    const char *path = ((const char**)key)[1];
+    return strcmp(path, db->strings + ((const gbc_romdb_entry_t*)elem)->path);
+}
+
+const gbc_romdb_entry_t* gbc_romdb_find(gbc_romdb_t *db, const char *path)
+{
+    const void *key[2] = { db, path };
+
+    if (!db->count)
+        return NULL;
+    return bsearch(key, db->entries, db->count, sizeof(gbc_romdb_entry_t), compare_entry_path);
+}
+
+const gbc_romdb_entry_t* gbc_romdb_find_hash(gbc_romdb_t *db, uint64_t hash)
+{
+    for (uint32_t i = 0; i < db->count; i++) {
+        if (db->entries[i].hash == hash && !(db->entries[i].status & ROMDB_UNREADABLE))
+            return db->entries + i;
+    }
+    return NULL;
+}
+
+static uint8_t is_rom_file(const char *name)
+{
+    const char *ext = strrchr(name, '.');
+    return ext && (!strcasecmp(ext, ".gb") || !strcasecmp(ext, ".gbc") || !strcasecmp(ext, ".sgb"));
+}
+
+/* realloc through the allocation wrappers, 'size' bytes of 'old' are kept */
+static void* grow(void *old, size_t size, size_t capacity)
+{
+    void *ptr = malloc_memory(capacity);
+    if (!ptr)
+        return NULL;
+    if (old)
+        memcpy(ptr, old, size);
+    free_memory(old);
+    return ptr;
+}
+
+static int add_string(gbc_romdb_t *db, romdb_scan_t *scan, const char *s, uint32_t *offset)
+{
+    size_t len = strlen(s) + 1;
+
+    if (db->strings_size + len > scan->strings_capacity) {
+        uint32_t capacity = scan->strings_capacity ? scan->strings_capacity * 2 : 4096;
+        while (capacity < db->strings_size + len)
+            capacity *= 2;
+        char *strings = grow(db->strings, db->strings_size, capacity);
+        if (!strings)
+            return -1;
+        db->strings = strings;
+        scan->strings_capacity = capacity;
+    }
+
+    memcpy(db->strings + db->strings_size, s, len);
+    *offset = db->strings_size;
+    db->strings_size += len;
+    return 0;
+}
+
+static gbc_romdb_entry_t* add_entry(gbc_romdb_t *db, romdb_scan_t *scan)
+{
+    if (db->count == scan->capacity) {
+        uint32_t capacity = scan->capacity ? scan->capacity * 2 : 256;
+        gbc_romdb_entry_t *entries = grow(db->entries, (size_t)db->count * sizeof(gbc_romdb_entry_t),
+            (size_t)capacity * sizeof(gbc_romdb_entry_t));
+        if (!entries)
+            return NULL;
+        db->entries = entries;
+        scan->capacity = capacity;
+    }
+
+    gbc_romdb_entry_t *entry = db->entries + db->count++;
+    memset(entry, 0, sizeof(gbc_romdb_entry_t));
+    return entry;
+}
+
+/* Collects every ROM under 'dir'. Entries whose size and mtime match the old index are
+ * copied over, the rest are queued for the workers. Symlinked ROMs are followed but
+ * symlinked directories are not, so a link loop cannot recurse forever. */
+static int collect(romdb_scan_t *scan, gbc_romdb_t *old, const char *dir)
+{
+    gbc_romdb_t *db = scan->db;
+    char path[ROMDB_PATH_MAX];
+    struct dirent *ent;
+    struct stat st;
+
+    DIR *d = opendir(dir);
+    if (!d) {
+        LOG_ERROR("[ROMDB] cannot open directory %s\n", dir);
+        return -1;
+    }
+
+    while ((ent = readdir(d))) {
+        if (ent->d_name[0] == '.')
+            continue;
+        if ((size_t)snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name) >= sizeof(path))
+            continue;
+        if (lstat(path, &st))
+            continue;
+        if (S_ISLNK(st.st_mode) && (stat(path, &st) || S_ISDIR(st.st_mode)))
+            continue;
+
+        if (S_ISDIR(st.st_mode)) {
+            collect(scan, old, path);
+            continue;
+        }
+        if (!S_ISREG(st.st_mode) || !is_rom_file(ent->d_name))
+            continue;
+
+        const gbc_romdb_entry_t *prev = gbc_romdb_find(old, path);
+        gbc_romdb_entry_t *entry = add_entry(db, scan);
+        uint32_t offset;
+        if (!entry || add_string(db, scan, path, &offset)) {
+            closedir(d);
+            return -1;
+        }
+
+        if (prev && prev->size == (uint64_t)st.st_size && prev->mtime == st.st_mtime &&
+            !(prev->status & ROMDB_UNREADABLE)) {
+            *entry = *prev;
+            db->reused++;
+        } else {
+            entry->size = st.st_size;
+            entry->mtime = st.st_mtime;
+            entry->status = ROMDB_UNREADABLE;
+        }
+        entry->path = offset;
+    }
+
+    closedir(d);
+    return 0;
+}
+
+static void analyse(gbc_romdb_entry_t *entry, const char *path)
+{
+    struct stat st;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return;
+
+    /* the file may have changed since it was listed */
+    if (fstat(fd, &st))
+        st.st_size = 0;
+    size_t size = entry->size = st.st_size;
+    entry->mtime = st.st_mtime;
+    if (size < CARTRIDGE_CODE_OFFSET) {
+        close(fd);
+        return;
+    }
+
+    uint8_t *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return;
+    madvise(data, size, MADV_SEQUENTIAL);
+
+    const cartridge_t *cart = (const cartridge_t*)(data + CARTRIDGE_HEADER_OFFSET);
+    uint8_t status = 0;
+
+    uint8_t header = 0;
+    for (int addr = CARTRIDGE_CHECKSUM_BEGIN; addr <= CARTRIDGE_CHECKSUM_END; addr++)
+        header = header - data[addr] - 1;
+    if (header == cart->header_checksum)
+        status |= ROMDB_HEADER_OK;
+
+    uint16_t global = 0;
+    for (size_t addr = 0; addr < size; addr++)
+        global += data[addr];
+    global -= data[ROMDB_GLOBAL_CHECKSUM_ADDR] + data[ROMDB_GLOBAL_CHECKSUM_ADDR + 1];
+    entry->global_checksum = (data[ROMDB_GLOBAL_CHECKSUM_ADDR] << 8) | data[ROMDB_GLOBAL_CHECKSUM_ADDR + 1];
+    if (global == entry->global_checksum)
+        status |= ROMDB_GLOBAL_OK;
+
+    if (cart->rom_size <= CARTRIDGE_MAX_ROM_SIZE_CODE && (size_t)cartridge_rom_size(cart) <= size)
+        status |= ROMDB_SIZE_OK;
+
+    memcpy(entry->title, cart->title, sizeof(entry->title));
+    entry->cartridge_type = cart->cartridge_type;
+    entry->rom_size = cart->rom_size;
+    entry->ram_size = cart->ram_size;
+    entry->cgb_flag = cart->cart_cgb_flag;
+    entry->sgb_flag = cart->sgb_flag;
+    entry->hash = gbc_rom_hash_data(data, size);
+    entry->status = status;
+
+    munmap(data, size);
+}
+
+static void* scan_worker(void *arg)
+{
+    romdb_scan_t *scan = (romdb_scan_t*)arg;
+    gbc_romdb_t *db = scan->db;
+    uint32_t i;
+
+    while ((i = __atomic_fetch_add(&scan->next, 1, __ATOMIC_RELAXED)) < scan->work_count) {
+        gbc_romdb_entry_t *entry = db->entries + scan->work[i];
+        analyse(entry, gbc_romdb_path(db, entry));
+    }
+
+    return NULL;
+}
+
+static int compare_path(const void *a, const void *b, void *strings)
+{
+    return strcmp((char*)strings + ((const gbc_romdb_entry_t*)a)->path,
+        (char*)strings + ((const gbc_romdb_entry_t*)b)->path);
+}
+
+/* Rebuilds 'db' from the files under 'dir'. Only new or changed files are read again. */
+int gbc_romdb_scan(gbc_romdb_t *db, const char *dir, int threads)
+{
+    pthread_t workers[ROMDB_MAX_THREADS];
+    gbc_romdb_t old = *db;
+    romdb_scan_t scan;
+    uint64_t start = get_time();
+
+    gbc_romdb_init(db);
+    memset(&scan, 0, sizeof(scan));
+    scan.db = db;
+
+    if (collect(&scan, &old, dir)) {
+        gbc_romdb_free(db);
+        *db = old;
+        return -1;
+    }
+    gbc_romdb_free(&old);
+
+    qsort_r(db->entries, db->count, sizeof(gbc_romdb_entry_t), compare_path, db->strings);
+
+    scan.work = malloc_memory((db->count + 1) * sizeof(uint32_t));
+    if (!scan.work)
+        return -1;
+    for (uint32_t i = 0; i < db->count; i++) {
+        if (db->entries[i].status & ROMDB_UNREADABLE)
+            scan.work[scan.work_count++] = i;
+    }
+
+    if (threads <= 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > ROMDB_MAX_THREADS)
+        threads = ROMDB_MAX_THREADS;
+    if ((uint32_t)threads > scan.work_count)
+        threads = scan.work_count;
+
+    /* the calling thread works too */
+    int started = 0;
+    for (; started < threads - 1; started++) {
+        if (pthread_create(&workers[started], NULL, scan_worker, &scan))
+            break;
+    }
+    scan_worker(&scan);
+    for (int i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+
+    db->scanned = scan.work_count;
+    db->scan_ns = get_time() - start;
+    free_memory(scan.work);
+
+    LOG_INFO("[ROMDB] %s: %u ROMs, %u scanned on %d threads, %u unchanged, %lu ms\n",
+        dir, db->count, db->scanned, started + 1, db->reused, (unsigned long)(db->scan_ns / 1000000));
+    return 0;
+}
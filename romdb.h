@@ -0,0 +1,58 @@
+#ifndef ROMDB_H
+#define ROMDB_H
+
+#include <stdint.h>
+#include "cartridge.h"
+
+#define ROMDB_MAGIC   0x42444d4f52434247ULL    /* "GBCROMDB" */
+#define ROMDB_VERSION 2
+
+#define ROMDB_MAX_THREADS 64
+
+/* gbc_romdb_entry_t.status */
+#define ROMDB_HEADER_OK  0x01   /* header checksum matches */
+#define ROMDB_GLOBAL_OK  0x02   /* global checksum matches, real carts often get it wrong */
+#define ROMDB_SIZE_OK    0x04   /* file holds the ROM size the header declares */
+#define ROMDB_UNREADABLE 0x80
+
+/* One ROM, fixed size so the index is loaded with a single read */
+typedef struct gbc_romdb_entry {
+    uint64_t hash;              /* gbc_rom_hash_data of the file, what gbc_rom_hash returns */
+    uint64_t size;
+    int64_t mtime;
+    uint32_t path;              /* offset in the string table */
+    uint16_t global_checksum;
+    uint8_t title[16];
+    uint8_t cartridge_type;
+    uint8_t rom_size;
+    uint8_t ram_size;
+    uint8_t cgb_flag;
+    uint8_t sgb_flag;
+    uint8_t status;             /* ROMDB_* */
+    uint8_t reserved[4];
+} gbc_romdb_entry_t;
+
+/* Entries are kept sorted by path */
+typedef struct gbc_romdb {
+    gbc_romdb_entry_t *entries;
+    uint32_t count;
+    char *strings;
+    uint32_t strings_size;
+
+    /* last scan */
+    uint32_t scanned;
+    uint32_t reused;
+    uint64_t scan_ns;
+} gbc_romdb_t;
+
+void gbc_romdb_init(gbc_romdb_t *db);
+void gbc_romdb_free(gbc_romdb_t *db);
+int gbc_romdb_load(gbc_romdb_t *db, const char *path);
+int gbc_romdb_save(gbc_romdb_t *db, const char *path);
+int gbc_romdb_scan(gbc_romdb_t *db, const char *dir, int threads);
+const gbc_romdb_entry_t* gbc_romdb_find(gbc_romdb_t *db, const char *path);
+const gbc_romdb_entry_t* gbc_romdb_find_hash(gbc_romdb_t *db, uint64_t hash);
+
+#define gbc_romdb_path(db, entry) ((db)->strings + (entry)->path)
+
+#endif
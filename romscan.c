@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "romdb.h"
+
+#define ROMSCAN_DEFAULT_INDEX "roms.idx"
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-j threads] [-o index] [-l] <rom directory>\n", prog);
+    fprintf(stderr, "  -j  worker threads, default one per cpu\n");
+    fprintf(stderr, "  -o  index file, default %s\n", ROMSCAN_DEFAULT_INDEX);
+    fprintf(stderr, "  -l  list every entry\n");
+}
+
+static void list(gbc_romdb_t *db)
+{
+    for (uint32_t i = 0; i < db->count; i++) {
+        const gbc_romdb_entry_t *e = db->entries + i;
+
+        if (e->status & ROMDB_UNREADABLE) {
+            printf("%-16s  unreadable  %s\n", "", gbc_romdb_path(db, e));
+            continue;
+        }
+        printf("%-16.16s  %016llx  type %02x rom %02x ram %02x %s%s  %s%s%s %s\n",
+            (const char*)e->title, (unsigned long long)e->hash,
+            e->cartridge_type, e->rom_size, e->ram_size,
+            (e->cgb_flag & CART_CGB_FLAG_CGB) ? "CGB" : "DMG", e->sgb_flag == 0x03 ? "+SGB" : "",
+            (e->status & ROMDB_HEADER_OK) ? "" : "bad-header ",
+            (e->status & ROMDB_GLOBAL_OK) ? "" : "bad-global ",
+            (e->status & ROMDB_SIZE_OK) ? "" : "bad-size ",
+            gbc_romdb_path(db, e));
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const char *index = ROMSCAN_DEFAULT_INDEX;
+    const char *dir = NULL;
+    int threads = 0;
+    int listing = 0;
+    gbc_romdb_t db;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-j") && i + 1 < argc)
+            threads = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-o") && i + 1 < argc)
+            index = argv[++i];
+        else if (!strcmp(argv[i], "-l"))
+            listing = 1;
+        else if (argv[i][0] != '-' && !dir)
+            dir = argv[i];
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!dir) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    /* a missing or stale index just means a full scan */
+    if (gbc_romdb_load(&db, index))
+        gbc_romdb_init(&db);
+
+    if (gbc_romdb_scan(&db, dir, threads) || gbc_romdb_save(&db, index)) {
+        gbc_romdb_free(&db);
+        return 1;
+    }
+
+    uint32_t bad = 0;
+    for (uint32_t i = 0; i < db.count; i++)
+        bad += (db.entries[i].status & (ROMDB_HEADER_OK | ROMDB_SIZE_OK)) != (ROMDB_HEADER_OK | ROMDB_SIZE_OK);
+
+    if (listing)
+        list(&db);
+    printf("%u ROMs, %u scanned, %u unchanged, %u invalid, %.1f ms\n",
+        db.count, db.scanned, db.reused, bad, db.scan_ns / 1e6);
+
+    gbc_romdb_free(&db);
+    return 0;
+}
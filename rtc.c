@@ -0,0 +1,257 @@
+#include <string.h>
+#include <time.h>
+#include "rtc.h"
+#include "common.h"
+
+#define TICKS_PER_SECOND    ((uint64_t)CLOCK_RATE)
+#define SECONDS_PER_DAY     86400
+#define RTC_WRAP            ((uint64_t)RTC_MAX_DAYS * SECONDS_PER_DAY * TICKS_PER_SECOND)
+
+#define RTC_TIMESTAMP_OFFSET 40
+#define RTC_NO_TIMESTAMP    UINT64_MAX  /* a fresh .sav is filled with 0xFF */
+
+static uint64_t host_ticks(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * TICKS_PER_SECOND + (uint64_t)ts.tv_nsec * TICKS_PER_SECOND / 1000000000ULL;
+}
+
+static uint64_t emulated_ticks(gbc_rtc_t *rtc)
+{
+    if (!rtc->cpu)
+        return rtc->emu_ticks;
+    return rtc->emu_ticks + ((rtc->cpu->cycles - rtc->emu_cycles) >> rtc->dspeed);
+}
+
+static uint64_t now(gbc_rtc_t *rtc)
+{
+    return rtc->clock == RTC_CLOCK_HOST ? host_ticks() : emulated_ticks(rtc);
+}
+
+/* Current counter in ticks; past 511 days it wraps and sets the carry */
+static uint64_t counter(gbc_rtc_t *rtc, uint64_t t)
+{
+    if (rtc->halt)
+        return rtc->stopped;
+
+    uint64_t c = t - rtc->base;
+    if (c >= RTC_WRAP) {
+        rtc->carry = 1;
+        c %= RTC_WRAP;
+        rtc->base = t - c;
+    }
+    return c;
+}
+
+static void set_counter(gbc_rtc_t *rtc, uint64_t t, uint64_t c)
+{
+    if (rtc->halt)
+        rtc->stopped = c;
+    else
+        rtc->base = t - c;
+}
+
+static void to_regs(gbc_rtc_t *rtc, uint64_t c, uint8_t *regs)
+{
+    uint64_t s = c / TICKS_PER_SECOND;
+    uint32_t days = s / SECONDS_PER_DAY;
+
+    regs[0] = s % 60;
+    regs[1] = (s / 60) % 60;
+    regs[2] = (s / 3600) % 24;
+    regs[3] = days & UINT8_MASK;
+    regs[4] = ((days >> 8) & RTC_DH_DAY_HIGH) | (rtc->halt ? RTC_DH_HALT : 0) | (rtc->carry ? RTC_DH_CARRY : 0);
+}
+
+static uint64_t from_regs(const uint8_t *regs)
+{
+    uint64_t days = regs[3] | ((regs[4] & RTC_DH_DAY_HIGH) << 8);
+    uint64_t s = regs[0] + regs[1] * 60 + regs[2] * 3600 + days * SECONDS_PER_DAY;
+    return s * TICKS_PER_SECOND;
+}
+
+void gbc_rtc_init(gbc_rtc_t *rtc, uint8_t clock)
+{
+    memset(rtc, 0, sizeof(gbc_rtc_t));
+    rtc->present = 1;
+    rtc->clock = clock;
+    rtc->latch = 0xFF;
+    rtc->base = now(rtc);
+}
+
+void gbc_rtc_connect(gbc_rtc_t *rtc, gbc_cpu_t *cpu)
+{
+    uint64_t t = now(rtc);
+    uint64_t c = counter(rtc, t);
+
+    rtc->cpu = cpu;
+    rtc->emu_cycles = cpu->cycles;
+    rtc->dspeed = cpu->dspeed;
+    set_counter(rtc, now(rtc), c);
+}
+
+/* Before the cpu's cycle counter is replaced (gbc_reset): the emulated clock holds its
+ * reading until gbc_rtc_connect picks up the new counter */
+void gbc_rtc_disconnect(gbc_rtc_t *rtc)
+{
+    rtc->emu_ticks = emulated_ticks(rtc);
+    rtc->cpu = NULL;
+}
+
+/* Fast-forward and deterministic runs follow emulated time; the counter carries over */
+void gbc_rtc_set_clock(gbc_rtc_t *rtc, uint8_t clock)
+{
+    if (rtc->clock == clock)
+        return;
+
+    uint64_t c = counter(rtc, now(rtc));
+    rtc->clock = clock;
+    set_counter(rtc, now(rtc), c);
+}
+
+/* Called after cpu->dspeed changes */
+void gbc_rtc_speed_switch(gbc_rtc_t *rtc)
+{
+    rtc->emu_ticks = emulated_ticks(rtc);
+    rtc->emu_cycles = rtc->cpu->cycles;
+    rtc->dspeed = rtc->cpu->dspeed;
+}
+
+/* Writing 0 then 1 copies the counter into the readable registers */
+void gbc_rtc_latch(gbc_rtc_t *rtc, uint8_t data)
+{
+    if (rtc->latch == 0 && data == 1) {
+        to_regs(rtc, counter(rtc, now(rtc)), rtc->latched);
+        gbc_rtc_save(rtc);
+    }
+    rtc->latch = data;
+}
+
+uint8_t gbc_rtc_read(gbc_rtc_t *rtc, uint8_t reg)
+{
+    return rtc->latched[reg - RTC_REG_S];
+}
+
+void gbc_rtc_write(gbc_rtc_t *rtc, uint8_t reg, uint8_t data)
+{
+    uint64_t t = now(rtc);
+    uint64_t c = counter(rtc, t);
+    uint64_t sub = c % TICKS_PER_SECOND;
+    uint8_t regs[RTC_REGS];
+
+    to_regs(rtc, c, regs);
+
+    switch (reg) {
+    case RTC_REG_S:
+        regs[0] = data & 0x3F;
+        sub = 0;    /* writing seconds resets the sub-second divider */
+        break;
+    case RTC_REG_M:
+        regs[1] = data & 0x3F;
+        break;
+    case RTC_REG_H:
+        regs[2] = data & 0x1F;
+        break;
+    case RTC_REG_DL:
+        regs[3] = data;
+        break;
+    case RTC_REG_DH:
+        regs[4] = data & RTC_DH_MASK;
+        rtc->carry = (data & RTC_DH_CARRY) != 0;
+        break;
+    }
+
+    c = from_regs(regs) + sub;
+
+    if (reg == RTC_REG_DH && rtc->halt != ((data & RTC_DH_HALT) != 0)) {
+        rtc->halt = (data & RTC_DH_HALT) != 0;
+        if (rtc->halt)
+            rtc->stopped = c;
+        else
+            rtc->base = t - c;
+    } else {
+        set_counter(rtc, t, c);
+    }
+
+    /* the latched copy shows the write, as on hardware */
+    rtc->latched[reg - RTC_REG_S] = regs[reg - RTC_REG_S];
+    gbc_rtc_save(rtc);
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+    for (int i = 0; i < 4; i++)
+        p[i] = v >> (i * 8);
+}
+
+static uint64_t get(const uint8_t *p, int bytes)
+{
+    uint64_t v = 0;
+    for (int i = bytes - 1; i >= 0; i--)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+/* The footer lives in the mapped .sav at 'offset'. Host clock time passes while the
+ * emulator is not running; emulated time does not. */
+void gbc_rtc_load(gbc_rtc_t *rtc, gbc_battery_t *bat, uint32_t offset)
+{
+    uint8_t regs[RTC_REGS];
+
+    rtc->battery = bat;
+    rtc->save = bat->data + offset;
+    rtc->save_offset = offset;
+
+    uint64_t timestamp = get(rtc->save + RTC_TIMESTAMP_OFFSET, 8);
+    if (timestamp == RTC_NO_TIMESTAMP) {
+        gbc_rtc_save(rtc);
+        return;
+    }
+
+    for (int i = 0; i < RTC_REGS; i++) {
+        regs[i] = get(rtc->save + i * 4, 4);
+        rtc->latched[i] = get(rtc->save + (RTC_REGS + i) * 4, 4);
+    }
+
+    rtc->halt = (regs[4] & RTC_DH_HALT) != 0;
+    rtc->carry = (regs[4] & RTC_DH_CARRY) != 0;
+
+    uint64_t t = now(rtc);
+    uint64_t c = from_regs(regs);
+    int64_t elapsed = (int64_t)(time(NULL) - (time_t)timestamp);
+    if (rtc->clock == RTC_CLOCK_HOST && !rtc->halt && elapsed > 0)
+        c += (uint64_t)elapsed * TICKS_PER_SECOND;
+
+    if (c >= RTC_WRAP) {
+        rtc->carry = 1;
+        c %= RTC_WRAP;
+    }
+    set_counter(rtc, t, c);
+
+    LOG_INFO("[RTC] loaded %u days %02u:%02u:%02u, %s clock\n",
+        regs[3] | ((regs[4] & RTC_DH_DAY_HIGH) << 8), regs[2], regs[1], regs[0],
+        rtc->clock == RTC_CLOCK_HOST ? "host" : "emulated");
+}
+
+void gbc_rtc_save(gbc_rtc_t *rtc)
+{
+    uint8_t regs[RTC_REGS];
+
+    if (!rtc->save)
+        return;
+
+    to_regs(rtc, counter(rtc, now(rtc)), regs);
+
+    for (int i = 0; i < RTC_REGS; i++) {
+        put32(rtc->save + i * 4, regs[i]);
+        put32(rtc->save + (RTC_REGS + i) * 4, rtc->latched[i]);
+    }
+
+    uint64_t timestamp = time(NULL);
+    put32(rtc->save + RTC_TIMESTAMP_OFFSET, timestamp);
+    put32(rtc->save + RTC_TIMESTAMP_OFFSET + 4, timestamp >> 32);
+
+    gbc_battery_mark(rtc->battery, rtc->save_offset);
+    gbc_battery_mark(rtc->battery, rtc->save_offset + RTC_SAVE_SIZE - 1);
+}
@@ -0,0 +1,67 @@
+#ifndef RTC_H
+#define RTC_H
+
+#include <stdint.h>
+#include "cpu.h"
+#include "battery.h"
+
+/* https://gbdev.io/pandocs/MBC3.html#the-clock-counter-registers */
+#define RTC_REG_S   0x08
+#define RTC_REG_M   0x09
+#define RTC_REG_H   0x0A
+#define RTC_REG_DL  0x0B
+#define RTC_REG_DH  0x0C
+#define RTC_REGS    5
+
+#define RTC_DH_DAY_HIGH 0x01
+#define RTC_DH_HALT     0x40
+#define RTC_DH_CARRY    0x80
+#define RTC_DH_MASK     (RTC_DH_DAY_HIGH | RTC_DH_HALT | RTC_DH_CARRY)
+
+#define RTC_MAX_DAYS    512
+
+#define RTC_CLOCK_EMULATED 0    /* seconds of emulated time, from cpu->cycles */
+#define RTC_CLOCK_HOST     1    /* wall clock time */
+
+/* S, M, H, DL, DH and latched S..DH as 32-bit words, then a 64-bit unix timestamp,
+ * all little endian, after the cartridge RAM in the .sav (the usual 48-byte footer) */
+#define RTC_SAVE_SIZE 48
+
+#define IS_RTC_REG(bank) ((bank) >= RTC_REG_S && (bank) <= RTC_REG_DH)
+
+/* The counter is never ticked: it is 'now - base' in 1/CLOCK_RATE s ticks and only broken
+ * into registers when the latch register is written or a register is accessed. */
+typedef struct gbc_rtc {
+    uint8_t present;
+    uint8_t clock;              /* RTC_CLOCK_* */
+    uint8_t latch;              /* last value written to 0x6000-0x7FFF */
+    uint8_t latched[RTC_REGS];
+    uint8_t halt;
+    uint8_t carry;
+
+    uint64_t base;              /* clock reading at counter zero, while running */
+    uint64_t stopped;           /* counter while halted */
+
+    /* emulated clock, rebased on speed switches so double speed does not run it fast */
+    gbc_cpu_t *cpu;
+    uint64_t emu_cycles;
+    uint64_t emu_ticks;
+    uint8_t dspeed;
+
+    uint8_t *save;              /* footer in the mapped .sav, NULL without one */
+    uint32_t save_offset;
+    gbc_battery_t *battery;
+} gbc_rtc_t;
+
+void gbc_rtc_init(gbc_rtc_t *rtc, uint8_t clock);
+void gbc_rtc_connect(gbc_rtc_t *rtc, gbc_cpu_t *cpu);
+void gbc_rtc_disconnect(gbc_rtc_t *rtc);
+void gbc_rtc_set_clock(gbc_rtc_t *rtc, uint8_t clock);
+void gbc_rtc_speed_switch(gbc_rtc_t *rtc);
+void gbc_rtc_latch(gbc_rtc_t *rtc, uint8_t data);
+uint8_t gbc_rtc_read(gbc_rtc_t *rtc, uint8_t reg);
+void gbc_rtc_write(gbc_rtc_t *rtc, uint8_t reg, uint8_t data);
+void gbc_rtc_load(gbc_rtc_t *rtc, gbc_battery_t *bat, uint32_t offset);
+void gbc_rtc_save(gbc_rtc_t *rtc);
+
+#endif
@@ -0,0 +1,115 @@
+#include <string.h>
+#include "runahead.h"
+#include "common.h"
+#include "utils.h"
+
+int gbc_runahead_init(gbc_runahead_t *ra, gbc_t *gbc, uint32_t frames)
+{
+    memset(ra, 0, sizeof(gbc_runahead_t));
+    ra->gbc = gbc;
+    gbc_get_components(gbc, &ra->components);
+
+    ra->state_size = gbc_state_size(&ra->components);
+    ra->state = malloc_memory(ra->state_size);
+    if (!ra->state) {
+        LOG_ERROR("[RUNAHEAD] cannot allocate a %zu byte snapshot\n", ra->state_size);
+        return -1;
+    }
+
+    /* from here on every snapshot is an incremental update */
+    gbc_state_save(&ra->components, ra->state, ra->state_size);
+    return gbc_runahead_set_frames(ra, frames);
+}
+
+void gbc_runahead_cleanup(gbc_runahead_t *ra)
+{
+    free_memory(ra->state);
+    ra->state = NULL;
+}
+
+int gbc_runahead_set_frames(gbc_runahead_t *ra, uint32_t frames)
+{
+    if (frames > RUNAHEAD_MAX_FRAMES) {
+        LOG_ERROR("[RUNAHEAD] at most %d frames ahead\n", RUNAHEAD_MAX_FRAMES);
+        return -1;
+    }
+
+    ra->frames = frames;
+    return 0;
+}
+
+/* One host frame with 'buttons' (KEY_* bits) held */
+void gbc_runahead_frame(gbc_runahead_t *ra, uint8_t buttons)
+{
+    gbc_t *gbc = ra->gbc;
+    gbc_graphic_t *graphic = &gbc->graphic;
+
+    io_set_buttons(&gbc->io, buttons);
+    ra->host_frames++;
+
+    if (!ra->frames) {
+        uint64_t start = get_time();
+        gbc_run_frame(gbc);
+        ra->real_ns += get_time() - start;
+        return;
+    }
+
+    /* the real frame is never shown, only the last speculative one */
+    screen_write write = graphic->screen_write;
+    gbc_obs_t *obs = graphic->obs;
+    graphic->screen_write = NULL;
+    graphic->obs = NULL;
+
+    uint64_t t0 = get_time();
+    gbc_run_frame(gbc);
+    uint64_t t1 = get_time();
+    gbc_state_update(&ra->components, ra->state, ra->state_size);
+    uint64_t t2 = get_time();
+
+    if (gbc->audio_log)
+        gbc_audio_log_speculate(gbc->audio_log, 1);
+    for (uint32_t k = 0; k < ra->frames; k++) {
+        if (k == ra->frames - 1) {
+            graphic->screen_write = write;
+            graphic->obs = obs;
+        }
+        gbc_run_frame(gbc);
+    }
+    uint64_t t3 = get_time();
+
+    gbc_state_restore(&ra->components, ra->state, ra->state_size);
+    if (gbc->audio_log)
+        gbc_audio_log_speculate(gbc->audio_log, 0);
+    gbc->frames -= ra->frames;
+    uint64_t t4 = get_time();
+
+    ra->real_ns += t1 - t0;
+    ra->save_ns += t2 - t1;
+    ra->ahead_ns += t3 - t2;
+    ra->restore_ns += t4 - t3;
+}
+
+/* Host frame cost relative to emulating the real frame alone */
+double gbc_runahead_overhead(gbc_runahead_t *ra)
+{
+    if (!ra->real_ns)
+        return 0.0;
+    return (double)(ra->real_ns + ra->save_ns + ra->ahead_ns + ra->restore_ns) / ra->real_ns;
+}
+
+/* Input shows up this much earlier on screen, as long as the game's own lag is at least
+ * 'frames' frames; beyond that it would skip past the first frames of the response. */
+double gbc_runahead_latency_ms(gbc_runahead_t *ra)
+{
+    return ra->frames * 1000.0 / FRAME_RATE;
+}
+
+void gbc_runahead_report(gbc_runahead_t *ra)
+{
+    uint64_t n = ra->host_frames ? ra->host_frames : 1;
+
+    LOG_INFO("[RUNAHEAD] %u frames ahead, %.1f ms less latency, %.2fx cost per host frame "
+        "(real %.1f us, save %.1f us, ahead %.1f us, restore %.1f us)\n",
+        ra->frames, gbc_runahead_latency_ms(ra), gbc_runahead_overhead(ra),
+        ra->real_ns / 1e3 / n, ra->save_ns / 1e3 / n, ra->ahead_ns / 1e3 / n, ra->restore_ns / 1e3 / n);
+}
@@ -0,0 +1,40 @@
+#ifndef RUNAHEAD_H
+#define RUNAHEAD_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "gbc.h"
+
+#define RUNAHEAD_MAX_FRAMES 8
+
+/* Hides the game's own input lag. Every host frame runs the real frame with the new input,
+ * snapshots, runs 'frames' more with the same input, presents the last of them and goes
+ * back to the snapshot. Only the real frame is heard (gbc->audio_log) and only the last
+ * one is drawn.
+ * The snapshot buffer is allocated once and refreshed incrementally, and the restore only
+ * copies back the pages the speculative frames wrote. */
+typedef struct gbc_runahead {
+    gbc_t *gbc;
+    uint32_t frames;                    /* 0 runs plain frames */
+    gbc_state_components_t components;
+
+    uint8_t *state;
+    size_t state_size;
+
+    /* statistics */
+    uint64_t host_frames;
+    uint64_t real_ns;                   /* the frame that counts */
+    uint64_t save_ns;
+    uint64_t ahead_ns;
+    uint64_t restore_ns;
+} gbc_runahead_t;
+
+int gbc_runahead_init(gbc_runahead_t *ra, gbc_t *gbc, uint32_t frames);
+void gbc_runahead_cleanup(gbc_runahead_t *ra);
+int gbc_runahead_set_frames(gbc_runahead_t *ra, uint32_t frames);
+void gbc_runahead_frame(gbc_runahead_t *ra, uint8_t buttons);
+double gbc_runahead_overhead(gbc_runahead_t *ra);
+double gbc_runahead_latency_ms(gbc_runahead_t *ra);
+void gbc_runahead_report(gbc_runahead_t *ra);
+
+#endif
@@ -0,0 +1,295 @@
+#define _GNU_SOURCE    /* pthread_setaffinity_np */
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "runner.h"
+#include "common.h"
+#include "utils.h"
+
+#define JOB_NONE    0
+#define JOB_CREATE  1
+#define JOB_STEP    2
+#define JOB_EXIT    3
+
+#define RANGE(next, end)    ((uint64_t)(next) | ((uint64_t)(end) << 32))
+#define RANGE_NEXT(range)   ((uint32_t)(range))
+#define RANGE_END(range)    ((uint32_t)((range) >> 32))
+
+static void observe_wram(gbc_t *gbc, uint8_t *obs)
+{
+    gbc_cow_copy_out(&gbc->mem.wram_cow, gbc->mem.wram, obs, WRAM_BANK_SIZE);
+}
+
+/* Owner side: take the next index of our own range */
+static int pop(gbc_runner_worker_t *w, uint32_t *index)
+{
+    uint64_t range = __atomic_load_n(&w->range, __ATOMIC_ACQUIRE);
+
+    for (;;) {
+        uint32_t next = RANGE_NEXT(range), end = RANGE_END(range);
+        if (next >= end)
+            return 0;
+        if (__atomic_compare_exchange_n(&w->range, &range, RANGE(next + 1, end), 1,
+            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            *index = next;
+            return 1;
+        }
+    }
+}
+
+/* Thief side: move the back half of a victim's range into ours */
+static int steal(gbc_runner_worker_t *w)
+{
+    gbc_runner_t *runner = w->runner;
+
+    for (int k = 1; k < runner->worker_count; k++) {
+        gbc_runner_worker_t *victim = runner->workers + (w->id + k) % runner->worker_count;
+        uint64_t range = __atomic_load_n(&victim->range, __ATOMIC_ACQUIRE);
+
+        for (;;) {
+            uint32_t next = RANGE_NEXT(range), end = RANGE_END(range);
+            if (next >= end)
+                break;
+
+            uint32_t mid = next + (end - next) / 2;
+            if (__atomic_compare_exchange_n(&victim->range, &range, RANGE(next, mid), 1,
+                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                __atomic_store_n(&w->range, RANGE(mid, end), __ATOMIC_RELEASE);
+                w->steals++;
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static void run_item(gbc_runner_worker_t *w, uint8_t job, uint32_t i)
+{
+    gbc_runner_t *runner = w->runner;
+    gbc_t *gbc;
+
+    switch (job) {
+    case JOB_CREATE:
+        /* created on the worker, so its pages are first touched on this cpu's node */
+        runner->instances[i] = gbc_create(runner->config);
+        if (!runner->instances[i])
+            __atomic_fetch_add(&runner->failed, 1, __ATOMIC_RELAXED);
+        else
+            memset(runner->observations + i * runner->obs_size, 0, runner->obs_size);
+        break;
+    case JOB_STEP:
+        gbc = runner->instances[i];
+        io_set_buttons(&gbc->io, runner->inputs[i]);
+        for (uint32_t f = 0; f < runner->quantum; f++)
+            gbc_run_frame(gbc);
+        runner->observe(gbc, runner->observations + i * runner->obs_size);
+        w->steps++;
+        break;
+    default:
+        break;
+    }
+}
+
+/* Every worker checks in when it runs out, so none is still stealing once dispatch
+ * returns and hands out the next job's ranges */
+static void run_job(gbc_runner_worker_t *w, uint8_t job)
+{
+    gbc_runner_t *runner = w->runner;
+    uint32_t i;
+
+    for (;;) {
+        while (pop(w, &i))
+            run_item(w, job, i);
+        if (!steal(w))
+            break;
+    }
+
+    if (__atomic_sub_fetch(&runner->remaining, 1, __ATOMIC_ACQ_REL) == 0) {
+        pthread_mutex_lock(&runner->lock);
+        pthread_cond_signal(&runner->done);
+        pthread_mutex_unlock(&runner->lock);
+    }
+}
+
+static void* runner_worker(void *arg)
+{
+    gbc_runner_worker_t *w = (gbc_runner_worker_t*)arg;
+    gbc_runner_t *runner = w->runner;
+    uint64_t seen = 0;
+
+    if (runner->flags & RUNNER_AFFINITY) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(w->id % sysconf(_SC_NPROCESSORS_ONLN), &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&runner->lock);
+        while (runner->generation == seen)
+            pthread_cond_wait(&runner->start, &runner->lock);
+        seen = runner->generation;
+        uint8_t job = runner->job;
+        pthread_mutex_unlock(&runner->lock);
+
+        if (job == JOB_EXIT)
+            break;
+        run_job(w, job);
+    }
+
+    return NULL;
+}
+
+/* Splits the instances evenly, wakes the workers and waits for all of them. Jobs that
+ * are not per instance hand out empty ranges, so nothing is left over to run. */
+static void dispatch(gbc_runner_t *runner, uint8_t job)
+{
+    uint32_t count = (job == JOB_CREATE || job == JOB_STEP) ? runner->count : 0;
+    uint32_t per = count / runner->worker_count;
+    uint32_t extra = count % runner->worker_count;
+    uint32_t begin = 0;
+
+    for (int w = 0; w < runner->worker_count; w++) {
+        uint32_t n = per + ((uint32_t)w < extra);
+        __atomic_store_n(&runner->workers[w].range, RANGE(begin, begin + n), __ATOMIC_RELAXED);
+        begin += n;
+    }
+
+    pthread_mutex_lock(&runner->lock);
+    runner->job = job;
+    __atomic_store_n(&runner->remaining, job == JOB_EXIT ? 0 : runner->worker_count, __ATOMIC_RELEASE);
+    runner->generation++;
+    pthread_cond_broadcast(&runner->start);
+
+    while (__atomic_load_n(&runner->remaining, __ATOMIC_ACQUIRE))
+        pthread_cond_wait(&runner->done, &runner->lock);
+    pthread_mutex_unlock(&runner->lock);
+}
+
+gbc_runner_t* gbc_runner_create(const gbc_config_t *config, uint32_t count, const gbc_runner_options_t *options)
+{
+    gbc_runner_options_t defaults = { 0 };
+    if (!options)
+        options = &defaults;
+
+    gbc_runner_t *runner = malloc_memory(sizeof(gbc_runner_t));
+    if (!runner)
+        return NULL;
+    memset(runner, 0, sizeof(gbc_runner_t));
+
+    int threads = options->threads > 0 ? options->threads : sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > RUNNER_MAX_WORKERS)
+        threads = RUNNER_MAX_WORKERS;
+
+    runner->count = count;
+    runner->flags = options->flags;
+    runner->quantum = options->quantum ? options->quantum : RUNNER_DEFAULT_QUANTUM;
+    runner->observe = options->observe ? options->observe : observe_wram;
+    runner->obs_size = options->observe ? options->obs_size : WRAM_BANK_SIZE;
+
+    runner->instances = malloc_memory(count * sizeof(gbc_t*));
+    runner->inputs = malloc_memory(count);
+    runner->observations = malloc_memory(count * runner->obs_size);
+    runner->workers = aligned_alloc(64, threads * sizeof(gbc_runner_worker_t));
+    if (!runner->instances || !runner->inputs || !runner->observations || !runner->workers) {
+        LOG_ERROR("[RUNNER] cannot allocate %u instances\n", count);
+        free_memory(runner->instances);
+        free_memory(runner->inputs);
+        free_memory(runner->observations);
+        free_memory(runner->workers);
+        free_memory(runner);
+        return NULL;
+    }
+    memset(runner->instances, 0, count * sizeof(gbc_t*));
+    memset(runner->inputs, 0, count);
+    memset(runner->workers, 0, threads * sizeof(gbc_runner_worker_t));
+
+    pthread_mutex_init(&runner->lock, NULL);
+    pthread_cond_init(&runner->start, NULL);
+    pthread_cond_init(&runner->done, NULL);
+
+    for (int i = 0; i < threads; i++) {
+        runner->workers[i].runner = runner;
+        runner->workers[i].id = i;
+        if (pthread_create(&runner->workers[i].thread, NULL, runner_worker, runner->workers + i))
+            break;
+        runner->worker_count++;
+    }
+
+    runner->config = config;
+    if (runner->worker_count)
+        dispatch(runner, JOB_CREATE);
+    runner->config = NULL;
+
+    if (!runner->worker_count || runner->failed) {
+        LOG_ERROR("[RUNNER] %d of %u instances failed to start\n", runner->failed, count);
+        gbc_runner_destroy(runner);
+        return NULL;
+    }
+
+    LOG_INFO("[RUNNER] %u instances on %d workers%s, %u frames per step\n", count,
+        runner->worker_count, (runner->flags & RUNNER_AFFINITY) ? " pinned" : "", runner->quantum);
+    return runner;
+}
+
+void gbc_runner_destroy(gbc_runner_t *runner)
+{
+    if (runner->worker_count)
+        dispatch(runner, JOB_EXIT);
+    for (int i = 0; i < runner->worker_count; i++)
+        pthread_join(runner->workers[i].thread, NULL);
+
+    for (uint32_t i = 0; i < runner->count; i++)
+        gbc_destroy(runner->instances[i]);
+
+    pthread_mutex_destroy(&runner->lock);
+    pthread_cond_destroy(&runner->start);
+    pthread_cond_destroy(&runner->done);
+
+    free_memory(runner->instances);
+    free_memory(runner->inputs);
+    free_memory(runner->observations);
+    free_memory(runner->workers);
+    free_memory(runner);
+}
+
+/* One input byte per instance, applied at the start of the next step */
+void gbc_runner_set_inputs(gbc_runner_t *runner, const uint8_t *inputs)
+{
+    memcpy(runner->inputs, inputs, runner->count);
+}
+
+/* Runs every instance for 'quantum' frames and refreshes the observations */
+void gbc_runner_step(gbc_runner_t *runner)
+{
+    uint64_t start = get_time();
+
+    dispatch(runner, JOB_STEP);
+
+    runner->step_ns += get_time() - start;
+    runner->frames += (uint64_t)runner->count * runner->quantum;
+}
+
+const uint8_t* gbc_runner_observations(gbc_runner_t *runner)
+{
+    return runner->observations;
+}
+
+/* emulated frames per second of wall time, all instances together */
+double gbc_runner_fps(gbc_runner_t *runner)
+{
+    return runner->step_ns ? runner->frames * 1e9 / runner->step_ns : 0.0;
+}
+
+void gbc_runner_report(gbc_runner_t *runner)
+{
+    uint64_t steals = 0;
+    for (int i = 0; i < runner->worker_count; i++)
+        steals += runner->workers[i].steals;
+
+    LOG_INFO("[RUNNER] %lu frames in %.2f s, %.0f frames/s (%.1fx real time per instance), %lu steals\n",
+        (unsigned long)runner->frames, runner->step_ns / 1e9, gbc_runner_fps(runner),
+        gbc_runner_fps(runner) / FRAME_RATE / runner->count, (unsigned long)steals);
+}
@@ -0,0 +1,71 @@
+#ifndef RUNNER_H
+#define RUNNER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "gbc.h"
+
+#define RUNNER_MAX_WORKERS 256
+#define RUNNER_DEFAULT_QUANTUM 1            /* frames per step */
+
+#define RUNNER_AFFINITY 0x01                /* pin worker i to cpu i */
+
+/* Writes 'obs_size' bytes describing an instance after a step */
+typedef void (*gbc_observe_func)(gbc_t *gbc, uint8_t *obs);
+
+typedef struct gbc_runner_options {
+    int threads;                            /* 0: one per online cpu */
+    uint32_t flags;                         /* RUNNER_* */
+    uint32_t quantum;
+    size_t obs_size;
+    gbc_observe_func observe;               /* NULL: WRAM bank 0 */
+} gbc_runner_options_t;
+
+/* A worker owns a range of instance indices, packed as next | end << 32 in one atomic
+ * word. It pops from the front; idle workers steal the back half of someone else's. */
+typedef struct gbc_runner_worker {
+    struct gbc_runner *runner;
+    pthread_t thread;
+    int id;
+    uint64_t range;
+    uint64_t steps;
+    uint64_t steals;
+} __attribute__((aligned(64))) gbc_runner_worker_t;
+
+typedef struct gbc_runner {
+    gbc_t **instances;
+    uint32_t count;
+    const gbc_config_t *config;             /* only during creation */
+
+    gbc_runner_worker_t *workers;
+    int worker_count;
+    uint32_t flags;
+    uint32_t quantum;
+
+    uint8_t *inputs;                        /* one io_set_buttons mask per instance */
+    uint8_t *observations;                  /* obs_size bytes per instance */
+    size_t obs_size;
+    gbc_observe_func observe;
+
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    uint64_t generation;
+    uint8_t job;
+    uint32_t remaining;                     /* workers still in the current job, atomic */
+    int failed;                             /* instances that could not be created */
+
+    uint64_t frames;
+    uint64_t step_ns;
+} gbc_runner_t;
+
+gbc_runner_t* gbc_runner_create(const gbc_config_t *config, uint32_t count, const gbc_runner_options_t *options);
+void gbc_runner_destroy(gbc_runner_t *runner);
+void gbc_runner_set_inputs(gbc_runner_t *runner, const uint8_t *inputs);
+void gbc_runner_step(gbc_runner_t *runner);
+const uint8_t* gbc_runner_observations(gbc_runner_t *runner);
+double gbc_runner_fps(gbc_runner_t *runner);
+void gbc_runner_report(gbc_runner_t *runner);
+
+#endif
@@ -0,0 +1,95 @@
+#include <string.h>
+#include "scheduler.h"
+#include "common.h"
+
+#define INTERRUPT_MASK 0x1F
+
+void gbc_scheduler_init(gbc_scheduler_t *sched)
+{
+    memset(sched, 0, sizeof(gbc_scheduler_t));
+    sched->frame_end = SCHEDULER_NO_EVENT;
+}
+
+void gbc_scheduler_connect(gbc_scheduler_t *sched, gbc_cpu_t *cpu, gbc_graphic_t *graphic, gbc_timer_t *timer)
+{
+    sched->cpu = cpu;
+    sched->graphic = graphic;
+    sched->timer = timer;
+}
+
+void gbc_scheduler_begin_frame(gbc_scheduler_t *sched, uint64_t cycles)
+{
+    sched->frame_start = sched->cpu->cycles;
+    sched->frame_end = sched->frame_start + cycles;
+    sched->frame_skipped = 0;
+}
+
+void gbc_scheduler_end_frame(gbc_scheduler_t *sched)
+{
+    uint64_t cycles = sched->cpu->cycles - sched->frame_start;
+
+    sched->total_cycles += cycles;
+    sched->total_skipped += sched->frame_skipped;
+    sched->skip_ratio = cycles ? (float)sched->frame_skipped / cycles : 0;
+}
+
+/* Earliest cycle at which anything outside the cpu can change state: a PPU mode change
+ * (VBlank/STAT and LY), a TIMA overflow, or the end of the frame (joypad). The serial
+ * port is not clocked internally, so it never fires on its own. */
+uint64_t gbc_scheduler_next_event(gbc_scheduler_t *sched)
+{
+    gbc_cpu_t *cpu = sched->cpu;
+    gbc_graphic_t *graphic = sched->graphic;
+    uint64_t next = sched->frame_end;
+
+    if (IO_PORT_READ(graphic->mem, IO_PORT_LCDC) & LCDC_PPU_ENABLE) {
+        uint64_t ppu = cpu->cycles + ((uint64_t)graphic->dots << cpu->dspeed);
+        if (ppu < next)
+            next = ppu;
+    }
+
+    if (sched->timer->next_event < next)
+        next = sched->timer->next_event;
+
+    return next;
+}
+
+/* Move the clock forward while the cpu does nothing; the PPU counts down its dots
+ * and the timer is derived from the cycle counter. */
+void gbc_scheduler_advance(gbc_scheduler_t *sched, uint64_t cycles)
+{
+    gbc_cpu_t *cpu = sched->cpu;
+    gbc_graphic_t *graphic = sched->graphic;
+
+    cpu->cycles += cycles;
+    if (IO_PORT_READ(graphic->mem, IO_PORT_LCDC) & LCDC_PPU_ENABLE)
+        graphic->dots -= cycles >> cpu->dspeed;
+
+    sched->frame_skipped += cycles;
+}
+
+/* Called by the main loop while the cpu is halted. Skips to one cycle before the next
+ * event, which then fires in the normal per-cycle path. Returns the cycles skipped. */
+uint64_t gbc_scheduler_skip_halt(gbc_scheduler_t *sched)
+{
+    gbc_cpu_t *cpu = sched->cpu;
+
+    if (!cpu->halt)
+        return 0;
+
+    /* an enabled interrupt is already pending, the cpu wakes up now */
+    if (cpu->ier & *cpu->ifp & INTERRUPT_MASK)
+        return 0;
+
+    uint64_t next = gbc_scheduler_next_event(sched);
+    if (next == SCHEDULER_NO_EVENT || next <= cpu->cycles + 1)
+        return 0;
+
+    /* keep whole PPU dots in double speed */
+    uint64_t skip = (next - cpu->cycles - 1) & ~(uint64_t)cpu->dspeed;
+    if (!skip)
+        return 0;
+
+    gbc_scheduler_advance(sched, skip);
+    return skip;
+}
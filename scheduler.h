@@ -0,0 +1,34 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdint.h>
+#include "cpu.h"
+#include "graphics.h"
+#include "timers.h"
+
+#define SCHEDULER_NO_EVENT UINT64_MAX
+
+/* Knows when the next interrupt source can fire so idle cpu time can be skipped in bulk */
+typedef struct gbc_scheduler {
+    gbc_cpu_t *cpu;
+    gbc_graphic_t *graphic;
+    gbc_timer_t *timer;
+
+    uint64_t frame_start;
+    uint64_t frame_end;         /* joypad input only changes between host frames */
+
+    uint64_t frame_skipped;     /* cycles skipped in the current frame */
+    uint64_t total_cycles;
+    uint64_t total_skipped;
+    float skip_ratio;           /* fraction of the last frame that was skipped */
+} gbc_scheduler_t;
+
+void gbc_scheduler_init(gbc_scheduler_t *sched);
+void gbc_scheduler_connect(gbc_scheduler_t *sched, gbc_cpu_t *cpu, gbc_graphic_t *graphic, gbc_timer_t *timer);
+void gbc_scheduler_begin_frame(gbc_scheduler_t *sched, uint64_t cycles);
+void gbc_scheduler_end_frame(gbc_scheduler_t *sched);
+uint64_t gbc_scheduler_next_event(gbc_scheduler_t *sched);
+void gbc_scheduler_advance(gbc_scheduler_t *sched, uint64_t cycles);
+uint64_t gbc_scheduler_skip_halt(gbc_scheduler_t *sched);
+
+#endif
@@ -0,0 +1,566 @@
+#include <stdio.h>
+#include <string.h>
+#include "state.h"
+#include "common.h"
+#include "utils.h"
+
+#define STATE_MAX_CHUNKS 16
+#define STATE_ALIGN(size) (((size) + 7) & ~(size_t)7)
+
+typedef struct state_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t size;          /* whole state, header included */
+} state_header_t;
+
+typedef struct state_chunk_header {
+    uint32_t id;
+    uint32_t size;
+} state_chunk_header_t;
+
+/* A field wired up at connect time: zeroed on save, kept from the live struct on load */
+typedef struct state_field {
+    uint16_t offset;
+    uint16_t size;
+} state_field_t;
+
+#define STATE_FIELD(type, field) { offsetof(type, field), sizeof(((type*)0)->field) }
+
+typedef struct state_chunk {
+    uint32_t id;
+    void *data;
+    size_t size;
+    const state_field_t *wiring;    /* sorted by offset */
+    int wiring_count;
+    uint64_t *dirty;                /* data chunks: pages written since the last snapshot */
+    gbc_cow_table_t *cow;           /* data chunks: pages still shared with forks */
+} state_chunk_t;
+
+static const state_field_t cpu_wiring[] = {
+    STATE_FIELD(gbc_cpu_t, mem_read),
+    STATE_FIELD(gbc_cpu_t, mem_write),
+    STATE_FIELD(gbc_cpu_t, mem_data),
+    STATE_FIELD(gbc_cpu_t, ifp),
+};
+
+static const state_field_t mem_wiring[] = {
+    STATE_FIELD(gbc_memory_t, read),
+    STATE_FIELD(gbc_memory_t, write),
+    STATE_FIELD(gbc_memory_t, map),
+    STATE_FIELD(gbc_memory_t, wram),
+    STATE_FIELD(gbc_memory_t, wram_banks),
+    STATE_FIELD(gbc_memory_t, wram_dirty),
+    STATE_FIELD(gbc_memory_t, wram_cow),
+};
+
+static const state_field_t graphic_wiring[] = {
+    STATE_FIELD(gbc_graphic_t, vram),
+    STATE_FIELD(gbc_graphic_t, vram_banks),
+    STATE_FIELD(gbc_graphic_t, vram_dirty),
+    STATE_FIELD(gbc_graphic_t, vram_cow),
+    STATE_FIELD(gbc_graphic_t, screen_udata),
+    STATE_FIELD(gbc_graphic_t, screen_update),
+    STATE_FIELD(gbc_graphic_t, screen_write),
+    STATE_FIELD(gbc_graphic_t, obs),
+    STATE_FIELD(gbc_graphic_t, mem),
+};
+
+static const state_field_t timer_wiring[] = {
+    STATE_FIELD(gbc_timer_t, mem),
+    STATE_FIELD(gbc_timer_t, cycles),
+    STATE_FIELD(gbc_timer_t, divp),
+    STATE_FIELD(gbc_timer_t, timap),
+    STATE_FIELD(gbc_timer_t, tmap),
+    STATE_FIELD(gbc_timer_t, tacp),
+};
+
+/* the bank pointer cache is wiring too, it is rebuilt from the registers */
+static const state_field_t mbc_wiring[] = {
+    STATE_FIELD(gbc_mbc_t, rom_bank_size),
+    STATE_FIELD(gbc_mbc_t, ram_bank_size),
+    STATE_FIELD(gbc_mbc_t, write),
+    STATE_FIELD(gbc_mbc_t, ram_read),
+    STATE_FIELD(gbc_mbc_t, ram_write),
+    STATE_FIELD(gbc_mbc_t, rom_bank0),
+    STATE_FIELD(gbc_mbc_t, rom_bankn),
+    STATE_FIELD(gbc_mbc_t, ram_base),
+    STATE_FIELD(gbc_mbc_t, mem),
+    STATE_FIELD(gbc_mbc_t, cart),
+    STATE_FIELD(gbc_mbc_t, rom_banks),
+    STATE_FIELD(gbc_mbc_t, rom_bank_map),
+    STATE_FIELD(gbc_mbc_t, ram_banks),
+    STATE_FIELD(gbc_mbc_t, ram_size),
+    STATE_FIELD(gbc_mbc_t, battery),
+    STATE_FIELD(gbc_mbc_t, ram_dirty),
+    STATE_FIELD(gbc_mbc_t, ram_cow),
+    STATE_FIELD(gbc_mbc_t, rtc.present),
+    STATE_FIELD(gbc_mbc_t, rtc.cpu),
+    STATE_FIELD(gbc_mbc_t, rtc.save),
+    STATE_FIELD(gbc_mbc_t, rtc.save_offset),
+    STATE_FIELD(gbc_mbc_t, rtc.battery),
+};
+
+#define STATE_CHUNK(chunks, n, _id, _data, _size, _wiring, _count, _dirty, _cow) do {     \
+        chunks[n].id = (_id);                                                       \
+        chunks[n].data = (_data);                                                   \
+        chunks[n].size = (_size);                                                   \
+        chunks[n].wiring = (_wiring);                                               \
+        chunks[n].wiring_count = (_count);                                          \
+        chunks[n].dirty = (_dirty);                                                 \
+        chunks[n].cow = (_cow);                                                     \
+        n++;                                                                        \
+    } while (0)
+
+#define STATE_STRUCT_CHUNK(chunks, n, id, data, type, wiring) \
+    STATE_CHUNK(chunks, n, id, data, sizeof(type), wiring, (int)(sizeof(wiring) / sizeof(state_field_t)), NULL, NULL)
+
+#define STATE_DATA_CHUNK(chunks, n, id, data, size, dirty, cow) \
+    STATE_CHUNK(chunks, n, id, data, size, NULL, 0, dirty, cow)
+
+static int state_chunks(const gbc_state_components_t *c, state_chunk_t *chunks)
+{
+    int n = 0;
+
+    if (c->cpu)
+        STATE_STRUCT_CHUNK(chunks, n, STATE_CHUNK_CPU, c->cpu, gbc_cpu_t, cpu_wiring);
+    if (c->mem) {
+        STATE_STRUCT_CHUNK(chunks, n, STATE_CHUNK_MEM, c->mem, gbc_memory_t, mem_wiring);
+        STATE_DATA_CHUNK(chunks, n, STATE_CHUNK_WRAM, c->mem->wram, (size_t)c->mem->wram_banks * WRAM_BANK_SIZE, c->mem->wram_dirty, &c->mem->wram_cow);
+    }
+    if (c->graphic) {
+        STATE_STRUCT_CHUNK(chunks, n, STATE_CHUNK_GFX, c->graphic, gbc_graphic_t, graphic_wiring);
+        STATE_DATA_CHUNK(chunks, n, STATE_CHUNK_VRAM, c->graphic->vram, (size_t)c->graphic->vram_banks * VRAM_BANK_SIZE, c->graphic->vram_dirty, &c->graphic->vram_cow);
+    }
+    if (c->timer)
+        STATE_STRUCT_CHUNK(chunks, n, STATE_CHUNK_TIMER, c->timer, gbc_timer_t, timer_wiring);
+    if (c->mbc) {
+        STATE_STRUCT_CHUNK(chunks, n, STATE_CHUNK_MBC, c->mbc, gbc_mbc_t, mbc_wiring);
+        STATE_DATA_CHUNK(chunks, n, STATE_CHUNK_CRAM, c->mbc->ram_banks, c->mbc->ram_size, c->mbc->ram_dirty, &c->mbc->ram_cow);
+    }
+    if (c->audio)
+        STATE_DATA_CHUNK(chunks, n, STATE_CHUNK_APU, c->audio, sizeof(gbc_audio), NULL, NULL);
+
+    return n;
+}
+
+size_t gbc_state_size(const gbc_state_components_t *c)
+{
+    state_chunk_t chunks[STATE_MAX_CHUNKS];
+    int n = state_chunks(c, chunks);
+    size_t size = sizeof(state_header_t) + sizeof(state_chunk_header_t);
+
+    for (int i = 0; i < n; i++)
+        size += sizeof(state_chunk_header_t) + STATE_ALIGN(chunks[i].size);
+    return size;
+}
+
+static void clear_dirty(const gbc_state_components_t *c)
+{
+    if (c->mem)
+        DIRTY_CLEAR(c->mem->wram_dirty);
+    if (c->graphic)
+        DIRTY_CLEAR(c->graphic->vram_dirty);
+    if (c->mbc)
+        DIRTY_CLEAR(c->mbc->ram_dirty);
+}
+
+/* after a load every page differs from whatever snapshot was taken last */
+static void set_dirty(const gbc_state_components_t *c)
+{
+    if (c->mem)
+        DIRTY_SET_ALL(c->mem->wram_dirty);
+    if (c->graphic)
+        DIRTY_SET_ALL(c->graphic->vram_dirty);
+    if (c->mbc)
+        DIRTY_SET_ALL(c->mbc->ram_dirty);
+}
+
+/* Shared pages are dropped without copying, before the regions are overwritten whole */
+static void release_regions(const gbc_state_components_t *c)
+{
+    if (c->mem)
+        gbc_cow_release(&c->mem->wram_cow, c->mem->wram);
+    if (c->graphic)
+        gbc_cow_release(&c->graphic->vram_cow, c->graphic->vram);
+    if (c->mbc)
+        gbc_cow_release(&c->mbc->ram_cow, c->mbc->ram_banks);
+}
+
+/* A data chunk as the machine sees it: a forked region reads some pages from its
+ * relatives, which snapshots and hashes read in place instead of unsharing them */
+static const uint8_t* chunk_ptr(const state_chunk_t *chunk, size_t offset)
+{
+    const uint8_t *data = (const uint8_t*)chunk->data;
+    return chunk->cow ? gbc_cow_ptr(chunk->cow, data, offset) : data + offset;
+}
+
+/* Copies the dirty pages of a data chunk to 'out', or back from 'in' when 'out' is NULL.
+ * Dirty pages are smaller than COW pages, so each one lies in a single shared page. */
+static void copy_dirty(const state_chunk_t *chunk, uint8_t *out, const uint8_t *in)
+{
+    uint8_t *data = (uint8_t*)chunk->data;
+
+    for (size_t w = 0; w < DIRTY_WORDS(chunk->size); w++) {
+        uint64_t bits = chunk->dirty[w];
+        while (bits) {
+            size_t offset = ((w << 6) + __builtin_ctzll(bits)) << DIRTY_PAGE_SHIFT;
+            bits &= bits - 1;
+            if (offset >= chunk->size)
+                break;
+
+            size_t length = offset + DIRTY_PAGE_SIZE > chunk->size ? chunk->size - offset : DIRTY_PAGE_SIZE;
+            if (out) {
+                memcpy(out + offset, chunk_ptr(chunk, offset), length);
+            } else {
+                if (chunk->cow)
+                    COW_TOUCH(chunk->cow, data, offset);
+                memcpy(data + offset, in + offset, length);
+            }
+        }
+    }
+}
+
+/* With 'incremental', data chunks only get the pages written since the last snapshot */
+static void write_chunks(const gbc_state_components_t *c, uint8_t *buf, size_t total, uint8_t incremental)
+{
+    state_chunk_t chunks[STATE_MAX_CHUNKS];
+    int n = state_chunks(c, chunks);
+    uint8_t *p = buf;
+
+    state_header_t header = { STATE_MAGIC, STATE_VERSION, total };
+    memcpy(p, &header, sizeof(header));
+    p += sizeof(header);
+
+    for (int i = 0; i < n; i++) {
+        state_chunk_header_t ch = { chunks[i].id, chunks[i].size };
+        memcpy(p, &ch, sizeof(ch));
+        p += sizeof(ch);
+
+        if (incremental && chunks[i].dirty) {
+            copy_dirty(chunks + i, p, NULL);
+        } else if (chunks[i].cow) {
+            gbc_cow_copy_out(chunks[i].cow, chunks[i].data, p, chunks[i].size);
+            memset(p + chunks[i].size, 0, STATE_ALIGN(chunks[i].size) - chunks[i].size);
+        } else {
+            memcpy(p, chunks[i].data, chunks[i].size);
+            for (int f = 0; f < chunks[i].wiring_count; f++)
+                memset(p + chunks[i].wiring[f].offset, 0, chunks[i].wiring[f].size);
+            memset(p + chunks[i].size, 0, STATE_ALIGN(chunks[i].size) - chunks[i].size);
+        }
+        p += STATE_ALIGN(chunks[i].size);
+    }
+
+    state_chunk_header_t end = { STATE_CHUNK_END, 0 };
+    memcpy(p, &end, sizeof(end));
+}
+
+/* Returns the bytes written, 0 if 'size' is too small. The dirty pages are left alone:
+ * they belong to the buffer gbc_state_update and gbc_state_restore work against. */
+size_t gbc_state_save(const gbc_state_components_t *c, uint8_t *buf, size_t size)
+{
+    size_t total = gbc_state_size(c);
+
+    if (size < total)
+        return 0;
+
+    write_chunks(c, buf, total, 0);
+    return total;
+}
+
+/* Brings 'buf', the last state saved or updated from these components, up to date by
+ * copying only the dirty pages of WRAM, VRAM and cartridge RAM. */
+size_t gbc_state_update(const gbc_state_components_t *c, uint8_t *buf, size_t size)
+{
+    size_t total = gbc_state_size(c);
+    state_header_t header;
+
+    if (size < total)
+        return 0;
+
+    memcpy(&header, buf, sizeof(header));
+    write_chunks(c, buf, total,
+        header.magic == STATE_MAGIC && header.version == STATE_VERSION && header.size == total);
+    clear_dirty(c);
+    return total;
+}
+
+/* everything but the wiring */
+static void load_chunk(const state_chunk_t *chunk, const uint8_t *src)
+{
+    uint8_t *dst = (uint8_t*)chunk->data;
+    size_t pos = 0;
+
+    for (int f = 0; f < chunk->wiring_count; f++) {
+        const state_field_t *field = chunk->wiring + f;
+        memcpy(dst + pos, src + pos, field->offset - pos);
+        pos = field->offset + field->size;
+    }
+    memcpy(dst + pos, src + pos, chunk->size - pos);
+}
+
+/* Nothing is changed unless every chunk the components need is present with the
+ * size the live machine has. Unknown chunks are skipped. */
+int gbc_state_load(const gbc_state_components_t *c, const uint8_t *buf, size_t size)
+{
+    state_chunk_t chunks[STATE_MAX_CHUNKS];
+    const uint8_t *found[STATE_MAX_CHUNKS] = { 0 };
+    int n = state_chunks(c, chunks);
+    state_header_t header;
+    state_chunk_header_t ch;
+
+    if (size < sizeof(header))
+        return -1;
+    memcpy(&header, buf, sizeof(header));
+    if (header.magic != STATE_MAGIC || header.version != STATE_VERSION || header.size > size) {
+        LOG_ERROR("[STATE] not a version %d state\n", STATE_VERSION);
+        return -1;
+    }
+
+    const uint8_t *p = buf + sizeof(header);
+    const uint8_t *end = buf + header.size;
+    while (p + sizeof(ch) <= end) {
+        memcpy(&ch, p, sizeof(ch));
+        p += sizeof(ch);
+        if (ch.id == STATE_CHUNK_END)
+            break;
+        if (STATE_ALIGN(ch.size) > (size_t)(end - p))
+            return -1;
+
+        for (int i = 0; i < n; i++) {
+            if (chunks[i].id != ch.id)
+                continue;
+            if (ch.size != chunks[i].size) {
+                LOG_ERROR("[STATE] chunk %.4s is %u bytes, expected %zu\n",
+                    (char*)&ch.id, ch.size, chunks[i].size);
+                return -1;
+            }
+            found[i] = p;
+        }
+        p += STATE_ALIGN(ch.size);
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (!found[i]) {
+            LOG_ERROR("[STATE] chunk %.4s is missing\n", (char*)&chunks[i].id);
+            return -1;
+        }
+    }
+
+    /* the state must come from the same kind of cartridge */
+    if (c->mbc) {
+        for (int i = 0; i < n; i++) {
+            if (chunks[i].id == STATE_CHUNK_MBC &&
+                found[i][offsetof(gbc_mbc_t, type)] != c->mbc->type)
+                return -1;
+        }
+    }
+
+    release_regions(c);
+    for (int i = 0; i < n; i++)
+        load_chunk(chunks + i, found[i]);
+
+    set_dirty(c);
+
+    if (c->mbc) {
+        gbc_mbc_update_banks(c->mbc);
+        if (c->mbc->battery) {
+            for (uint32_t offset = 0; offset < c->mbc->ram_size; offset += c->mbc->battery->page_size)
+                gbc_battery_mark(c->mbc->battery, offset);
+        }
+    }
+
+    return 0;
+}
+
+/* cartridge RAM pages about to be copied back must reach the .sav too */
+static void mark_battery_dirty(gbc_mbc_t *mbc)
+{
+    for (size_t w = 0; w < DIRTY_WORDS(MAX_RAM_SIZE); w++) {
+        uint64_t bits = mbc->ram_dirty[w];
+        while (bits) {
+            uint32_t offset = ((w << 6) + __builtin_ctzll(bits)) << DIRTY_PAGE_SHIFT;
+            bits &= bits - 1;
+            if (offset < mbc->ram_size)
+                gbc_battery_mark(mbc->battery, offset);
+        }
+    }
+}
+
+#ifdef DEBUG
+/* A store that skipped the write macros leaves its page clean, so the restore misses it */
+static void verify_restore(const state_chunk_t *chunks, int n, const uint8_t *buf)
+{
+    const uint8_t *p = buf + sizeof(state_header_t);
+
+    for (int i = 0; i < n; i++) {
+        size_t pos = 0;
+
+        p += sizeof(state_chunk_header_t);
+        for (int f = 0; f <= chunks[i].wiring_count; f++) {
+            size_t end = f < chunks[i].wiring_count ? chunks[i].wiring[f].offset : chunks[i].size;
+            for (size_t b = pos; b < end; b++) {
+                if (*chunk_ptr(chunks + i, b) != p[b]) {
+                    LOG_ERROR("[STATE] restore left %.4s+%zu different, a write bypassed the dirty pages\n",
+                        (const char*)&chunks[i].id, b);
+                    return;
+                }
+            }
+            if (f < chunks[i].wiring_count)
+                pos = chunks[i].wiring[f].offset + chunks[i].wiring[f].size;
+        }
+        p += STATE_ALIGN(chunks[i].size);
+    }
+}
+#endif
+
+/* Undoes everything since 'buf' was last saved or updated from these same components:
+ * the structs are reloaded and only the pages written since then are copied back, so
+ * the cost follows what the machine touched. Afterwards the live machine matches 'buf'
+ * and nothing is dirty, which keeps the next gbc_state_update small too. */
+int gbc_state_restore(const gbc_state_components_t *c, const uint8_t *buf, size_t size)
+{
+    state_chunk_t chunks[STATE_MAX_CHUNKS];
+    int n = state_chunks(c, chunks);
+    size_t total = gbc_state_size(c);
+    state_header_t header;
+
+    if (size < total)
+        return -1;
+    memcpy(&header, buf, sizeof(header));
+    if (header.magic != STATE_MAGIC || header.version != STATE_VERSION || header.size != total)
+        return -1;
+
+    if (c->mbc && c->mbc->battery)
+        mark_battery_dirty(c->mbc);
+
+    /* only the pages copied back are unshared */
+    const uint8_t *p = buf + sizeof(header);
+    for (int i = 0; i < n; i++) {
+        p += sizeof(state_chunk_header_t);
+        if (chunks[i].dirty)
+            copy_dirty(chunks + i, NULL, p);
+        else
+            load_chunk(chunks + i, p);
+        p += STATE_ALIGN(chunks[i].size);
+    }
+
+    clear_dirty(c);
+    if (c->mbc)
+        gbc_mbc_update_banks(c->mbc);
+#ifdef DEBUG
+    verify_restore(chunks, n, buf);
+#endif
+    return 0;
+}
+
+/* Hash of what gbc_state_save would write, without a buffer and without clearing the
+ * dirty pages, so it can run next to incremental snapshots. Data chunks are hashed one
+ * COW page at a time, read in place, so a fork hashes the same as an unshared copy. */
+uint64_t gbc_state_hash(const gbc_state_components_t *c)
+{
+    state_chunk_t chunks[STATE_MAX_CHUNKS];
+    int n = state_chunks(c, chunks);
+    uint64_t hash = STATE_VERSION;
+
+    for (int i = 0; i < n; i++) {
+        const uint8_t *data = (const uint8_t*)chunks[i].data;
+        size_t pos = 0;
+
+        hash = hash64(&chunks[i].id, sizeof(chunks[i].id), hash);
+        if (chunks[i].cow) {
+            for (size_t offset = 0; offset < chunks[i].size; offset += COW_PAGE_SIZE) {
+                size_t length = chunks[i].size - offset < COW_PAGE_SIZE ? chunks[i].size - offset : COW_PAGE_SIZE;
+                hash = hash64(chunk_ptr(chunks + i, offset), length, hash);
+            }
+            continue;
+        }
+
+        for (int f = 0; f < chunks[i].wiring_count; f++) {
+            const state_field_t *field = chunks[i].wiring + f;
+            hash = hash64(data + pos, field->offset - pos, hash);
+            pos = field->offset + field->size;
+        }
+        hash = hash64(data + pos, chunks[i].size - pos, hash);
+    }
+
+    return hash;
+}
+
+static void relocate_pointer(void *field, uintptr_t from, size_t size, intptr_t delta)
+{
+    uintptr_t ptr;
+
+    memcpy(&ptr, field, sizeof(ptr));
+    if (ptr >= from && ptr - from < size) {
+        ptr += delta;
+        memcpy(field, &ptr, sizeof(ptr));
+    }
+}
+
+/* After the machine spanning [from, from + size) was copied byte for byte to 'to', points
+ * the copy's wiring back into the copy. 'c' are the copy's components. Pointers leaving
+ * the machine (ROM, heap regions, callbacks) are kept. */
+void gbc_state_relocate(const gbc_state_components_t *c, const void *from, size_t size, void *to)
+{
+    state_chunk_t chunks[STATE_MAX_CHUNKS];
+    int n = state_chunks(c, chunks);
+    intptr_t delta = (uint8_t*)to - (const uint8_t*)from;
+
+    for (int i = 0; i < n; i++) {
+        for (int f = 0; f < chunks[i].wiring_count; f++) {
+            const state_field_t *field = chunks[i].wiring + f;
+            if (field->size == sizeof(void*))
+                relocate_pointer((uint8_t*)chunks[i].data + field->offset, (uintptr_t)from, size, delta);
+        }
+    }
+
+    /* the memory map is wiring too, its entries point at the components */
+    if (c->mem) {
+        for (int e = 0; e < MEMORY_MAP_ENTRIES; e++)
+            relocate_pointer(&c->mem->map[e].udata, (uintptr_t)from, size, delta);
+    }
+}
+
+int gbc_state_save_file(const gbc_state_components_t *c, const char *path)
+{
+    size_t size = gbc_state_size(c);
+    uint8_t *buf = malloc_memory(size);
+    if (!buf)
+        return -1;
+
+    gbc_state_save(c, buf, size);
+
+    FILE *fp = fopen(path, "wb");
+    int ok = fp && fwrite(buf, 1, size, fp) == size;
+    if (fp && fclose(fp))
+        ok = 0;
+    free_memory(buf);
+
+    if (!ok) {
+        LOG_ERROR("[STATE] failed to write %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+int gbc_state_load_file(const gbc_state_components_t *c, const char *path)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        LOG_ERROR("[STATE] cannot open %s\n", path);
+        return -1;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    uint8_t *buf = size > 0 ? malloc_memory(size) : NULL;
+    int ret = -1;
+    if (buf && fread(buf, 1, size, fp) == (size_t)size)
+        ret = gbc_state_load(c, buf, size);
+
+    fclose(fp);
+    free_memory(buf);
+    return ret;
+}
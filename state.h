@@ -0,0 +1,50 @@
+#ifndef STATE_H
+#define STATE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "cpu.h"
+#include "memory.h"
+#include "graphics.h"
+#include "timers.h"
+#include "mbc.h"
+#include "audio.h"
+
+#define STATE_MAGIC   0x4554415453434247ULL    /* "GBCSTATE" */
+#define STATE_VERSION 3                         /* bump when a component struct changes */
+
+#define STATE_CHUNK_ID(a, b, c, d) ((uint32_t)(a) | ((uint32_t)(b) << 8) | ((uint32_t)(c) << 16) | ((uint32_t)(d) << 24))
+
+#define STATE_CHUNK_CPU   STATE_CHUNK_ID('C', 'P', 'U', ' ')
+#define STATE_CHUNK_MEM   STATE_CHUNK_ID('M', 'E', 'M', ' ')
+#define STATE_CHUNK_WRAM  STATE_CHUNK_ID('W', 'R', 'A', 'M')
+#define STATE_CHUNK_GFX   STATE_CHUNK_ID('G', 'F', 'X', ' ')
+#define STATE_CHUNK_VRAM  STATE_CHUNK_ID('V', 'R', 'A', 'M')
+#define STATE_CHUNK_TIMER STATE_CHUNK_ID('T', 'I', 'M', 'R')
+#define STATE_CHUNK_MBC   STATE_CHUNK_ID('M', 'B', 'C', ' ')
+#define STATE_CHUNK_CRAM  STATE_CHUNK_ID('C', 'R', 'A', 'M')
+#define STATE_CHUNK_APU   STATE_CHUNK_ID('A', 'P', 'U', ' ')
+#define STATE_CHUNK_END   STATE_CHUNK_ID('E', 'N', 'D', ' ')
+
+/* The parts of the machine a state covers. NULL components are left out on save and
+ * must be NULL on load too. */
+typedef struct gbc_state_components {
+    gbc_cpu_t *cpu;
+    gbc_memory_t *mem;
+    gbc_graphic_t *graphic;
+    gbc_timer_t *timer;
+    gbc_mbc_t *mbc;
+    gbc_audio *audio;
+} gbc_state_components_t;
+
+size_t gbc_state_size(const gbc_state_components_t *c);
+size_t gbc_state_save(const gbc_state_components_t *c, uint8_t *buf, size_t size);
+size_t gbc_state_update(const gbc_state_components_t *c, uint8_t *buf, size_t size);
+int gbc_state_load(const gbc_state_components_t *c, const uint8_t *buf, size_t size);
+uint64_t gbc_state_hash(const gbc_state_components_t *c);
+int gbc_state_restore(const gbc_state_components_t *c, const uint8_t *buf, size_t size);
+int gbc_state_save_file(const gbc_state_components_t *c, const char *path);
+int gbc_state_load_file(const gbc_state_components_t *c, const char *path);
+void gbc_state_relocate(const gbc_state_components_t *c, const void *from, size_t size, void *to);
+
+#endif
@@ -0,0 +1,172 @@
+#include <string.h>
+#include "timers.h"
+#include "common.h"
+
+static const uint16_t tac_cycles[4] = {
+    TAC_MODE_0_CYCLES, TAC_MODE_1_CYCLES, TAC_MODE_2_CYCLES, TAC_MODE_3_CYCLES
+};
+
+#define TAC_PERIOD(tac) (tac_cycles[(tac) & TAC_TIMER_SPEED_MASK])
+
+/* TIMA increments on the falling edge of the system counter bit at half the period */
+#define TAC_SIGNAL(tac, counter) \
+    (((tac) & TAC_TIMER_ENABLE) && ((counter) & (TAC_PERIOD(tac) >> 1)))
+
+static void timer_tick(gbc_timer_t *timer, uint64_t ticks)
+{
+    uint8_t tima = *timer->timap;
+    uint8_t tma = *timer->tmap;
+
+    if (ticks < (uint64_t)(256 - tima)) {
+        *timer->timap = tima + ticks;
+        return;
+    }
+
+    /* overflow reloads TMA, after which it overflows every 256 - TMA ticks */
+    ticks -= 256 - tima;
+    *timer->timap = tma + ticks % (256 - tma);
+    REQUEST_INTERRUPT(timer->mem, INTERRUPT_TIMER);
+}
+
+static void timer_schedule(gbc_timer_t *timer)
+{
+    uint8_t tac = *timer->tacp;
+
+    if (!(tac & TAC_TIMER_ENABLE)) {
+        timer->next_event = TIMER_NO_EVENT;
+        return;
+    }
+
+    uint64_t period = TAC_PERIOD(tac);
+    uint64_t counter = timer->tima_base - timer->div_base;
+    uint64_t edges = counter / period + (256 - *timer->timap);
+
+    timer->next_event = timer->div_base + edges * period;
+}
+
+/* Bring TIMA and the DIV port up to 'now' */
+static void timer_sync(gbc_timer_t *timer, uint64_t now)
+{
+    uint8_t tac = *timer->tacp;
+
+    if (tac & TAC_TIMER_ENABLE) {
+        uint64_t period = TAC_PERIOD(tac);
+        uint64_t ticks = (now - timer->div_base) / period - (timer->tima_base - timer->div_base) / period;
+        if (ticks)
+            timer_tick(timer, ticks);
+    }
+
+    timer->tima_base = now;
+    *timer->divp = ((now - timer->div_base) >> 8) & UINT8_MASK;
+}
+
+void gbc_timer_init(gbc_timer_t *timer)
+{
+    memset(timer, 0, sizeof(gbc_timer_t));
+    timer->next_event = TIMER_NO_EVENT;
+}
+
+static uint8_t timer_read(void *udata, uint16_t addr)
+{
+    return gbc_timer_read((gbc_timer_t*)udata, IO_ADDR_PORT(addr));
+}
+
+static uint8_t timer_write(void *udata, uint16_t addr, uint8_t data)
+{
+    gbc_timer_write((gbc_timer_t*)udata, IO_ADDR_PORT(addr), data);
+    return 0;
+}
+
+void gbc_timer_connect(gbc_timer_t *timer, gbc_memory_t *mem, gbc_cpu_t *cpu)
+{
+    timer->mem = mem;
+    timer->cycles = &cpu->cycles;
+
+    timer->divp = connect_io_port(mem, IO_PORT_ADDR(IO_PORT_DIV));
+    timer->timap = connect_io_port(mem, IO_PORT_ADDR(IO_PORT_TIMA));
+    timer->tmap = connect_io_port(mem, IO_PORT_ADDR(IO_PORT_TMA));
+    timer->tacp = connect_io_port(mem, IO_PORT_ADDR(IO_PORT_TAC));
+
+    timer->div_base = cpu->cycles;
+    timer->tima_base = cpu->cycles;
+    timer_schedule(timer);
+
+    memory_map_entry_t entry;
+    entry.id = TIMER_ID;
+    entry.addr_begin = TIMER_BEGIN;
+    entry.addr_end = TIMER_END;
+    entry.read = timer_read;
+    entry.write = timer_write;
+    entry.udata = timer;
+
+    register_memory_map(mem, &entry);
+}
+
+/* Only does work on the cycle TIMA overflows */
+void gbc_timer_cycle(gbc_timer_t *timer)
+{
+    uint64_t now = *timer->cycles;
+
+    if (now < timer->next_event)
+        return;
+
+    timer_sync(timer, now);
+    timer_schedule(timer);
+}
+
+uint8_t gbc_timer_read(gbc_timer_t *timer, uint8_t port)
+{
+    timer_sync(timer, *timer->cycles);
+    timer_schedule(timer);
+
+    switch (port) {
+    case IO_PORT_DIV:
+        return *timer->divp;
+    case IO_PORT_TIMA:
+        return *timer->timap;
+    case IO_PORT_TMA:
+        return *timer->tmap;
+    case IO_PORT_TAC:
+        return *timer->tacp | 0xF8;
+    }
+
+    LOG_ERROR("[TIMER] read from invalid port %02x\n", port);
+    return 0xFF;
+}
+
+void gbc_timer_write(gbc_timer_t *timer, uint8_t port, uint8_t data)
+{
+    uint64_t now = *timer->cycles;
+    uint64_t counter = now - timer->div_base;
+    uint8_t tac = *timer->tacp;
+
+    timer_sync(timer, now);
+
+    switch (port) {
+    case IO_PORT_DIV:
+        /* resetting the counter is a falling edge if the selected bit was set */
+        if (TAC_SIGNAL(tac, counter))
+            timer_tick(timer, 1);
+        timer->div_base = now;
+        *timer->divp = 0;
+        break;
+    case IO_PORT_TIMA:
+        *timer->timap = data;
+        break;
+    case IO_PORT_TMA:
+        *timer->tmap = data;
+        break;
+    case IO_PORT_TAC:
+        /* disabling or switching to a bit that is low can also produce a falling edge */
+        if (TAC_SIGNAL(tac, counter) && !TAC_SIGNAL(data, counter))
+            timer_tick(timer, 1);
+        *timer->tacp = data & (TAC_TIMER_ENABLE | TAC_TIMER_SPEED_MASK);
+        break;
+    default:
+        LOG_ERROR("[TIMER] write to invalid port %02x\n", port);
+        return;
+    }
+
+    timer->tima_base = now;
+    timer_schedule(timer);
+}
@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include "memory.h"
+#include "cpu.h"
 
 #define TICK_DIVIDER 256      /* 16384Hz in cpu normal mode, equivalent to 256 cpu cycles */
 
@@ -16,13 +17,19 @@
 
 #define TAC_MODE_0_CYCLES  1024  // 4096 Hz
 #define TAC_MODE_1_CYCLES  16    // 262144 Hz
-#define TAC_MODE_2_CYCLES  48   // 65536 Hz
+#define TAC_MODE_2_CYCLES  64    // 65536 Hz
 #define TAC_MODE_3_CYCLES  256   // 16384 Hz
 
+#define TIMER_NO_EVENT UINT64_MAX
+
+/* DIV and TIMA are derived from the cpu cycle counter on access instead of being ticked.
+ * https://gbdev.io/pandocs/Timer_Obscure_Behaviour.html */
 typedef struct gbc_timer {
     gbc_memory_t *mem;
-    uint16_t div_cycles;
-    uint16_t timer_cycles;
+    uint64_t *cycles;       /* cpu->cycles */
+    uint64_t div_base;      /* cycle the 16-bit system counter was last reset */
+    uint64_t tima_base;     /* cycle TIMA was last brought up to date */
+    uint64_t next_event;    /* cycle of the next TIMA overflow, TIMER_NO_EVENT while TAC is disabled */
     uint8_t *divp;
     uint8_t *timap;
     uint8_t *tmap;
@@ -31,7 +38,9 @@ typedef struct gbc_timer {
 } gbc_timer_t;
 
 void gbc_timer_init(gbc_timer_t *timer);
-void gbc_timer_connect(gbc_timer_t *timer, gbc_memory_t *mem);
+void gbc_timer_connect(gbc_timer_t *timer, gbc_memory_t *mem, gbc_cpu_t *cpu);
 void gbc_timer_cycle(gbc_timer_t *timer);
+uint8_t gbc_timer_read(gbc_timer_t *timer, uint8_t port);
+void gbc_timer_write(gbc_timer_t *timer, uint8_t port, uint8_t data);
 
-#endif 
+#endif
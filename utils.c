@@ -1,5 +1,6 @@
 #include "utils.h"
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
 void *malloc_memory(size_t size){
@@ -15,3 +16,44 @@ uint64_t get_time(){
     clock_gettime(CLOCK_MONOTONIC, &ts);
     return ts.tv_sec * 1000000000 + ts.tv_nsec;    
 }
+
+#define HASH64_PRIME1 0x9E3779B185EBCA87ULL
+#define HASH64_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define HASH64_PRIME3 0x165667B19E3779F9ULL
+
+static inline uint64_t rotl64(uint64_t x, int r){
+    return (x << r) | (x >> (64 - r));
+}
+
+/* Non-cryptographic 64-bit content hash, 8 bytes at a time in four independent lanes */
+uint64_t hash64(const void *data, size_t size, uint64_t seed){
+    const uint8_t *p = (const uint8_t*)data;
+    const uint8_t *end = p + size;
+    uint64_t lane[4] = { seed + HASH64_PRIME1, seed + HASH64_PRIME2, seed, seed - HASH64_PRIME1 };
+    uint64_t h, w;
+
+    for (; p + 32 <= end; p += 32) {
+        for (int i = 0; i < 4; i++) {
+            memcpy(&w, p + i * 8, 8);
+            lane[i] = rotl64(lane[i] + w * HASH64_PRIME2, 31) * HASH64_PRIME1;
+        }
+    }
+
+    h = rotl64(lane[0], 1) + rotl64(lane[1], 7) + rotl64(lane[2], 12) + rotl64(lane[3], 18);
+    h += size;
+
+    for (; p + 8 <= end; p += 8) {
+        memcpy(&w, p, 8);
+        h ^= rotl64(w * HASH64_PRIME2, 31) * HASH64_PRIME1;
+        h = rotl64(h, 27) * HASH64_PRIME1 + HASH64_PRIME3;
+    }
+    for (; p < end; p++)
+        h = rotl64(h ^ (*p * HASH64_PRIME3), 11) * HASH64_PRIME1;
+
+    h ^= h >> 33;
+    h *= HASH64_PRIME2;
+    h ^= h >> 29;
+    h *= HASH64_PRIME3;
+    h ^= h >> 32;
+    return h;
+}
@@ -2,9 +2,11 @@
 #define _UTILS_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 void *malloc_memory(size_t size);
 void free_memory(void *ptr);
 
 uint64_t get_time();
+uint64_t hash64(const void *data, size_t size, uint64_t seed);
 #endif
\ No newline at end of file